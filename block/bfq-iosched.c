@@ -123,16 +123,67 @@
 #include <linux/sbitmap.h>
 #include <linux/delay.h>
 #include <linux/backing-dev.h>
+#include <linux/jump_label.h>
 
 #include <trace/events/block.h>
 
 #include "elevator.h"
 #include "blk.h"
 #include "blk-mq.h"
+#include "blk-mq-debugfs.h"
 #include "blk-mq-sched.h"
 #include "bfq-iosched.h"
 #include "blk-wbt.h"
 
+/* Maximum number of requests inserted per bfqd->lock hold */
+#define BFQ_INSERT_BATCH	16
+
+#ifdef CONFIG_BLK_DEBUG_FS
+/*
+ * Hook timing is off until enabled through the op_stats debugfs attribute
+ * of a device, and the key keeps the hooks of all other devices free of
+ * clock reads while none is timed.
+ */
+static DEFINE_STATIC_KEY_FALSE(bfq_op_timing_key);
+static DEFINE_MUTEX(bfq_op_timing_mutex);
+
+static inline u64 bfq_op_start(struct bfq_data *bfqd)
+{
+	if (!static_branch_unlikely(&bfq_op_timing_key) ||
+	    !READ_ONCE(bfqd->op_timing))
+		return 0;
+	return ktime_get_ns();
+}
+
+static inline void bfq_op_end(struct bfq_data *bfqd, enum bfq_op op,
+			      u64 start)
+{
+	if (!start)
+		return;
+	this_cpu_inc(bfqd->op_stats->nr[op]);
+	this_cpu_add(bfqd->op_stats->ns[op], ktime_get_ns() - start);
+}
+
+static inline void bfq_op_merge_skipped(struct bfq_data *bfqd)
+{
+	this_cpu_inc(bfqd->op_stats->merge_skipped);
+}
+#else
+static inline u64 bfq_op_start(struct bfq_data *bfqd)
+{
+	return 0;
+}
+
+static inline void bfq_op_end(struct bfq_data *bfqd, enum bfq_op op,
+			      u64 start)
+{
+}
+
+static inline void bfq_op_merge_skipped(struct bfq_data *bfqd)
+{
+}
+#endif /* CONFIG_BLK_DEBUG_FS */
+
 #define BFQ_BFQQ_FNS(name)						\
 void bfq_mark_bfqq_##name(struct bfq_queue *bfqq)			\
 {									\
@@ -2447,6 +2498,20 @@ static bool bfq_bio_merge(struct request_queue *q, struct bio *bio,
 {
 	struct bfq_data *bfqd = q->elevator->elevator_data;
 	struct request *free = NULL;
+	struct bfq_io_cq *bic;
+	bool ret;
+	u64 start;
+
+	/*
+	 * Only requests queued in bfq_queues are merge candidates. If
+	 * there are none, which is the common case on devices that keep
+	 * up with their load, don't bother with the locks. A racing
+	 * insertion can only cost a missed merge.
+	 */
+	if (!READ_ONCE(bfqd->queued))
+		return false;
+
+	start = bfq_op_start(bfqd);
 	/*
 	 * bfq_bic_lookup grabs the queue_lock: invoke it now and
 	 * store its return value for later use, to avoid nesting
@@ -2454,10 +2519,21 @@ static bool bfq_bio_merge(struct request_queue *q, struct bio *bio,
 	 * returned by bfq_bic_lookup does not go away before
 	 * bfqd->lock is taken.
 	 */
-	struct bfq_io_cq *bic = bfq_bic_lookup(q);
-	bool ret;
+	bic = bfq_bic_lookup(q);
 
-	spin_lock_irq(&bfqd->lock);
+	/*
+	 * Async writes have normally been merged in the plug already and
+	 * nobody waits for them: don't contend for bfqd->lock just to try
+	 * once more.
+	 */
+	if (!op_is_sync(bio->bi_opf)) {
+		if (!spin_trylock_irq(&bfqd->lock)) {
+			bfq_op_merge_skipped(bfqd);
+			return false;
+		}
+	} else {
+		spin_lock_irq(&bfqd->lock);
+	}
 
 	if (bic) {
 		/*
@@ -2479,6 +2555,7 @@ static bool bfq_bio_merge(struct request_queue *q, struct bio *bio,
 	if (free)
 		blk_mq_free_request(free);
 
+	bfq_op_end(bfqd, BFQ_OP_BIO_MERGE, start);
 	return ret;
 }
 
@@ -5303,6 +5380,7 @@ static struct request *bfq_dispatch_request(struct blk_mq_hw_ctx *hctx)
 	struct request *rq;
 	struct bfq_queue *in_serv_queue;
 	bool waiting_rq, idle_timer_disabled = false;
+	u64 start = bfq_op_start(bfqd);
 
 	spin_lock_irq(&bfqd->lock);
 
@@ -5320,6 +5398,7 @@ static struct request *bfq_dispatch_request(struct blk_mq_hw_ctx *hctx)
 			idle_timer_disabled ? in_serv_queue : NULL,
 				idle_timer_disabled);
 
+	bfq_op_end(bfqd, BFQ_OP_DISPATCH, start);
 	return rq;
 }
 
@@ -6236,27 +6315,25 @@ static inline void bfq_update_insert_stats(struct request_queue *q,
 
 static struct bfq_queue *bfq_init_rq(struct request *rq);
 
-static void bfq_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
-			       blk_insert_t flags)
+/*
+ * Insert @rq with bfqd->lock held. Returns false if @rq has been merged
+ * into a queued request instead, in which case it has been moved to @free.
+ */
+static bool bfq_insert_request_locked(struct request_queue *q,
+				      struct request *rq, blk_insert_t flags,
+				      struct list_head *free,
+				      bool *idle_timer_disabled)
 {
-	struct request_queue *q = hctx->queue;
 	struct bfq_data *bfqd = q->elevator->elevator_data;
 	struct bfq_queue *bfqq;
-	bool idle_timer_disabled = false;
-	blk_opf_t cmd_flags;
-	LIST_HEAD(free);
 
 #ifdef CONFIG_BFQ_GROUP_IOSCHED
 	if (!cgroup_subsys_on_dfl(io_cgrp_subsys) && rq->bio)
 		bfqg_stats_update_legacy_io(q, rq);
 #endif
-	spin_lock_irq(&bfqd->lock);
 	bfqq = bfq_init_rq(rq);
-	if (blk_mq_sched_try_insert_merge(q, rq, &free)) {
-		spin_unlock_irq(&bfqd->lock);
-		blk_mq_free_requests(&free);
-		return;
-	}
+	if (blk_mq_sched_try_insert_merge(q, rq, free))
+		return false;
 
 	trace_block_rq_insert(rq);
 
@@ -6265,13 +6342,7 @@ static void bfq_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
 	} else if (!bfqq) {
 		list_add_tail(&rq->queuelist, &bfqd->dispatch);
 	} else {
-		idle_timer_disabled = __bfq_insert_request(bfqd, rq);
-		/*
-		 * Update bfqq, because, if a queue merge has occurred
-		 * in __bfq_insert_request, then rq has been
-		 * redirected into a new queue.
-		 */
-		bfqq = RQ_BFQQ(rq);
+		*idle_timer_disabled = __bfq_insert_request(bfqd, rq);
 
 		if (rq_mergeable(rq)) {
 			elv_rqhash_add(q, rq);
@@ -6279,29 +6350,95 @@ static void bfq_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
 				q->last_merge = rq;
 		}
 	}
+	return true;
+}
+
+static void bfq_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
+			       blk_insert_t flags)
+{
+	struct request_queue *q = hctx->queue;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	struct bfq_queue *bfqq;
+	bool idle_timer_disabled = false;
+	blk_opf_t cmd_flags;
+	u64 start = bfq_op_start(bfqd);
+	LIST_HEAD(free);
+
+	spin_lock_irq(&bfqd->lock);
+	if (!bfq_insert_request_locked(q, rq, flags, &free,
+				       &idle_timer_disabled)) {
+		spin_unlock_irq(&bfqd->lock);
+		blk_mq_free_requests(&free);
+		bfq_op_end(bfqd, BFQ_OP_INSERT, start);
+		return;
+	}
 
 	/*
+	 * Update bfqq, because, if a queue merge has occurred
+	 * in __bfq_insert_request, then rq has been
+	 * redirected into a new queue.
+	 *
 	 * Cache cmd_flags before releasing scheduler lock, because rq
 	 * may disappear afterwards (for example, because of a request
 	 * merge).
 	 */
+	bfqq = RQ_BFQQ(rq);
 	cmd_flags = rq->cmd_flags;
 	spin_unlock_irq(&bfqd->lock);
 
 	bfq_update_insert_stats(q, bfqq, idle_timer_disabled,
 				cmd_flags);
+	bfq_op_end(bfqd, BFQ_OP_INSERT, start);
 }
 
 static void bfq_insert_requests(struct blk_mq_hw_ctx *hctx,
 				struct list_head *list,
 				blk_insert_t flags)
 {
+	struct request_queue *q = hctx->queue;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	LIST_HEAD(free);
+
+	/*
+	 * The per-request insert stats take the queue_lock, which must
+	 * not nest inside bfqd->lock: insert one request at a time then.
+	 */
+	if (IS_ENABLED(CONFIG_BFQ_CGROUP_DEBUG)) {
+		while (!list_empty(list)) {
+			struct request *rq;
+
+			rq = list_first_entry(list, struct request, queuelist);
+			list_del_init(&rq->queuelist);
+			bfq_insert_request(hctx, rq, flags);
+		}
+		return;
+	}
+
+	/*
+	 * Otherwise insert the whole list, typically a flushed plug, taking
+	 * bfqd->lock once per BFQ_INSERT_BATCH requests instead of once
+	 * per request.
+	 */
 	while (!list_empty(list)) {
-		struct request *rq;
+		unsigned int nr = 0;
+		u64 start = bfq_op_start(bfqd);
+
+		spin_lock_irq(&bfqd->lock);
+		while (!list_empty(list) && nr < BFQ_INSERT_BATCH) {
+			struct request *rq;
+			bool idle_timer_disabled = false;
+
+			rq = list_first_entry(list, struct request, queuelist);
+			list_del_init(&rq->queuelist);
+			bfq_insert_request_locked(q, rq, flags, &free,
+						  &idle_timer_disabled);
+			nr++;
+		}
+		spin_unlock_irq(&bfqd->lock);
 
-		rq = list_first_entry(list, struct request, queuelist);
-		list_del_init(&rq->queuelist);
-		bfq_insert_request(hctx, rq, flags);
+		blk_mq_free_requests(&free);
+		INIT_LIST_HEAD(&free);
+		bfq_op_end(bfqd, BFQ_OP_INSERT, start);
 	}
 }
 
@@ -6650,6 +6787,7 @@ static void bfq_finish_requeue_request(struct request *rq)
 	struct bfq_queue *bfqq = RQ_BFQQ(rq);
 	struct bfq_data *bfqd;
 	unsigned long flags;
+	u64 start;
 
 	/*
 	 * rq either is not associated with any icq, or is an already
@@ -6660,6 +6798,7 @@ static void bfq_finish_requeue_request(struct request *rq)
 		return;
 
 	bfqd = bfqq->bfqd;
+	start = bfq_op_start(bfqd);
 
 	if (rq->rq_flags & RQF_STARTED)
 		bfqg_stats_update_completion(bfqq_group(bfqq),
@@ -6678,6 +6817,7 @@ static void bfq_finish_requeue_request(struct request *rq)
 	bfq_put_queue(bfqq);
 	RQ_BIC(rq)->requests--;
 	spin_unlock_irqrestore(&bfqd->lock, flags);
+	bfq_op_end(bfqd, BFQ_OP_FINISH, start);
 
 	/*
 	 * Reset private fields. In case of a requeue, this allows
@@ -7170,6 +7310,11 @@ static void bfq_exit_queue(struct elevator_queue *e)
 	clear_bit(ELEVATOR_FLAG_DISABLE_WBT, &e->flags);
 	wbt_enable_default(bfqd->queue->disk);
 
+#ifdef CONFIG_BLK_DEBUG_FS
+	if (bfqd->op_timing)
+		static_branch_dec(&bfq_op_timing_key);
+	free_percpu(bfqd->op_stats);
+#endif
 	kfree(bfqd);
 }
 
@@ -7207,6 +7352,12 @@ static int bfq_init_queue(struct request_queue *q, struct elevator_type *e)
 	}
 	eq->elevator_data = bfqd;
 
+#ifdef CONFIG_BLK_DEBUG_FS
+	bfqd->op_stats = alloc_percpu(struct bfq_op_stats);
+	if (!bfqd->op_stats)
+		goto out_free;
+#endif
+
 	spin_lock_irq(&q->queue_lock);
 	q->elevator = eq;
 	spin_unlock_irq(&q->queue_lock);
@@ -7362,6 +7513,9 @@ static int bfq_init_queue(struct request_queue *q, struct elevator_type *e)
 	return 0;
 
 out_free:
+#ifdef CONFIG_BLK_DEBUG_FS
+	free_percpu(bfqd->op_stats);
+#endif
 	kfree(bfqd);
 	kobject_put(&eq->kobj);
 	return -ENOMEM;
@@ -7593,6 +7747,86 @@ static struct elv_fs_entry bfq_attrs[] = {
 	__ATTR_NULL
 };
 
+#ifdef CONFIG_BLK_DEBUG_FS
+static const char *const bfq_op_name[BFQ_OP_NR] = {
+	[BFQ_OP_INSERT]		= "insert",
+	[BFQ_OP_DISPATCH]	= "dispatch",
+	[BFQ_OP_BIO_MERGE]	= "bio_merge",
+	[BFQ_OP_FINISH]		= "finish",
+};
+
+static int bfq_op_stats_show(void *data, struct seq_file *m)
+{
+	struct request_queue *q = data;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	u64 merge_skipped = 0;
+	int op, cpu;
+
+	for (op = 0; op < BFQ_OP_NR; op++) {
+		u64 nr = 0, ns = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct bfq_op_stats *stats =
+				per_cpu_ptr(bfqd->op_stats, cpu);
+
+			nr += stats->nr[op];
+			ns += stats->ns[op];
+		}
+		seq_printf(m, "%s nr=%llu ns=%llu avg_ns=%llu\n",
+			   bfq_op_name[op], nr, ns, nr ? div64_u64(ns, nr) : 0);
+	}
+
+	for_each_possible_cpu(cpu)
+		merge_skipped += per_cpu_ptr(bfqd->op_stats, cpu)->merge_skipped;
+	seq_printf(m, "merge_skipped %llu\n", merge_skipped);
+	seq_printf(m, "timing %s\n", bfqd->op_timing ? "enabled" : "disabled");
+	return 0;
+}
+
+/* "enable" or "disable" hook timing, "reset" the counters */
+static ssize_t bfq_op_stats_write(void *data, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct request_queue *q = data;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	char opbuf[16] = { }, *op;
+	ssize_t ret = count;
+	int cpu;
+
+	if (count >= sizeof(opbuf))
+		return -EINVAL;
+	if (copy_from_user(opbuf, buf, count))
+		return -EFAULT;
+	op = strstrip(opbuf);
+
+	mutex_lock(&bfq_op_timing_mutex);
+	if (strcmp(op, "enable") == 0) {
+		if (!bfqd->op_timing) {
+			static_branch_inc(&bfq_op_timing_key);
+			WRITE_ONCE(bfqd->op_timing, true);
+		}
+	} else if (strcmp(op, "disable") == 0) {
+		if (bfqd->op_timing) {
+			WRITE_ONCE(bfqd->op_timing, false);
+			static_branch_dec(&bfq_op_timing_key);
+		}
+	} else if (strcmp(op, "reset") == 0) {
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(bfqd->op_stats, cpu), 0,
+			       sizeof(struct bfq_op_stats));
+	} else {
+		ret = -EINVAL;
+	}
+	mutex_unlock(&bfq_op_timing_mutex);
+	return ret;
+}
+
+static const struct blk_mq_debugfs_attr bfq_queue_debugfs_attrs[] = {
+	{"op_stats", 0600, bfq_op_stats_show, bfq_op_stats_write},
+	{},
+};
+#endif
+
 static struct elevator_type iosched_bfq_mq = {
 	.ops = {
 		.limit_depth		= bfq_limit_depth,
@@ -7618,6 +7852,9 @@ static struct elevator_type iosched_bfq_mq = {
 
 	.icq_size =		sizeof(struct bfq_io_cq),
 	.icq_align =		__alignof__(struct bfq_io_cq),
+#ifdef CONFIG_BLK_DEBUG_FS
+	.queue_debugfs_attrs =	bfq_queue_debugfs_attrs,
+#endif
 	.elevator_attrs =	bfq_attrs,
 	.elevator_name =	"bfq",
 	.elevator_owner =	THIS_MODULE,
@@ -504,6 +504,25 @@ struct bfq_io_cq {
 	unsigned int requests;	/* Number of requests this process has in flight */
 };
 
+/* scheduler hooks whose cost is accounted in struct bfq_op_stats */
+enum bfq_op {
+	BFQ_OP_INSERT,
+	BFQ_OP_DISPATCH,
+	BFQ_OP_BIO_MERGE,
+	BFQ_OP_FINISH,
+	BFQ_OP_NR,
+};
+
+#ifdef CONFIG_BLK_DEBUG_FS
+/* per-cpu number of invocations and time spent in each hook */
+struct bfq_op_stats {
+	u64 nr[BFQ_OP_NR];
+	u64 ns[BFQ_OP_NR];
+	/* async bio merges given up because bfqd->lock was contended */
+	u64 merge_skipped;
+};
+#endif
+
 /**
  * struct bfq_data - per-device data structure.
  *
@@ -851,6 +870,13 @@ struct bfq_data {
 	 * other queues (NCQ provides for 32 slots).
 	 */
 	unsigned int actuator_load_threshold;
+
+#ifdef CONFIG_BLK_DEBUG_FS
+	/* not protected by @lock, updated with this_cpu ops */
+	struct bfq_op_stats __percpu *op_stats;
+	/* hooks are timed into @op_stats, set from debugfs */
+	bool op_timing;
+#endif
 };
 
 enum bfqq_state_flags {
@@ -312,6 +312,17 @@ enum {
 
 	/* if apart further than 16M, consider randio for linear model */
 	LCOEF_RANDIO_PAGES	= 4096,
+
+	/*
+	 * ctrl=adapt: don't trust a fit with fewer (decayed) samples, move
+	 * coefficients by at most ADAPT_STEP_PCT per period and never
+	 * further than ADAPT_RANGE times away from where they started.
+	 */
+	ADAPT_MIN_SAMPLES	= 256,
+	ADAPT_STEP_PCT		= 5,
+	ADAPT_RANGE		= 16,
+	ADAPT_DECAY_SHIFT	= 3,
+	ADAPT_FP_SHIFT		= 10,
 };
 
 enum ioc_running {
@@ -366,6 +377,23 @@ enum {
 	NR_LCOEFS,
 };
 
+/* cost model adaptation samples */
+enum {
+	ADAPT_SEQ,
+	ADAPT_RAND,
+	NR_ADAPT_KINDS,
+};
+
+enum {
+	ADAPT_NR,		/* number of IOs */
+	ADAPT_X,		/* sum of pages */
+	ADAPT_Y,		/* sum of service times in ~us */
+	ADAPT_XX,
+	ADAPT_XY,
+	ADAPT_YY,
+	NR_ADAPT_SUMS,
+};
+
 enum {
 	AUTOP_INVALID,
 	AUTOP_HDD,
@@ -400,6 +428,10 @@ struct ioc_pcpu_stat {
 
 	local64_t			rq_wait_ns;
 	u64				last_rq_wait_ns;
+
+	/* completion samples for ctrl=adapt */
+	local64_t			adapt[2][NR_ADAPT_KINDS][NR_ADAPT_SUMS];
+	u64				last_adapt[2][NR_ADAPT_KINDS][NR_ADAPT_SUMS];
 };
 
 /* per device */
@@ -445,6 +477,19 @@ struct ioc {
 	int				autop_idx;
 	bool				user_qos_params:1;
 	bool				user_cost_model:1;
+	bool				adapt_cost_model:1;
+
+	/* ctrl=adapt state, see ioc_adapt_cost_model() */
+	u64				adapt_sums[2][NR_ADAPT_KINDS][NR_ADAPT_SUMS];
+	u64				adapt_seed[NR_LCOEFS];
+	u32				adapt_conf[2];	/* fit quality, pct */
+	/*
+	 * Last completion on the device, see ioc_adapt_sample().  Written by
+	 * every completion while ctrl=adapt is on, so it's a cacheline
+	 * shared by all CPUs; that's the price of measuring the device's
+	 * inter-completion time rather than a per-queue one.
+	 */
+	atomic64_t			adapt_last_done_ns;
 };
 
 struct iocg_pcpu_stat {
@@ -894,6 +939,15 @@ static void calc_lcoefs(u64 bps, u64 seqiops, u64 randiops,
 	}
 }
 
+/* the inverse of calc_lcoefs() */
+static void calc_i_lcoefs(u64 page, u64 seqio, u64 randio,
+			  u64 *bps, u64 *seqiops, u64 *randiops)
+{
+	*bps = page ? div64_u64(VTIME_PER_SEC * IOC_PAGE_SIZE, page) : 0;
+	*seqiops = seqio + page ? div64_u64(VTIME_PER_SEC, seqio + page) : 0;
+	*randiops = randio + page ? div64_u64(VTIME_PER_SEC, randio + page) : 0;
+}
+
 static void ioc_refresh_lcoefs(struct ioc *ioc)
 {
 	u64 *u = ioc->params.i_lcoefs;
@@ -1038,6 +1092,194 @@ static void ioc_adjust_base_vrate(struct ioc *ioc, u32 rq_wait_pct,
 	ioc_refresh_margins(ioc);
 }
 
+/*
+ * Least squares fit of the service times of one direction's completions to
+ *
+ *   y = a_seq * [seq] + a_rand * [rand] + b * pages
+ *
+ * over the decayed samples.  On success, b, a_seq and a_rand are stored in
+ * ADAPT_FP_SHIFT fixed point in @shape laid out like the page, seqio and
+ * randio lcoefs, and @learned tells which of them the samples determine.
+ */
+static bool ioc_adapt_fit(struct ioc *ioc, int rw, u64 *shape, bool *learned)
+{
+	u64 (*s)[NR_ADAPT_SUMS] = ioc->adapt_sums[rw];
+	u64 nr = 0, sy = 0, syy = 0, sxx = 0, sxy = 0;
+	u64 mxx = 0, mxy = 0, myy = 0;
+	u64 num, den, sst, sse, explained;
+	int k;
+
+	ioc->adapt_conf[rw] = 0;
+
+	for (k = 0; k < NR_ADAPT_KINDS; k++) {
+		u64 n = s[k][ADAPT_NR];
+
+		if (!n)
+			continue;
+		nr += n;
+		sy += s[k][ADAPT_Y];
+		syy += s[k][ADAPT_YY];
+		sxx += s[k][ADAPT_XX];
+		sxy += s[k][ADAPT_XY];
+		/* per-kind mean corrections */
+		mxx += mul_u64_u64_div_u64(s[k][ADAPT_X], s[k][ADAPT_X], n);
+		mxy += mul_u64_u64_div_u64(s[k][ADAPT_X], s[k][ADAPT_Y], n);
+		myy += mul_u64_u64_div_u64(s[k][ADAPT_Y], s[k][ADAPT_Y], n);
+	}
+
+	if (nr < ADAPT_MIN_SAMPLES)
+		return false;
+
+	/* IO sizes must vary enough to tell the per-page cost apart */
+	if (sxx <= mxx + nr / 4 || sxy <= mxy)
+		return false;
+	num = sxy - mxy;
+	den = sxx - mxx;
+
+	shape[0] = mul_u64_u64_div_u64(num, 1 << ADAPT_FP_SHIFT, den);
+	learned[0] = true;
+
+	for (k = 0; k < NR_ADAPT_KINDS; k++) {
+		u64 n = s[k][ADAPT_NR];
+		u64 y = s[k][ADAPT_Y] << ADAPT_FP_SHIFT;
+		u64 bx = shape[0] * s[k][ADAPT_X];
+
+		learned[1 + k] = n >= ADAPT_MIN_SAMPLES / 4;
+		shape[1 + k] = y > bx ? div64_u64(y - bx, max(n, 1ULL)) : 0;
+	}
+
+	/* confidence is the share of the variance the fit explains */
+	sst = syy - min(syy, mul_u64_u64_div_u64(sy, sy, nr));
+	explained = mul_u64_u64_div_u64(num, num, den);
+	sse = syy - min(syy, myy);
+	sse -= min(sse, explained);
+	if (sst)
+		ioc->adapt_conf[rw] = 100 - min_t(u64, div64_u64(sse * 100, sst),
+						  100);
+	return true;
+}
+
+/*
+ * Move @cur a bounded step towards @target without leaving the range
+ * around @seed allowed by ADAPT_RANGE.
+ */
+static u64 ioc_adapt_step(u64 cur, u64 target, u64 seed)
+{
+	u64 step = max_t(u64, div64_u64(cur * ADAPT_STEP_PCT, 100), 1);
+	u64 next;
+
+	if (!seed)
+		return cur;
+
+	if (target >= cur)
+		next = cur + min((target - cur) >> ADAPT_DECAY_SHIFT, step);
+	else
+		next = cur - min((cur - target) >> ADAPT_DECAY_SHIFT, step);
+
+	return clamp(next, max_t(u64, seed / ADAPT_RANGE, 1),
+		     seed * ADAPT_RANGE);
+}
+
+/*
+ * ctrl=adapt: refine the linear cost model from completions.
+ *
+ * Completion service times determine the relative costs of pages, seq and
+ * rand IOs per direction.  Their absolute scale comes from vrate, which
+ * the controller already adjusts so that the model matches what the device
+ * sustains: the learned coefficients are scaled such that the recent IO
+ * mix costs what it costs under the current model divided by vrate.  vrate
+ * is then rescaled by the change in the mix's cost so that throttling stays
+ * continuous, which walks it back towards 100% as the model absorbs it.
+ * If that would push vrate past vrate_min or vrate_max, the model is left
+ * alone for the period instead.
+ */
+static void ioc_adapt_cost_model(struct ioc *ioc)
+{
+	u64 *c = ioc->params.lcoefs, *u = ioc->params.i_lcoefs;
+	u64 shape[NR_LCOEFS], weight[NR_LCOEFS], lc[NR_LCOEFS];
+	u64 model_cost = 0, shape_cost = 0, new_cost = 0;
+	u64 vrate = ioc->vtime_base_rate;
+	bool learned[NR_LCOEFS] = { };
+	int cpu, rw, k, i;
+
+	lockdep_assert_held(&ioc->lock);
+
+	for (rw = READ; rw <= WRITE; rw++)
+		for (k = 0; k < NR_ADAPT_KINDS; k++)
+			for (i = 0; i < NR_ADAPT_SUMS; i++)
+				ioc->adapt_sums[rw][k][i] -=
+					ioc->adapt_sums[rw][k][i] >> ADAPT_DECAY_SHIFT;
+
+	for_each_online_cpu(cpu) {
+		struct ioc_pcpu_stat *stat = per_cpu_ptr(ioc->pcpu_stat, cpu);
+
+		for (rw = READ; rw <= WRITE; rw++) {
+			for (k = 0; k < NR_ADAPT_KINDS; k++) {
+				for (i = 0; i < NR_ADAPT_SUMS; i++) {
+					u64 v = local64_read(&stat->adapt[rw][k][i]);
+
+					ioc->adapt_sums[rw][k][i] +=
+						v - stat->last_adapt[rw][k][i];
+					stat->last_adapt[rw][k][i] = v;
+				}
+			}
+		}
+	}
+
+	/* the page, seqio and randio lcoefs of each direction are adjacent */
+	for (rw = READ; rw <= WRITE; rw++) {
+		u64 (*s)[NR_ADAPT_SUMS] = ioc->adapt_sums[rw];
+		int base = rw == READ ? LCOEF_RPAGE : LCOEF_WPAGE;
+
+		weight[base] = s[ADAPT_SEQ][ADAPT_X] + s[ADAPT_RAND][ADAPT_X];
+		weight[base + 1] = s[ADAPT_SEQ][ADAPT_NR];
+		weight[base + 2] = s[ADAPT_RAND][ADAPT_NR];
+
+		ioc_adapt_fit(ioc, rw, &shape[base], &learned[base]);
+	}
+
+	for (i = 0; i < NR_LCOEFS; i++) {
+		if (!learned[i])
+			continue;
+		model_cost += weight[i] * c[i];
+		shape_cost += weight[i] * shape[i];
+	}
+	if (!model_cost || !shape_cost)
+		return;
+
+	for (i = 0; i < NR_LCOEFS; i++) {
+		u64 target;
+
+		if (!learned[i])
+			continue;
+		target = mul_u64_u64_div_u64(shape[i], model_cost, shape_cost);
+		target = mul_u64_u64_div_u64(target, VTIME_PER_USEC,
+					     ioc->vtime_base_rate);
+		lc[i] = ioc_adapt_step(c[i], target, ioc->adapt_seed[i]);
+		new_cost += weight[i] * lc[i];
+	}
+
+	/* keep the effective cost of what wasn't learned unchanged */
+	for (i = 0; i < NR_LCOEFS; i++)
+		if (!learned[i])
+			lc[i] = mul_u64_u64_div_u64(c[i], new_cost, model_cost);
+
+	vrate = mul_u64_u64_div_u64(vrate, new_cost, model_cost);
+	if ((vrate < ioc->vrate_min && vrate < ioc->vtime_base_rate) ||
+	    (vrate > ioc->vrate_max && vrate > ioc->vtime_base_rate))
+		return;
+	ioc->vtime_base_rate = vrate;
+
+	calc_i_lcoefs(lc[LCOEF_RPAGE], lc[LCOEF_RSEQIO], lc[LCOEF_RRANDIO],
+		      &u[I_LCOEF_RBPS], &u[I_LCOEF_RSEQIOPS],
+		      &u[I_LCOEF_RRANDIOPS]);
+	calc_i_lcoefs(lc[LCOEF_WPAGE], lc[LCOEF_WSEQIO], lc[LCOEF_WRANDIO],
+		      &u[I_LCOEF_WBPS], &u[I_LCOEF_WSEQIOPS],
+		      &u[I_LCOEF_WRANDIOPS]);
+	ioc_refresh_lcoefs(ioc);
+	ioc_refresh_margins(ioc);
+}
+
 /* take a snapshot of the current [v]time and vrate */
 static void ioc_now(struct ioc *ioc, struct ioc_now *now)
 {
@@ -2432,6 +2674,9 @@ static void ioc_timer_fn(struct timer_list *timer)
 	ioc_adjust_base_vrate(ioc, rq_wait_pct, nr_lagging, nr_shortages,
 			      prev_busy_level, missed_ppm);
 
+	if (ioc->adapt_cost_model)
+		ioc_adapt_cost_model(ioc);
+
 	ioc_refresh_params(ioc, false);
 
 	ioc_forgive_debts(ioc, usage_us_sum, nr_debtors, &now);
@@ -2518,13 +2763,38 @@ static u64 adjust_inuse_and_calc_cost(struct ioc_gq *iocg, u64 vtime,
 	return cost;
 }
 
+static bool iocg_bio_is_randio(struct ioc_gq *iocg, struct bio *bio)
+{
+	u64 seek_pages = 0;
+
+	if (iocg->cursor) {
+		seek_pages = abs(bio->bi_iter.bi_sector - iocg->cursor);
+		seek_pages >>= IOC_SECT_TO_PAGE_SHIFT;
+	}
+
+	return seek_pages > LCOEF_RANDIO_PAGES;
+}
+
+/*
+ * ctrl=adapt fits the completion times against the coefficients charged
+ * at issue.  Remember which of seqio and randio that was, ioc_rqos_track()
+ * carries it over to the request.
+ */
+static void iocg_mark_randio(struct bio *bio, bool randio)
+{
+	if (randio)
+		bio_set_flag(bio, BIO_IOCOST_RANDIO);
+	else
+		bio_clear_flag(bio, BIO_IOCOST_RANDIO);
+}
+
 static void calc_vtime_cost_builtin(struct bio *bio, struct ioc_gq *iocg,
 				    bool is_merge, u64 *costp)
 {
 	struct ioc *ioc = iocg->ioc;
 	u64 coef_seqio, coef_randio, coef_page;
 	u64 pages = max_t(u64, bio_sectors(bio) >> IOC_SECT_TO_PAGE_SHIFT, 1);
-	u64 seek_pages = 0;
+	bool randio;
 	u64 cost = 0;
 
 	/* Can't calculate cost for empty bio */
@@ -2546,17 +2816,14 @@ static void calc_vtime_cost_builtin(struct bio *bio, struct ioc_gq *iocg,
 		goto out;
 	}
 
-	if (iocg->cursor) {
-		seek_pages = abs(bio->bi_iter.bi_sector - iocg->cursor);
-		seek_pages >>= IOC_SECT_TO_PAGE_SHIFT;
-	}
-
 	if (!is_merge) {
-		if (seek_pages > LCOEF_RANDIO_PAGES) {
+		randio = iocg_bio_is_randio(iocg, bio);
+		if (randio) {
 			cost += coef_randio;
 		} else {
 			cost += coef_seqio;
 		}
+		iocg_mark_randio(bio, randio);
 	}
 	cost += pages * coef_page;
 out:
@@ -2607,10 +2874,19 @@ static void ioc_rqos_throttle(struct rq_qos *rqos, struct bio *bio)
 	bool use_debt, ioc_locked;
 	unsigned long flags;
 
-	/* bypass IOs if disabled, still initializing, or for root cgroup */
-	if (!ioc->enabled || !iocg || !iocg->level)
+	/* bypass IOs if disabled or still initializing */
+	if (!ioc->enabled || !iocg)
 		return;
 
+	/* root cgroup isn't charged, but ctrl=adapt samples its IOs too */
+	if (!iocg->level) {
+		if (ioc->adapt_cost_model) {
+			iocg_mark_randio(bio, iocg_bio_is_randio(iocg, bio));
+			iocg->cursor = bio_end_sector(bio);
+		}
+		return;
+	}
+
 	/* calculate the absolute vtime cost */
 	abs_cost = calc_vtime_cost(bio, iocg, false);
 	if (!abs_cost)
@@ -2798,11 +3074,55 @@ static void ioc_rqos_done_bio(struct rq_qos *rqos, struct bio *bio)
 		atomic64_add(bio->bi_iocost_cost, &iocg->done_vtime);
 }
 
+static void ioc_rqos_track(struct rq_qos *rqos, struct request *rq,
+			   struct bio *bio)
+{
+	if (bio_flagged(bio, BIO_IOCOST_RANDIO))
+		rq->rq_flags |= RQF_IOCOST_RANDIO;
+}
+
+/*
+ * The device time a request accounts for is measured from its issue or
+ * the previous completion, whichever is later.  At queue depth one that's
+ * its service time.  With more requests in flight, time spent queued
+ * behind others inside the device is left out and the inter-completion
+ * time of a saturated device is what each request costs.
+ *
+ * Whether it's sampled as seqio or randio was decided when it was charged,
+ * see iocg_mark_randio().
+ */
+static void ioc_adapt_sample(struct ioc *ioc, struct ioc_pcpu_stat *ccs,
+			     struct request *rq, int rw, u64 now_ns)
+{
+	u64 pages = max_t(u64, blk_rq_stats_sectors(rq) >>
+			  IOC_SECT_TO_PAGE_SHIFT, 1);
+	u64 start_ns, lat;
+	local64_t *sums;
+
+	start_ns = atomic64_xchg(&ioc->adapt_last_done_ns, now_ns);
+	start_ns = max(start_ns, rq->io_start_time_ns);
+	if (!rq->io_start_time_ns || now_ns <= start_ns)
+		return;
+	lat = (now_ns - start_ns) >> 10;
+
+	if (rq->rq_flags & RQF_IOCOST_RANDIO)
+		sums = ccs->adapt[rw][ADAPT_RAND];
+	else
+		sums = ccs->adapt[rw][ADAPT_SEQ];
+
+	local64_inc(&sums[ADAPT_NR]);
+	local64_add(pages, &sums[ADAPT_X]);
+	local64_add(lat, &sums[ADAPT_Y]);
+	local64_add(pages * pages, &sums[ADAPT_XX]);
+	local64_add(pages * lat, &sums[ADAPT_XY]);
+	local64_add(lat * lat, &sums[ADAPT_YY]);
+}
+
 static void ioc_rqos_done(struct rq_qos *rqos, struct request *rq)
 {
 	struct ioc *ioc = rqos_to_ioc(rqos);
 	struct ioc_pcpu_stat *ccs;
-	u64 on_q_ns, rq_wait_ns, size_nsec;
+	u64 now_ns, on_q_ns, rq_wait_ns, size_nsec;
 	int pidx, rw;
 
 	if (!ioc->enabled || !rq->alloc_time_ns || !rq->start_time_ns)
@@ -2821,7 +3141,8 @@ static void ioc_rqos_done(struct rq_qos *rqos, struct request *rq)
 		return;
 	}
 
-	on_q_ns = ktime_get_ns() - rq->alloc_time_ns;
+	now_ns = ktime_get_ns();
+	on_q_ns = now_ns - rq->alloc_time_ns;
 	rq_wait_ns = rq->start_time_ns - rq->alloc_time_ns;
 	size_nsec = div64_u64(calc_size_vtime_cost(rq, ioc), VTIME_PER_NSEC);
 
@@ -2835,6 +3156,9 @@ static void ioc_rqos_done(struct rq_qos *rqos, struct request *rq)
 
 	local64_add(rq_wait_ns, &ccs->rq_wait_ns);
 
+	if (ioc->adapt_cost_model)
+		ioc_adapt_sample(ioc, ccs, rq, rw, now_ns);
+
 	put_cpu_ptr(ccs);
 }
 
@@ -2865,6 +3189,7 @@ static void ioc_rqos_exit(struct rq_qos *rqos)
 static const struct rq_qos_ops ioc_rqos_ops = {
 	.throttle = ioc_rqos_throttle,
 	.merge = ioc_rqos_merge,
+	.track = ioc_rqos_track,
 	.done_bio = ioc_rqos_done_bio,
 	.done = ioc_rqos_done,
 	.queue_depth_changed = ioc_rqos_queue_depth_changed,
@@ -3367,10 +3692,15 @@ static u64 ioc_cost_model_prfill(struct seq_file *sf,
 	spin_lock_irq(&ioc->lock);
 	seq_printf(sf, "%s ctrl=%s model=linear "
 		   "rbps=%llu rseqiops=%llu rrandiops=%llu "
-		   "wbps=%llu wseqiops=%llu wrandiops=%llu\n",
-		   dname, ioc->user_cost_model ? "user" : "auto",
+		   "wbps=%llu wseqiops=%llu wrandiops=%llu",
+		   dname, ioc->adapt_cost_model ? "adapt" :
+		   ioc->user_cost_model ? "user" : "auto",
 		   u[I_LCOEF_RBPS], u[I_LCOEF_RSEQIOPS], u[I_LCOEF_RRANDIOPS],
 		   u[I_LCOEF_WBPS], u[I_LCOEF_WSEQIOPS], u[I_LCOEF_WRANDIOPS]);
+	if (ioc->adapt_cost_model)
+		seq_printf(sf, " rconf=%u wconf=%u",
+			   ioc->adapt_conf[READ], ioc->adapt_conf[WRITE]);
+	seq_putc(sf, '\n');
 	spin_unlock_irq(&ioc->lock);
 	return 0;
 }
@@ -3407,7 +3737,7 @@ static ssize_t ioc_cost_model_write(struct kernfs_open_file *of, char *input,
 	struct request_queue *q;
 	struct ioc *ioc;
 	u64 u[NR_I_LCOEFS];
-	bool user;
+	bool user, adapt;
 	char *body, *p;
 	int ret;
 
@@ -3438,6 +3768,7 @@ static ssize_t ioc_cost_model_write(struct kernfs_open_file *of, char *input,
 	spin_lock_irq(&ioc->lock);
 	memcpy(u, ioc->params.i_lcoefs, sizeof(u));
 	user = ioc->user_cost_model;
+	adapt = ioc->adapt_cost_model;
 
 	while ((p = strsep(&body, " \t\n"))) {
 		substring_t args[MAX_OPT_ARGS];
@@ -3451,12 +3782,18 @@ static ssize_t ioc_cost_model_write(struct kernfs_open_file *of, char *input,
 		switch (match_token(p, cost_ctrl_tokens, args)) {
 		case COST_CTRL:
 			match_strlcpy(buf, &args[0], sizeof(buf));
-			if (!strcmp(buf, "auto"))
+			if (!strcmp(buf, "auto")) {
 				user = false;
-			else if (!strcmp(buf, "user"))
+				adapt = false;
+			} else if (!strcmp(buf, "user")) {
 				user = true;
-			else
+				adapt = false;
+			} else if (!strcmp(buf, "adapt")) {
+				user = true;
+				adapt = true;
+			} else {
 				goto einval;
+			}
 			continue;
 		case COST_MODEL:
 			match_strlcpy(buf, &args[0], sizeof(buf));
@@ -3480,7 +3817,16 @@ static ssize_t ioc_cost_model_write(struct kernfs_open_file *of, char *input,
 	} else {
 		ioc->user_cost_model = false;
 	}
+	ioc->adapt_cost_model = adapt;
 	ioc_refresh_params(ioc, true);
+
+	/* (re)start adapting from the coefficients now in effect */
+	if (adapt) {
+		memcpy(ioc->adapt_seed, ioc->params.lcoefs,
+		       sizeof(ioc->adapt_seed));
+		memset(ioc->adapt_sums, 0, sizeof(ioc->adapt_sums));
+		memset(ioc->adapt_conf, 0, sizeof(ioc->adapt_conf));
+	}
 	spin_unlock_irq(&ioc->lock);
 
 	blk_mq_unquiesce_queue(q);
@@ -155,11 +155,53 @@ static ssize_t queue_state_write(void *data, const char __user *buf,
 	return count;
 }
 
+static int queue_latency_hist_show(void *data, struct seq_file *m)
+{
+	blk_stat_lat_hist_show(data, m);
+	return 0;
+}
+
+static ssize_t queue_latency_hist_write(void *data, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct request_queue *q = data;
+	char opbuf[16] = { }, *op;
+	int ret;
+
+	if (blk_queue_dying(q))
+		return -ENOENT;
+
+	if (count >= sizeof(opbuf)) {
+		pr_err("%s: operation too long\n", __func__);
+		goto inval;
+	}
+
+	if (copy_from_user(opbuf, buf, count))
+		return -EFAULT;
+	op = strstrip(opbuf);
+	if (strcmp(op, "enable") == 0) {
+		ret = blk_stat_enable_lat_hist(q);
+		if (ret)
+			return ret;
+	} else if (strcmp(op, "disable") == 0) {
+		blk_stat_disable_lat_hist(q);
+	} else if (strcmp(op, "reset") == 0) {
+		blk_stat_reset_lat_hist(q);
+	} else {
+		pr_err("%s: unsupported operation '%s'\n", __func__, op);
+inval:
+		pr_err("%s: use 'enable', 'disable' or 'reset'\n", __func__);
+		return -EINVAL;
+	}
+	return count;
+}
+
 static const struct blk_mq_debugfs_attr blk_mq_debugfs_queue_attrs[] = {
 	{ "poll_stat", 0400, queue_poll_stat_show },
 	{ "requeue_list", 0400, .seq_ops = &queue_requeue_list_seq_ops },
 	{ "pm_only", 0600, queue_pm_only_show, NULL },
 	{ "state", 0600, queue_state_show, queue_state_write },
+	{ "latency_hist", 0600, queue_latency_hist_show, queue_latency_hist_write },
 	{ "zone_wlock", 0400, queue_zone_wlock_show, NULL },
 	{ },
 };
@@ -260,6 +302,7 @@ static const char *const rqf_name[] = {
 	RQF_NAME(ZONE_WRITE_LOCKED),
 	RQF_NAME(TIMED_OUT),
 	RQF_NAME(RESV),
+	RQF_NAME(IOCOST_RANDIO),
 };
 #undef RQF_NAME
 
@@ -497,6 +540,27 @@ static ssize_t hctx_run_write(void *data, const char __user *buf, size_t count,
 	return count;
 }
 
+static int hctx_tag_stats_show(void *data, struct seq_file *m)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+
+	seq_printf(m, "nowait_fails=%lu\n", hctx->tag_stats.nowait_fails);
+	seq_printf(m, "retries=%lu\n", hctx->tag_stats.retries);
+	seq_printf(m, "sleeps=%lu\n", hctx->tag_stats.sleeps);
+	seq_printf(m, "wake_hits=%lu\n", hctx->tag_stats.wake_hits);
+	seq_printf(m, "wake_misses=%lu\n", hctx->tag_stats.wake_misses);
+	return 0;
+}
+
+static ssize_t hctx_tag_stats_write(void *data, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+
+	memset(&hctx->tag_stats, 0, sizeof(hctx->tag_stats));
+	return count;
+}
+
 static int hctx_active_show(void *data, struct seq_file *m)
 {
 	struct blk_mq_hw_ctx *hctx = data;
@@ -626,6 +690,7 @@ static const struct blk_mq_debugfs_attr blk_mq_debugfs_hctx_attrs[] = {
 	{"sched_tags", 0400, hctx_sched_tags_show},
 	{"sched_tags_bitmap", 0400, hctx_sched_tags_bitmap_show},
 	{"run", 0600, hctx_run_show, hctx_run_write},
+	{"tag_stats", 0600, hctx_tag_stats_show, hctx_tag_stats_write},
 	{"active", 0400, hctx_active_show},
 	{"dispatch_busy", 0400, hctx_dispatch_busy_show},
 	{"type", 0400, hctx_type_show},
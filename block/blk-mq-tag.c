@@ -137,6 +137,7 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 	struct sbq_wait_state *ws;
 	DEFINE_SBQ_WAIT(wait);
 	unsigned int tag_offset;
+	bool woken = false;
 	int tag;
 
 	if (data->flags & BLK_MQ_REQ_RESERVED) {
@@ -155,8 +156,10 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 	if (tag != BLK_MQ_NO_TAG)
 		goto found_tag;
 
-	if (data->flags & BLK_MQ_REQ_NOWAIT)
+	if (data->flags & BLK_MQ_REQ_NOWAIT) {
+		data->hctx->tag_stats.nowait_fails++;
 		return BLK_MQ_NO_TAG;
+	}
 
 	ws = bt_wait_ptr(bt, data->hctx);
 	do {
@@ -173,6 +176,7 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 		 * Retry tag allocation after running the hardware queue,
 		 * as running the queue may also have found completions.
 		 */
+		data->hctx->tag_stats.retries++;
 		tag = __blk_mq_get_tag(data, bt);
 		if (tag != BLK_MQ_NO_TAG)
 			break;
@@ -183,8 +187,13 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 		if (tag != BLK_MQ_NO_TAG)
 			break;
 
+		if (woken)
+			data->hctx->tag_stats.wake_misses++;
+		data->hctx->tag_stats.sleeps++;
+
 		bt_prev = bt;
 		io_schedule();
+		woken = true;
 
 		sbitmap_finish_wait(bt, ws, &wait);
 
@@ -208,6 +217,8 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 		ws = bt_wait_ptr(bt, data->hctx);
 	} while (1);
 
+	if (woken)
+		data->hctx->tag_stats.wake_hits++;
 	sbitmap_finish_wait(bt, ws, &wait);
 
 found_tag:
@@ -3373,6 +3373,10 @@ static struct blk_mq_tags *blk_mq_alloc_rq_map(struct blk_mq_tag_set *set,
 	if (!tags)
 		return NULL;
 
+	/* host-wide tags are allocated from by all CPUs, keep clusters apart */
+	if (hctx_idx == BLK_MQ_NO_HCTX_IDX)
+		sbitmap_spread_alloc_hints(&tags->bitmap_tags.sb);
+
 	tags->rqs = kcalloc_node(nr_tags, sizeof(struct request *),
 				 GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY,
 				 node);
@@ -6,15 +6,44 @@
  */
 #include <linux/kernel.h>
 #include <linux/rculist.h>
+#include <linux/ioprio.h>
+#include <linux/seq_file.h>
 
 #include "blk-stat.h"
 #include "blk-mq.h"
 #include "blk.h"
 
+/*
+ * Log-linear completion latency histogram: below 2^BLK_LAT_HIST_SUB_BITS
+ * units of 2^BLK_LAT_HIST_UNIT_SHIFT ns (~1us) the buckets are linear, above
+ * that every power of two is split into 2^BLK_LAT_HIST_SUB_BITS buckets, so
+ * the relative error stays below 25% up to ~34s.
+ */
+#define BLK_LAT_HIST_UNIT_SHIFT	10
+#define BLK_LAT_HIST_SUB_BITS	2
+#define BLK_LAT_HIST_SUB	(1U << BLK_LAT_HIST_SUB_BITS)
+#define BLK_LAT_HIST_GROUPS	25
+#define BLK_LAT_HIST_BUCKETS	(BLK_LAT_HIST_GROUPS * BLK_LAT_HIST_SUB)
+
+enum {
+	BLK_LAT_HIST_READ,
+	BLK_LAT_HIST_WRITE,
+	BLK_LAT_HIST_OTHER,
+	BLK_LAT_HIST_OPS,
+};
+
+#define BLK_LAT_HIST_PRIOS	(IOPRIO_CLASS_IDLE + 1)
+
+struct blk_lat_hist {
+	u32 buckets[BLK_LAT_HIST_OPS][BLK_LAT_HIST_PRIOS][BLK_LAT_HIST_BUCKETS];
+};
+
 struct blk_queue_stats {
 	struct list_head callbacks;
 	spinlock_t lock;
 	int accounting;
+	/* published under @lock, freed after an RCU grace period */
+	struct blk_lat_hist __percpu *hist;
 };
 
 void blk_rq_stat_init(struct blk_rq_stat *stat)
@@ -47,9 +76,56 @@ void blk_rq_stat_add(struct blk_rq_stat *stat, u64 value)
 	stat->nr_samples++;
 }
 
+static unsigned int blk_lat_hist_bucket(u64 nsecs)
+{
+	u64 v = nsecs >> BLK_LAT_HIST_UNIT_SHIFT;
+	unsigned int msb, bucket;
+
+	if (v < BLK_LAT_HIST_SUB)
+		return v;
+
+	msb = fls64(v) - 1;
+	bucket = (msb - BLK_LAT_HIST_SUB_BITS + 1) * BLK_LAT_HIST_SUB +
+		((v >> (msb - BLK_LAT_HIST_SUB_BITS)) & (BLK_LAT_HIST_SUB - 1));
+	return min(bucket, BLK_LAT_HIST_BUCKETS - 1);
+}
+
+/* Lowest latency in ns accounted to @bucket. */
+static u64 blk_lat_hist_bucket_start(unsigned int bucket)
+{
+	unsigned int group = bucket / BLK_LAT_HIST_SUB;
+	u64 v = bucket % BLK_LAT_HIST_SUB;
+
+	if (group)
+		v = (BLK_LAT_HIST_SUB + v) << (group - 1);
+	return v << BLK_LAT_HIST_UNIT_SHIFT;
+}
+
+static void blk_lat_hist_add(struct blk_lat_hist __percpu *hist,
+			     struct request *rq, u64 value)
+{
+	unsigned int op;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		op = BLK_LAT_HIST_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = BLK_LAT_HIST_WRITE;
+		break;
+	default:
+		op = BLK_LAT_HIST_OTHER;
+		break;
+	}
+
+	this_cpu_inc(hist->buckets[op][IOPRIO_PRIO_CLASS(req_get_ioprio(rq))]
+				  [blk_lat_hist_bucket(value)]);
+}
+
 void blk_stat_add(struct request *rq, u64 now)
 {
 	struct request_queue *q = rq->q;
+	struct blk_lat_hist __percpu *hist;
 	struct blk_stat_callback *cb;
 	struct blk_rq_stat *stat;
 	int bucket, cpu;
@@ -61,6 +137,10 @@ void blk_stat_add(struct request *rq, u64 now)
 		blk_throtl_stat_add(rq, value);
 
 	rcu_read_lock();
+	hist = READ_ONCE(q->stats->hist);
+	if (hist)
+		blk_lat_hist_add(hist, rq, value);
+
 	cpu = get_cpu();
 	list_for_each_entry_rcu(cb, &q->stats->callbacks, list) {
 		if (!blk_stat_is_active(cb))
@@ -206,6 +286,151 @@ void blk_stat_enable_accounting(struct request_queue *q)
 }
 EXPORT_SYMBOL_GPL(blk_stat_enable_accounting);
 
+int blk_stat_enable_lat_hist(struct request_queue *q)
+{
+	struct blk_lat_hist __percpu *hist;
+	unsigned long flags;
+
+	hist = alloc_percpu(struct blk_lat_hist);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&q->stats->lock, flags);
+	if (!q->stats->hist) {
+		smp_store_release(&q->stats->hist, hist);
+		hist = NULL;
+		if (!q->stats->accounting++ && list_empty(&q->stats->callbacks))
+			blk_queue_flag_set(QUEUE_FLAG_STATS, q);
+	}
+	spin_unlock_irqrestore(&q->stats->lock, flags);
+
+	free_percpu(hist);
+	return 0;
+}
+
+void blk_stat_disable_lat_hist(struct request_queue *q)
+{
+	struct blk_lat_hist __percpu *hist;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->stats->lock, flags);
+	hist = q->stats->hist;
+	if (hist) {
+		WRITE_ONCE(q->stats->hist, NULL);
+		if (!--q->stats->accounting && list_empty(&q->stats->callbacks))
+			blk_queue_flag_clear(QUEUE_FLAG_STATS, q);
+	}
+	spin_unlock_irqrestore(&q->stats->lock, flags);
+
+	if (hist) {
+		synchronize_rcu();
+		free_percpu(hist);
+	}
+}
+
+void blk_stat_reset_lat_hist(struct request_queue *q)
+{
+	struct blk_lat_hist __percpu *hist;
+	int cpu;
+
+	rcu_read_lock();
+	hist = READ_ONCE(q->stats->hist);
+	if (hist) {
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(hist, cpu), 0, sizeof(*hist));
+	}
+	rcu_read_unlock();
+}
+
+static const char *const blk_lat_hist_op_name[BLK_LAT_HIST_OPS] = {
+	[BLK_LAT_HIST_READ]	= "read",
+	[BLK_LAT_HIST_WRITE]	= "write",
+	[BLK_LAT_HIST_OTHER]	= "other",
+};
+
+static const char *const blk_lat_hist_prio_name[BLK_LAT_HIST_PRIOS] = {
+	[IOPRIO_CLASS_NONE]	= "none",
+	[IOPRIO_CLASS_RT]	= "rt",
+	[IOPRIO_CLASS_BE]	= "be",
+	[IOPRIO_CLASS_IDLE]	= "idle",
+};
+
+/*
+ * Upper end in us of the bucket holding the sample at fraction
+ * @num / @den of @total samples.
+ */
+static u64 blk_lat_hist_percentile(const u64 *sums, u64 total, u64 num,
+				   u64 den)
+{
+	u64 rank = div64_u64(total * num + den - 1, den), seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < BLK_LAT_HIST_BUCKETS - 1; b++) {
+		seen += sums[b];
+		if (seen >= rank)
+			break;
+	}
+	if (b == BLK_LAT_HIST_BUCKETS - 1)
+		return div_u64(blk_lat_hist_bucket_start(b), NSEC_PER_USEC);
+	return div_u64(blk_lat_hist_bucket_start(b + 1), NSEC_PER_USEC);
+}
+
+/*
+ * For each operation and priority class with samples, print one summary line
+ * with the p50/p99/p99.9 latencies in us, then "<start_us> <count>" for each
+ * non-empty bucket.
+ */
+void blk_stat_lat_hist_show(struct request_queue *q, struct seq_file *m)
+{
+	struct blk_lat_hist __percpu *hist;
+	unsigned int op, prio, b;
+	u64 *sums, total;
+	int cpu;
+
+	sums = kmalloc_array(BLK_LAT_HIST_BUCKETS, sizeof(*sums), GFP_KERNEL);
+	if (!sums)
+		return;
+
+	rcu_read_lock();
+	hist = READ_ONCE(q->stats->hist);
+	if (!hist) {
+		seq_puts(m, "disabled\n");
+		goto out;
+	}
+
+	for (op = 0; op < BLK_LAT_HIST_OPS; op++) {
+		for (prio = 0; prio < BLK_LAT_HIST_PRIOS; prio++) {
+			total = 0;
+			for (b = 0; b < BLK_LAT_HIST_BUCKETS; b++) {
+				sums[b] = 0;
+				for_each_possible_cpu(cpu)
+					sums[b] += per_cpu_ptr(hist, cpu)->
+						buckets[op][prio][b];
+				total += sums[b];
+			}
+			if (!total)
+				continue;
+
+			seq_printf(m, "%s %s samples=%llu p50=%llu p99=%llu p999=%llu\n",
+				   blk_lat_hist_op_name[op],
+				   blk_lat_hist_prio_name[prio], total,
+				   blk_lat_hist_percentile(sums, total, 50, 100),
+				   blk_lat_hist_percentile(sums, total, 99, 100),
+				   blk_lat_hist_percentile(sums, total, 999, 1000));
+			for (b = 0; b < BLK_LAT_HIST_BUCKETS; b++) {
+				if (!sums[b])
+					continue;
+				seq_printf(m, "  %llu %llu\n",
+					   div_u64(blk_lat_hist_bucket_start(b),
+						   NSEC_PER_USEC), sums[b]);
+			}
+		}
+	}
+out:
+	rcu_read_unlock();
+	kfree(sums);
+}
+
 struct blk_queue_stats *blk_alloc_queue_stats(void)
 {
 	struct blk_queue_stats *stats;
@@ -217,6 +442,7 @@ struct blk_queue_stats *blk_alloc_queue_stats(void)
 	INIT_LIST_HEAD(&stats->callbacks);
 	spin_lock_init(&stats->lock);
 	stats->accounting = 0;
+	stats->hist = NULL;
 
 	return stats;
 }
@@ -228,5 +454,6 @@ void blk_free_queue_stats(struct blk_queue_stats *stats)
 
 	WARN_ON(!list_empty(&stats->callbacks));
 
+	free_percpu(stats->hist);
 	kfree(stats);
 }
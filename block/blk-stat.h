@@ -8,6 +8,8 @@
 #include <linux/rcupdate.h>
 #include <linux/timer.h>
 
+struct seq_file;
+
 /**
  * struct blk_stat_callback - Block statistics callback.
  *
@@ -72,6 +74,12 @@ void blk_stat_add(struct request *rq, u64 now);
 void blk_stat_enable_accounting(struct request_queue *q);
 void blk_stat_disable_accounting(struct request_queue *q);
 
+/* per-cpu completion latency histograms by operation and priority class */
+int blk_stat_enable_lat_hist(struct request_queue *q);
+void blk_stat_disable_lat_hist(struct request_queue *q);
+void blk_stat_reset_lat_hist(struct request_queue *q);
+void blk_stat_lat_hist_show(struct request_queue *q, struct seq_file *m);
+
 /**
  * blk_stat_alloc_callback() - Allocate a block statistics callback.
  * @timer_fn: Timer callback function.
@@ -21,6 +21,9 @@
 /* Total max dispatch from all groups in one round */
 #define THROTL_QUANTUM 32
 
+/* A per-cpu budget holds at most 1/2^THROTL_BUDGET_SHIFT of a slice's worth */
+#define THROTL_BUDGET_SHIFT 3
+
 /* Throttling is performed over a slice and after that slice is renewed */
 #define DFL_THROTL_SLICE_HD (HZ / 10)
 #define DFL_THROTL_SLICE_SSD (HZ / 50)
@@ -339,7 +342,7 @@ static struct blkg_policy_data *throtl_pd_alloc(struct gendisk *disk,
 		struct blkcg *blkcg, gfp_t gfp)
 {
 	struct throtl_grp *tg;
-	int rw;
+	int rw, cpu;
 
 	tg = kzalloc_node(sizeof(*tg), gfp, disk->node_id);
 	if (!tg)
@@ -351,11 +354,18 @@ static struct blkg_policy_data *throtl_pd_alloc(struct gendisk *disk,
 	if (blkg_rwstat_init(&tg->stat_ios, gfp))
 		goto err_exit_stat_bytes;
 
+	tg->budget = alloc_percpu_gfp(struct throtl_budget, gfp);
+	if (!tg->budget)
+		goto err_exit_stat_ios;
+	for_each_possible_cpu(cpu)
+		raw_spin_lock_init(&per_cpu_ptr(tg->budget, cpu)->lock);
+
 	throtl_service_queue_init(&tg->service_queue);
 
 	for (rw = READ; rw <= WRITE; rw++) {
 		throtl_qnode_init(&tg->qnode_on_self[rw], tg);
 		throtl_qnode_init(&tg->qnode_on_parent[rw], tg);
+		tg->budget_sweep[rw] = jiffies;
 	}
 
 	RB_CLEAR_NODE(&tg->rb_node);
@@ -376,6 +386,8 @@ static struct blkg_policy_data *throtl_pd_alloc(struct gendisk *disk,
 
 	return &tg->pd;
 
+err_exit_stat_ios:
+	blkg_rwstat_exit(&tg->stat_ios);
 err_exit_stat_bytes:
 	blkg_rwstat_exit(&tg->stat_bytes);
 err_free_tg:
@@ -491,6 +503,7 @@ static void throtl_pd_free(struct blkg_policy_data *pd)
 	struct throtl_grp *tg = pd_to_tg(pd);
 
 	del_timer_sync(&tg->service_queue.pending_timer);
+	free_percpu(tg->budget);
 	blkg_rwstat_exit(&tg->stat_bytes);
 	blkg_rwstat_exit(&tg->stat_ios);
 	kfree(tg);
@@ -577,7 +590,8 @@ static void throtl_dequeue_tg(struct throtl_grp *tg)
 static void throtl_schedule_pending_timer(struct throtl_service_queue *sq,
 					  unsigned long expires)
 {
-	unsigned long max_expire = jiffies + 8 * sq_to_td(sq)->throtl_slice;
+	struct throtl_data *td = sq_to_td(sq);
+	unsigned long max_expire = jiffies + 8 * td->throtl_slice;
 
 	/*
 	 * Since we are adjusting the throttle limit dynamically, the sleep
@@ -588,6 +602,20 @@ static void throtl_schedule_pending_timer(struct throtl_service_queue *sq,
 	 */
 	if (time_after(expires, max_expire))
 		expires = max_expire;
+
+	/*
+	 * Round the delay up to a fraction of the slice so that groups
+	 * becoming dispatchable at about the same time are served by one
+	 * timer run, and leave an earlier armed timer alone: it reschedules
+	 * itself for whatever is still pending once it has dispatched.
+	 */
+	if (time_after(expires, jiffies))
+		expires = jiffies + roundup(expires - jiffies,
+					    max(td->throtl_slice >> 3, 1U));
+	if (timer_pending(&sq->pending_timer) &&
+	    time_before_eq(sq->pending_timer.expires, expires))
+		return;
+
 	mod_timer(&sq->pending_timer, expires);
 	throtl_log(sq, "schedule timer. delay=%lu jiffies=%lu",
 		   expires - jiffies, jiffies);
@@ -637,6 +665,7 @@ static inline void throtl_start_new_slice_with_credit(struct throtl_grp *tg,
 	tg->io_disp[rw] = 0;
 	tg->carryover_bytes[rw] = 0;
 	tg->carryover_ios[rw] = 0;
+	tg->slice_gen[rw]++;
 
 	/*
 	 * Previous slice has expired. We must have trimmed it after last
@@ -659,6 +688,7 @@ static inline void throtl_start_new_slice(struct throtl_grp *tg, bool rw,
 {
 	tg->bytes_disp[rw] = 0;
 	tg->io_disp[rw] = 0;
+	tg->slice_gen[rw]++;
 	tg->slice_start[rw] = jiffies;
 	tg->slice_end[rw] = jiffies + tg->td->throtl_slice;
 	if (clear_carryover) {
@@ -1334,6 +1364,8 @@ static void tg_conf_updated(struct throtl_grp *tg, bool global)
 		struct throtl_grp *parent_tg;
 
 		tg_update_has_rules(this_tg);
+		/* limits changed, drop the per-cpu budgets carved from them */
+		WRITE_ONCE(this_tg->budget_gen, this_tg->budget_gen + 1);
 		/* ignore root/second level */
 		if (!cgroup_subsys_on_dfl(io_cgrp_subsys) || !blkg->parent ||
 		    !blkg->parent->parent)
@@ -2173,16 +2205,234 @@ static void throtl_upgrade_state(struct throtl_data *td)
 }
 #endif
 
+/*
+ * Shrink *@bytes and *@ios to what @tg may still dispatch in direction @rw
+ * in its current slice window, capped at a fraction of one slice's worth.
+ */
+static void tg_budget_headroom(struct throtl_grp *tg, bool rw, u64 *bytes,
+			       unsigned int *ios)
+{
+	unsigned long jiffy_elapsed = jiffies - tg->slice_start[rw];
+	unsigned int slice = tg->td->throtl_slice;
+	u64 bps_limit = tg_bps_limit(tg, rw);
+	u32 iops_limit = tg_iops_limit(tg, rw);
+	long long bytes_allowed;
+	int io_allowed;
+
+	if (tg->flags & THROTL_TG_CANCELING) {
+		*bytes = 0;
+		*ios = 0;
+		return;
+	}
+
+	/* same window as tg_within_bps_limit() */
+	jiffy_elapsed = roundup(jiffy_elapsed ?: slice, slice);
+
+	if (bps_limit != U64_MAX) {
+		bytes_allowed = calculate_bytes_allowed(bps_limit, jiffy_elapsed) +
+				tg->carryover_bytes[rw] - tg->bytes_disp[rw];
+		if (bytes_allowed <= 0)
+			*bytes = 0;
+		else
+			*bytes = min3(*bytes, (u64)bytes_allowed,
+				      calculate_bytes_allowed(bps_limit, slice) >>
+				      THROTL_BUDGET_SHIFT);
+	}
+
+	if (iops_limit != UINT_MAX) {
+		io_allowed = calculate_io_allowed(iops_limit, jiffy_elapsed) +
+			     tg->carryover_ios[rw] - tg->io_disp[rw];
+		if (io_allowed <= 0)
+			*ios = 0;
+		else
+			*ios = min3(*ios, (unsigned int)io_allowed,
+				    calculate_io_allowed(iops_limit, slice) >>
+				    THROTL_BUDGET_SHIFT);
+	}
+}
+
+/*
+ * Changes whenever @tg or one of its ancestors starts a new slice in
+ * direction @rw, as every term only ever grows.
+ */
+static unsigned int tg_slice_gen_sum(struct throtl_grp *tg, bool rw)
+{
+	unsigned int sum = 0;
+
+	for (; tg; tg = sq_to_tg(tg->service_queue.parent_sq))
+		sum += tg->slice_gen[rw];
+	return sum;
+}
+
+/*
+ * Give the unused part of budget @b of @tg back to the levels it was
+ * charged to.  A level that started a new slice since has already forgotten
+ * the charge, so nothing is refunded then.  Called with the queue lock and
+ * @b->lock held.
+ */
+static void throtl_refund_budget(struct throtl_grp *tg,
+				 struct throtl_budget *b, bool rw)
+{
+	u64 bytes = b->bytes[rw];
+	unsigned int ios = b->ios[rw];
+	struct throtl_grp *pos;
+
+	b->bytes[rw] = 0;
+	b->ios[rw] = 0;
+
+	if (b->slice_gen[rw] != tg_slice_gen_sum(tg, rw))
+		return;
+
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq)) {
+		if (bytes != U64_MAX)
+			pos->bytes_disp[rw] -= min(pos->bytes_disp[rw], bytes);
+		if (ios != UINT_MAX)
+			pos->io_disp[rw] -= min(pos->io_disp[rw], ios);
+	}
+}
+
+/*
+ * Refund the budgets of @tg that other cpus let expire, at most once per
+ * slice.  Called with the queue lock held.
+ */
+static void throtl_sweep_budgets(struct throtl_grp *tg, bool rw)
+{
+	struct throtl_budget *b;
+	int cpu;
+
+	if (time_before(jiffies, tg->budget_sweep[rw]))
+		return;
+	tg->budget_sweep[rw] = jiffies + tg->td->throtl_slice;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(tg->budget, cpu);
+		raw_spin_lock(&b->lock);
+		if ((b->bytes[rw] || b->ios[rw]) &&
+		    !time_before(jiffies, b->expires[rw]))
+			throtl_refund_budget(tg, b, rw);
+		raw_spin_unlock(&b->lock);
+	}
+}
+
+/**
+ * throtl_reserve_budget - hand spare budget of a hierarchy to this cpu
+ * @tg: the leaf throtl_grp a bio was just passed through
+ * @rw: direction
+ * @bytes: bytes every level of the hierarchy can spare
+ * @ios: ios every level of the hierarchy can spare
+ *
+ * Charge @bytes and @ios to @tg and all its ancestors right away and let
+ * throtl_consume_budget() pass bios of @tg on this cpu against them without
+ * the queue lock.  The reservation expires after one throtl_slice: every
+ * level extended its slice to at least that long when the bio was checked,
+ * so the charge can't be forgotten by a new slice while it is being used.
+ * Whatever isn't used by then is refunded when this cpu reserves again or
+ * by throtl_sweep_budgets().
+ */
+static void throtl_reserve_budget(struct throtl_grp *tg, bool rw, u64 bytes,
+				  unsigned int ios)
+{
+	struct throtl_budget *b = this_cpu_ptr(tg->budget);
+	struct throtl_grp *pos;
+	unsigned int slice_gen;
+
+	lockdep_assert_held(&tg->td->queue->queue_lock);
+
+	if (!bytes || !ios || tg->td->limit_valid[LIMIT_LOW])
+		return;
+	slice_gen = tg_slice_gen_sum(tg, rw);
+
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq)) {
+		if (bytes != U64_MAX)
+			pos->bytes_disp[rw] += bytes;
+		if (ios != UINT_MAX)
+			pos->io_disp[rw] += ios;
+	}
+
+	raw_spin_lock(&b->lock);
+	/* still covered by the same slices, keep the leftover */
+	if (b->gen[rw] == tg->budget_gen && b->ios[rw] &&
+	    b->slice_gen[rw] == slice_gen &&
+	    time_before(jiffies, b->expires[rw])) {
+		if (bytes != U64_MAX)
+			bytes += b->bytes[rw];
+		if (ios != UINT_MAX)
+			ios += b->ios[rw];
+	} else if (b->bytes[rw] || b->ios[rw]) {
+		throtl_refund_budget(tg, b, rw);
+	}
+
+	b->bytes[rw] = bytes;
+	b->ios[rw] = ios;
+	b->gen[rw] = tg->budget_gen;
+	b->slice_gen[rw] = slice_gen;
+	b->expires[rw] = jiffies + tg->td->throtl_slice;
+	raw_spin_unlock(&b->lock);
+}
+
+/*
+ * Fast path without the queue lock: pass @bio if this cpu holds enough
+ * budget reserved for its group and nothing is queued in the way.
+ */
+static bool throtl_consume_budget(struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+	unsigned int size = 0;
+	struct throtl_budget *b;
+	struct throtl_grp *pos;
+	unsigned long flags;
+	bool ret = false;
+
+	if (READ_ONCE(tg->td->limit_valid[LIMIT_LOW]))
+		return false;
+
+	/* throtl is FIFO - if bios are already queued, take the slow path */
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq))
+		if (READ_ONCE(pos->service_queue.nr_queued[rw]))
+			return false;
+
+	if (!bio_flagged(bio, BIO_BPS_THROTTLED))
+		size = throtl_bio_data_size(bio);
+
+	local_irq_save(flags);
+	b = this_cpu_ptr(tg->budget);
+	raw_spin_lock(&b->lock);
+	if (b->gen[rw] == READ_ONCE(tg->budget_gen) && b->ios[rw] &&
+	    b->bytes[rw] >= size && time_before(jiffies, b->expires[rw])) {
+		if (b->bytes[rw] != U64_MAX)
+			b->bytes[rw] -= size;
+		if (b->ios[rw] != UINT_MAX)
+			b->ios[rw]--;
+		ret = true;
+	}
+	raw_spin_unlock(&b->lock);
+	local_irq_restore(flags);
+
+	return ret;
+}
+
 bool __blk_throtl_bio(struct bio *bio)
 {
 	struct request_queue *q = bdev_get_queue(bio->bi_bdev);
 	struct blkcg_gq *blkg = bio->bi_blkg;
 	struct throtl_qnode *qn = NULL;
 	struct throtl_grp *tg = blkg_to_tg(blkg);
+	struct throtl_grp *leaf_tg = tg;
 	struct throtl_service_queue *sq;
 	bool rw = bio_data_dir(bio);
 	bool throttled = false;
 	struct throtl_data *td = tg->td;
+	u64 budget_bytes = U64_MAX;
+	unsigned int budget_ios = UINT_MAX;
+
+	if (throtl_consume_budget(tg, bio)) {
+		bio_set_flag(bio, BIO_BPS_THROTTLED);
+#ifdef CONFIG_BLK_DEV_THROTTLING_LOW
+		if (!td->track_bio_latency)
+			bio->bi_issue.value |= BIO_ISSUE_THROTL_SKIP_LATENCY;
+#endif
+		return false;
+	}
 
 	rcu_read_lock();
 
@@ -2192,6 +2442,8 @@ bool __blk_throtl_bio(struct bio *bio)
 
 	blk_throtl_update_idletime(tg);
 
+	throtl_sweep_budgets(tg, rw);
+
 	sq = &tg->service_queue;
 
 again:
@@ -2229,6 +2481,7 @@ bool __blk_throtl_bio(struct bio *bio)
 		 * So keep on trimming slice even if bio is not queued.
 		 */
 		throtl_trim_slice(tg, rw);
+		tg_budget_headroom(tg, rw, &budget_bytes, &budget_ios);
 
 		/*
 		 * @bio passed through this layer without being throttled.
@@ -2240,6 +2493,8 @@ bool __blk_throtl_bio(struct bio *bio)
 		tg = sq_to_tg(sq);
 		if (!tg) {
 			bio_set_flag(bio, BIO_BPS_THROTTLED);
+			throtl_reserve_budget(leaf_tg, rw, budget_bytes,
+					      budget_ios);
 			goto out_unlock;
 		}
 	}
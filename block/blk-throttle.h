@@ -52,6 +52,21 @@ struct throtl_service_queue {
 	struct timer_list	pending_timer;	/* fires on first_pending_disptime */
 };
 
+/*
+ * Budget reserved from the whole hierarchy by the slow path and handed to a
+ * single CPU, so that bios which stay within their limits can be passed
+ * without taking the queue lock.  U64_MAX/UINT_MAX mean the direction isn't
+ * limited in that dimension.  See throtl_reserve_budget().
+ */
+struct throtl_budget {
+	raw_spinlock_t		lock;		/* against refunds from other cpus */
+	u64			bytes[2];
+	unsigned int		ios[2];
+	unsigned int		gen[2];		/* throtl_grp->budget_gen */
+	unsigned int		slice_gen[2];	/* tg_slice_gen_sum() when charged */
+	unsigned long		expires[2];	/* in jiffies */
+};
+
 enum tg_state_flags {
 	THROTL_TG_PENDING	= 1 << 0,	/* on parent's pending tree */
 	THROTL_TG_WAS_EMPTY	= 1 << 1,	/* bio_lists[] became non-empty */
@@ -97,6 +112,14 @@ struct throtl_grp {
 
 	unsigned int flags;
 
+	/* per-cpu budgets, invalidated by bumping budget_gen */
+	struct throtl_budget __percpu *budget;
+	unsigned int budget_gen;
+	/* next time expired budgets are refunded */
+	unsigned long budget_sweep[2];
+	/* bumped whenever a new slice starts */
+	unsigned int slice_gen[2];
+
 	/* are there any throtl rules between this group and td? */
 	bool has_rules_bps[2];
 	bool has_rules_iops[2];
@@ -37,6 +37,11 @@ static const int prio_aging_expire = 10 * HZ;
 static const int writes_starved = 2;    /* max times reads can starve a write */
 static const int fifo_batch = 16;       /* # of sequential requests treated as one
 				     by the above parameters. For throughput. */
+/*
+ * Number of requests selected per dd->lock acquisition in
+ * dd_dispatch_request().
+ */
+static const int dispatch_batch = 4;
 
 enum dd_data_dir {
 	DD_READ		= READ,
@@ -54,6 +59,12 @@ enum dd_prio {
 
 enum { DD_PRIO_COUNT = 3 };
 
+/* Bits in deadline_data.run_state. */
+enum {
+	DD_DISPATCHING	= 0,
+	DD_RERUN	= 1,
+};
+
 /*
  * I/O statistics per I/O priority. It is fine if these counters overflow.
  * What matters is that these counters are at least as wide as
@@ -96,6 +107,7 @@ struct deadline_data {
 	 */
 	int fifo_expire[DD_DIR_COUNT];
 	int fifo_batch;
+	int dispatch_batch;
 	int writes_starved;
 	int front_merges;
 	u32 async_depth;
@@ -103,6 +115,24 @@ struct deadline_data {
 
 	spinlock_t lock;
 	spinlock_t zone_lock;
+
+	unsigned long run_state;
+
+	/*
+	 * Requests selected by the last dd->lock acquisition and not yet
+	 * returned by dd_dispatch_request(). Only accessed while holding
+	 * the DD_DISPATCHING bit.
+	 */
+	struct list_head dispatch_ready;
+
+	/*
+	 * Inserted requests wait here until the next dispatch or bio merge
+	 * moves them to the per-priority lists, so that inserting does not
+	 * contend on dd->lock.
+	 */
+	spinlock_t insert_lock ____cacheline_aligned_in_smp;
+	struct list_head at_head;
+	struct list_head at_tail;
 };
 
 /* Maps an I/O priority class to a deadline scheduler priority. */
@@ -585,25 +615,17 @@ static struct request *dd_dispatch_prio_aged_requests(struct deadline_data *dd,
 	return NULL;
 }
 
-/*
- * Called from blk_mq_run_hw_queue() -> __blk_mq_sched_dispatch_requests().
- *
- * One confusing aspect here is that we get called for a specific
- * hardware queue, but we may return a request that is for a
- * different hardware queue. This is because mq-deadline has shared
- * state for all hardware queues, in terms of sorting, FIFOs, etc.
- */
-static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
+static struct request *dd_dispatch_one(struct deadline_data *dd,
+				       unsigned long now)
 {
-	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
-	const unsigned long now = jiffies;
 	struct request *rq;
 	enum dd_prio prio;
 
-	spin_lock(&dd->lock);
+	lockdep_assert_held(&dd->lock);
+
 	rq = dd_dispatch_prio_aged_requests(dd, now);
 	if (rq)
-		goto unlock;
+		return rq;
 
 	/*
 	 * Next, dispatch requests in priority order. Ignore lower priority
@@ -615,9 +637,111 @@ static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
 			break;
 	}
 
-unlock:
+	return rq;
+}
+
+static void dd_insert_request(struct request_queue *q, struct request *rq,
+			      blk_insert_t flags, struct list_head *free);
+
+/*
+ * Move the requests inserted by dd_insert_requests() to the per-priority
+ * sort and fifo lists. Called before dispatching and before merging, so
+ * that requests do not stay invisible to bio merging.
+ */
+static void dd_sort_insert_lists(struct request_queue *q,
+				 struct deadline_data *dd,
+				 struct list_head *free)
+{
+	LIST_HEAD(at_head);
+	LIST_HEAD(at_tail);
+	struct request *rq;
+
+	lockdep_assert_held(&dd->lock);
+
+	spin_lock(&dd->insert_lock);
+	list_splice_init(&dd->at_head, &at_head);
+	list_splice_init(&dd->at_tail, &at_tail);
+	spin_unlock(&dd->insert_lock);
+
+	while (!list_empty(&at_head)) {
+		rq = list_first_entry(&at_head, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		dd_insert_request(q, rq, BLK_MQ_INSERT_AT_HEAD, free);
+	}
+
+	while (!list_empty(&at_tail)) {
+		rq = list_first_entry(&at_tail, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		dd_insert_request(q, rq, 0, free);
+	}
+}
+
+static bool dd_has_work(struct blk_mq_hw_ctx *hctx);
+
+/*
+ * Called from blk_mq_run_hw_queue() -> __blk_mq_sched_dispatch_requests().
+ *
+ * One confusing aspect here is that we get called for a specific
+ * hardware queue, but we may return a request that is for a
+ * different hardware queue. This is because mq-deadline has shared
+ * state for all hardware queues, in terms of sorting, FIFOs, etc.
+ *
+ * Up to dispatch_batch requests are selected per dd->lock acquisition.
+ * The first one is returned and the others are handed out by the next
+ * calls without taking dd->lock.
+ *
+ * Only one context dispatches at a time. A context that finds
+ * DD_DISPATCHING set returns NULL, which makes blk_mq_do_dispatch_sched()
+ * rerun its queue only after BLK_MQ_BUDGET_DELAY. To avoid that delay the
+ * loser sets DD_RERUN and the holder reruns the hardware queues right
+ * away if there is still work once it has cleared DD_DISPATCHING.
+ */
+static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
+	const unsigned long now = jiffies;
+	struct request *rq = NULL, *next;
+	LIST_HEAD(free);
+	int i;
+
+retry:
+	if (test_bit(DD_DISPATCHING, &dd->run_state) ||
+	    test_and_set_bit_lock(DD_DISPATCHING, &dd->run_state)) {
+		set_bit(DD_RERUN, &dd->run_state);
+		/* Pairs with the barrier after clearing DD_DISPATCHING. */
+		smp_mb__after_atomic();
+		if (!test_bit(DD_DISPATCHING, &dd->run_state))
+			goto retry;
+		return NULL;
+	}
+
+	rq = list_first_entry_or_null(&dd->dispatch_ready, struct request,
+				      queuelist);
+	if (rq) {
+		list_del_init(&rq->queuelist);
+		goto out;
+	}
+
+	spin_lock(&dd->lock);
+	dd_sort_insert_lists(hctx->queue, dd, &free);
+	for (i = 0; i < dd->dispatch_batch; i++) {
+		next = dd_dispatch_one(dd, now);
+		if (!next)
+			break;
+		if (!rq)
+			rq = next;
+		else
+			list_add_tail(&next->queuelist, &dd->dispatch_ready);
+	}
 	spin_unlock(&dd->lock);
 
+	blk_mq_free_requests(&free);
+out:
+	clear_bit_unlock(DD_DISPATCHING, &dd->run_state);
+	smp_mb__after_atomic();
+	if (test_bit(DD_RERUN, &dd->run_state) &&
+	    test_and_clear_bit(DD_RERUN, &dd->run_state) && dd_has_work(hctx))
+		blk_mq_run_hw_queues(hctx->queue, true);
 	return rq;
 }
 
@@ -664,6 +788,10 @@ static void dd_exit_sched(struct elevator_queue *e)
 	struct deadline_data *dd = e->elevator_data;
 	enum dd_prio prio;
 
+	WARN_ON_ONCE(!list_empty(&dd->dispatch_ready));
+	WARN_ON_ONCE(!list_empty(&dd->at_head));
+	WARN_ON_ONCE(!list_empty(&dd->at_tail));
+
 	for (prio = 0; prio <= DD_PRIO_MAX; prio++) {
 		struct dd_per_prio *per_prio = &dd->per_prio[prio];
 		const struct io_stats_per_prio *stats = &per_prio->stats;
@@ -720,9 +848,14 @@ static int dd_init_sched(struct request_queue *q, struct elevator_type *e)
 	dd->front_merges = 1;
 	dd->last_dir = DD_WRITE;
 	dd->fifo_batch = fifo_batch;
+	dd->dispatch_batch = dispatch_batch;
 	dd->prio_aging_expire = prio_aging_expire;
 	spin_lock_init(&dd->lock);
 	spin_lock_init(&dd->zone_lock);
+	INIT_LIST_HEAD(&dd->dispatch_ready);
+	spin_lock_init(&dd->insert_lock);
+	INIT_LIST_HEAD(&dd->at_head);
+	INIT_LIST_HEAD(&dd->at_tail);
 
 	/* We dispatch from request queue wide instead of hw queue */
 	blk_queue_flag_set(QUEUE_FLAG_SQ_SCHED, q);
@@ -776,14 +909,17 @@ static bool dd_bio_merge(struct request_queue *q, struct bio *bio,
 {
 	struct deadline_data *dd = q->elevator->elevator_data;
 	struct request *free = NULL;
+	LIST_HEAD(free_list);
 	bool ret;
 
 	spin_lock(&dd->lock);
+	dd_sort_insert_lists(q, dd, &free_list);
 	ret = blk_mq_sched_try_merge(q, bio, nr_segs, &free);
 	spin_unlock(&dd->lock);
 
 	if (free)
 		blk_mq_free_request(free);
+	blk_mq_free_requests(&free_list);
 
 	return ret;
 }
@@ -791,10 +927,9 @@ static bool dd_bio_merge(struct request_queue *q, struct bio *bio,
 /*
  * add rq to rbtree and fifo
  */
-static void dd_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
+static void dd_insert_request(struct request_queue *q, struct request *rq,
 			      blk_insert_t flags, struct list_head *free)
 {
-	struct request_queue *q = hctx->queue;
 	struct deadline_data *dd = q->elevator->elevator_data;
 	const enum dd_data_dir data_dir = rq_data_dir(rq);
 	u16 ioprio = req_get_ioprio(rq);
@@ -859,6 +994,10 @@ static void dd_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
 
 /*
  * Called from blk_mq_insert_request() or blk_mq_dispatch_plug_list().
+ *
+ * The whole list is queued on dd->at_head or dd->at_tail under
+ * dd->insert_lock only. dd_sort_insert_lists() sorts the requests in when
+ * the queue is run next or a bio merge is attempted.
  */
 static void dd_insert_requests(struct blk_mq_hw_ctx *hctx,
 			       struct list_head *list,
@@ -866,19 +1005,13 @@ static void dd_insert_requests(struct blk_mq_hw_ctx *hctx,
 {
 	struct request_queue *q = hctx->queue;
 	struct deadline_data *dd = q->elevator->elevator_data;
-	LIST_HEAD(free);
-
-	spin_lock(&dd->lock);
-	while (!list_empty(list)) {
-		struct request *rq;
-
-		rq = list_first_entry(list, struct request, queuelist);
-		list_del_init(&rq->queuelist);
-		dd_insert_request(hctx, rq, flags, &free);
-	}
-	spin_unlock(&dd->lock);
 
-	blk_mq_free_requests(&free);
+	spin_lock(&dd->insert_lock);
+	if (flags & BLK_MQ_INSERT_AT_HEAD)
+		list_splice_tail_init(list, &dd->at_head);
+	else
+		list_splice_tail_init(list, &dd->at_tail);
+	spin_unlock(&dd->insert_lock);
 }
 
 /* Callback from inside blk_mq_rq_ctx_init(). */
@@ -892,6 +1025,10 @@ static bool dd_has_write_work(struct blk_mq_hw_ctx *hctx)
 	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
 	enum dd_prio p;
 
+	/* Not sorted in yet, may contain writes. */
+	if (!list_empty_careful(&dd->at_tail))
+		return true;
+
 	for (p = 0; p <= DD_PRIO_MAX; p++)
 		if (!list_empty_careful(&dd->per_prio[p].fifo_list[DD_WRITE]))
 			return true;
@@ -957,6 +1094,11 @@ static bool dd_has_work(struct blk_mq_hw_ctx *hctx)
 	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
 	enum dd_prio prio;
 
+	if (!list_empty_careful(&dd->dispatch_ready) ||
+	    !list_empty_careful(&dd->at_head) ||
+	    !list_empty_careful(&dd->at_tail))
+		return true;
+
 	for (prio = 0; prio <= DD_PRIO_MAX; prio++)
 		if (dd_has_work_for_prio(&dd->per_prio[prio]))
 			return true;
@@ -982,6 +1124,7 @@ SHOW_INT(deadline_writes_starved_show, dd->writes_starved);
 SHOW_INT(deadline_front_merges_show, dd->front_merges);
 SHOW_INT(deadline_async_depth_show, dd->async_depth);
 SHOW_INT(deadline_fifo_batch_show, dd->fifo_batch);
+SHOW_INT(deadline_dispatch_batch_show, dd->dispatch_batch);
 #undef SHOW_INT
 #undef SHOW_JIFFIES
 
@@ -1012,6 +1155,7 @@ STORE_INT(deadline_writes_starved_store, &dd->writes_starved, INT_MIN, INT_MAX);
 STORE_INT(deadline_front_merges_store, &dd->front_merges, 0, 1);
 STORE_INT(deadline_async_depth_store, &dd->async_depth, 1, INT_MAX);
 STORE_INT(deadline_fifo_batch_store, &dd->fifo_batch, 0, INT_MAX);
+STORE_INT(deadline_dispatch_batch_store, &dd->dispatch_batch, 1, 256);
 #undef STORE_FUNCTION
 #undef STORE_INT
 #undef STORE_JIFFIES
@@ -1026,6 +1170,7 @@ static struct elv_fs_entry deadline_attrs[] = {
 	DD_ATTR(front_merges),
 	DD_ATTR(async_depth),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(dispatch_batch),
 	DD_ATTR(prio_aging_expire),
 	__ATTR_NULL
 };
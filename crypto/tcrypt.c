@@ -70,6 +70,10 @@ static unsigned int klen;
 static char *tvmem[TVMEMSIZE];
 
 static const int block_sizes[] = { 16, 64, 128, 256, 1024, 1420, 4096, 0 };
+/* dm-crypt sector sizes, see mode 611 */
+static const int sector_sizes[] = { 512, 4096, 0 };
+/* block sizes of the skcipher speed tests */
+static const int *skcipher_sizes = block_sizes;
 static const int aead_sizes[] = { 16, 64, 256, 512, 1024, 1420, 4096, 8192, 0 };
 
 #define XBUFSIZE 8
@@ -1116,7 +1120,7 @@ static void test_mb_skcipher_speed(const char *algo, int enc, int secs,
 
 	i = 0;
 	do {
-		b_size = block_sizes;
+		b_size = skcipher_sizes;
 		do {
 			u32 bs = round_up(*b_size, crypto_skcipher_blocksize(tfm));
 
@@ -1332,7 +1336,7 @@ static void test_skcipher_speed(const char *algo, int enc, unsigned int secs,
 
 	i = 0;
 	do {
-		b_size = block_sizes;
+		b_size = skcipher_sizes;
 
 		do {
 			u32 bs = round_up(*b_size, crypto_skcipher_blocksize(tfm));
@@ -2880,6 +2884,24 @@ static int do_test(const char *alg, u32 type, u32 mask, int m, u32 num_mb)
 				       speed_template_16_32, num_mb);
 		break;
 
+	/*
+	 * dm-crypt sectors: one request at a time, as a sync cipher sees
+	 * them, against num_mb requests in flight, as an async cipher sees
+	 * a batch.  With sec=0 the cycles per request are reported.
+	 */
+	case 611:
+		skcipher_sizes = sector_sizes;
+		test_cipher_speed("xts(aes)", ENCRYPT, sec, NULL, 0,
+				  speed_template_32_64);
+		test_cipher_speed("xts(aes)", DECRYPT, sec, NULL, 0,
+				  speed_template_32_64);
+		test_mb_skcipher_speed("xts(aes)", ENCRYPT, sec, NULL, 0,
+				       speed_template_32_64, num_mb);
+		test_mb_skcipher_speed("xts(aes)", DECRYPT, sec, NULL, 0,
+				       speed_template_32_64, num_mb);
+		skcipher_sizes = block_sizes;
+		break;
+
 	}
 
 	return ret;
@@ -65,11 +65,15 @@ struct loop_device {
 	struct workqueue_struct *workqueue;
 	struct work_struct      rootcg_work;
 	struct list_head        rootcg_cmd_list;
+	struct work_struct      nowait_work;
+	struct list_head        nowait_cmd_list;
 	struct list_head        idle_worker_list;
 	struct rb_root          worker_tree;
 	struct timer_list       timer;
 	bool			use_dio;
 	bool			sysfs_inited;
+	/* writes which failed with IOCB_NOWAIT and went to the workers */
+	atomic_t		lo_nr_blocking_writes;
 
 	struct request_queue	*lo_queue;
 	struct blk_mq_tag_set	tag_set;
@@ -81,6 +85,8 @@ struct loop_device {
 struct loop_cmd {
 	struct list_head list_entry;
 	bool use_aio; /* use AIO interface to handle I/O */
+	bool nowait; /* aio issued with IOCB_NOWAIT from loop_nowait_workfn() */
+	bool blocking_write; /* counted in lo_nr_blocking_writes */
 	atomic_t ref; /* only for aio */
 	long ret;
 	struct kiocb iocb;
@@ -339,6 +345,13 @@ static void lo_complete_rq(struct request *rq)
 	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
 	blk_status_t ret = BLK_STS_OK;
 
+	if (cmd->blocking_write) {
+		struct loop_device *lo = rq->q->queuedata;
+
+		atomic_dec(&lo->lo_nr_blocking_writes);
+		cmd->blocking_write = false;
+	}
+
 	if (!cmd->use_aio || cmd->ret < 0 || cmd->ret == blk_rq_bytes(rq) ||
 	    req_op(rq) != REQ_OP_READ) {
 		if (cmd->ret < 0)
@@ -369,6 +382,37 @@ static void lo_complete_rq(struct request *rq)
 	}
 }
 
+static void loop_queue_work(struct loop_device *lo, struct loop_cmd *cmd);
+
+/*
+ * The IOCB_NOWAIT attempt from loop_nowait_workfn() is done. Returns true if
+ * it would have blocked and the command has been handed to the workers.
+ */
+static bool lo_rw_aio_nowait_done(struct loop_cmd *cmd)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct loop_device *lo = rq->q->queuedata;
+
+	cmd->nowait = false;
+	if (cmd->ret != -EAGAIN) {
+		/* loop_handle_cmd() didn't run, drop the reference here */
+		if (cmd->memcg_css)
+			css_put(cmd->memcg_css);
+		return false;
+	}
+
+	/*
+	 * Writes mostly block on allocating blocks of sparse backing files,
+	 * so don't try the next ones without blocking until this one is done.
+	 */
+	if (req_op(rq) == REQ_OP_WRITE) {
+		cmd->blocking_write = true;
+		atomic_inc(&lo->lo_nr_blocking_writes);
+	}
+	loop_queue_work(lo, cmd);
+	return true;
+}
+
 static void lo_rw_aio_do_completion(struct loop_cmd *cmd)
 {
 	struct request *rq = blk_mq_rq_from_pdu(cmd);
@@ -377,6 +421,8 @@ static void lo_rw_aio_do_completion(struct loop_cmd *cmd)
 		return;
 	kfree(cmd->bvec);
 	cmd->bvec = NULL;
+	if (cmd->nowait && lo_rw_aio_nowait_done(cmd))
+		return;
 	if (likely(!blk_should_fake_timeout(rq->q)))
 		blk_mq_complete_request(rq);
 }
@@ -444,6 +490,8 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 	cmd->iocb.ki_filp = file;
 	cmd->iocb.ki_complete = lo_rw_aio_complete;
 	cmd->iocb.ki_flags = IOCB_DIRECT;
+	if (cmd->nowait)
+		cmd->iocb.ki_flags |= IOCB_NOWAIT;
 	cmd->iocb.ki_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
 
 	if (rw == ITER_SOURCE)
@@ -458,6 +506,64 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 	return 0;
 }
 
+static bool loop_can_nowait(struct loop_device *lo, struct loop_cmd *cmd)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+	if (!cmd->use_aio || !(lo->lo_backing_file->f_mode & FMODE_NOWAIT))
+		return false;
+
+	if (req_op(rq) == REQ_OP_WRITE &&
+	    ((lo->lo_flags & LO_FLAGS_READ_ONLY) ||
+	     atomic_read(&lo->lo_nr_blocking_writes)))
+		return false;
+
+	return true;
+}
+
+/*
+ * Issue direct IO to the backing file with IOCB_NOWAIT, on behalf of the
+ * request's cgroups. If it would block, lo_rw_aio_nowait_done() hands the
+ * command to the per-cgroup worker.
+ */
+static bool loop_try_nowait(struct loop_device *lo, struct loop_cmd *cmd)
+{
+	struct cgroup_subsys_state *cmd_blkcg_css = cmd->blkcg_css;
+	struct cgroup_subsys_state *cmd_memcg_css = cmd->memcg_css;
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	loff_t pos = ((loff_t) blk_rq_pos(rq) << 9) + lo->lo_offset;
+	struct mem_cgroup *old_memcg = NULL;
+	int ret;
+
+	/*
+	 * The command may complete and drop its memcg reference before
+	 * lo_rw_aio() returns, hold our own while the memcg is active.
+	 */
+	if (cmd_blkcg_css)
+		kthread_associate_blkcg(cmd_blkcg_css);
+	if (cmd_memcg_css) {
+		css_get(cmd_memcg_css);
+		old_memcg = set_active_memcg(
+			mem_cgroup_from_css(cmd_memcg_css));
+	}
+
+	cmd->nowait = true;
+	ret = lo_rw_aio(lo, cmd, pos, req_op(rq) == REQ_OP_WRITE ?
+			ITER_SOURCE : ITER_DEST);
+	if (ret) {
+		/* nothing was issued, let the worker retry */
+		cmd->nowait = false;
+	}
+
+	if (cmd_blkcg_css)
+		kthread_associate_blkcg(NULL);
+	if (cmd_memcg_css) {
+		set_active_memcg(old_memcg);
+		css_put(cmd_memcg_css);
+	}
+	return !ret;
+}
+
 static int do_req_filebacked(struct loop_device *lo, struct request *rq)
 {
 	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
@@ -826,14 +932,19 @@ static inline int queue_on_root_worker(struct cgroup_subsys_state *css)
 }
 #endif
 
+/*
+ * Called from loop_queue_rq(), loop_nowait_workfn() or, for IOCB_NOWAIT
+ * retries, aio completion.
+ */
 static void loop_queue_work(struct loop_device *lo, struct loop_cmd *cmd)
 {
 	struct rb_node **node, *parent = NULL;
 	struct loop_worker *cur_worker, *worker = NULL;
 	struct work_struct *work;
 	struct list_head *cmd_list;
+	unsigned long flags;
 
-	spin_lock_irq(&lo->lo_work_lock);
+	spin_lock_irqsave(&lo->lo_work_lock, flags);
 
 	if (queue_on_root_worker(cmd->blkcg_css))
 		goto queue_work;
@@ -893,6 +1004,19 @@ static void loop_queue_work(struct loop_device *lo, struct loop_cmd *cmd)
 	}
 	list_add_tail(&cmd->list_entry, cmd_list);
 	queue_work(lo->workqueue, work);
+	spin_unlock_irqrestore(&lo->lo_work_lock, flags);
+}
+
+/*
+ * Direct IO that can be issued with IOCB_NOWAIT goes to a single work item
+ * instead of the per-cgroup workers. ->queue_rq() must not sleep, and that
+ * work item does not get stuck behind IO that blocks.
+ */
+static void loop_queue_nowait(struct loop_device *lo, struct loop_cmd *cmd)
+{
+	spin_lock_irq(&lo->lo_work_lock);
+	list_add_tail(&cmd->list_entry, &lo->nowait_cmd_list);
+	queue_work(lo->workqueue, &lo->nowait_work);
 	spin_unlock_irq(&lo->lo_work_lock);
 }
 
@@ -1877,7 +2001,10 @@ static blk_status_t loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 #endif
 	}
 #endif
-	loop_queue_work(lo, cmd);
+	if (loop_can_nowait(lo, cmd))
+		loop_queue_nowait(lo, cmd);
+	else
+		loop_queue_work(lo, cmd);
 
 	return BLK_STS_OK;
 }
@@ -1935,18 +2062,28 @@ static void loop_process_work(struct loop_worker *worker,
 			struct list_head *cmd_list, struct loop_device *lo)
 {
 	int orig_flags = current->flags;
-	struct loop_cmd *cmd;
+	struct loop_cmd *cmd, *next;
+	struct blk_plug plug;
+	LIST_HEAD(batch);
 
 	current->flags |= PF_LOCAL_THROTTLE | PF_MEMALLOC_NOIO;
 	spin_lock_irq(&lo->lo_work_lock);
 	while (!list_empty(cmd_list)) {
-		cmd = container_of(
-			cmd_list->next, struct loop_cmd, list_entry);
-		list_del(cmd_list->next);
+		/*
+		 * Grab everything queued so far and issue it under one plug,
+		 * so the backing device sees it as a batch and can merge
+		 * adjacent IO.
+		 */
+		list_splice_init(cmd_list, &batch);
 		spin_unlock_irq(&lo->lo_work_lock);
 
-		loop_handle_cmd(cmd);
-		cond_resched();
+		blk_start_plug(&plug);
+		list_for_each_entry_safe(cmd, next, &batch, list_entry) {
+			list_del(&cmd->list_entry);
+			loop_handle_cmd(cmd);
+			cond_resched();
+		}
+		blk_finish_plug(&plug);
 
 		spin_lock_irq(&lo->lo_work_lock);
 	}
@@ -1979,6 +2116,31 @@ static void loop_rootcg_workfn(struct work_struct *work)
 	loop_process_work(NULL, &lo->rootcg_cmd_list, lo);
 }
 
+static void loop_nowait_workfn(struct work_struct *work)
+{
+	struct loop_device *lo =
+		container_of(work, struct loop_device, nowait_work);
+	int orig_flags = current->flags;
+	struct loop_cmd *cmd, *next;
+	struct blk_plug plug;
+	LIST_HEAD(batch);
+
+	spin_lock_irq(&lo->lo_work_lock);
+	list_splice_init(&lo->nowait_cmd_list, &batch);
+	spin_unlock_irq(&lo->lo_work_lock);
+
+	current->flags |= PF_LOCAL_THROTTLE | PF_MEMALLOC_NOIO;
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(cmd, next, &batch, list_entry) {
+		list_del(&cmd->list_entry);
+		if (!loop_try_nowait(lo, cmd))
+			loop_queue_work(lo, cmd);
+		cond_resched();
+	}
+	blk_finish_plug(&plug);
+	current->flags = orig_flags;
+}
+
 static const struct blk_mq_ops loop_mq_ops = {
 	.queue_rq       = loop_queue_rq,
 	.complete	= lo_complete_rq,
@@ -2072,6 +2234,8 @@ static int loop_add(int i)
 	spin_lock_init(&lo->lo_work_lock);
 	INIT_WORK(&lo->rootcg_work, loop_rootcg_workfn);
 	INIT_LIST_HEAD(&lo->rootcg_cmd_list);
+	INIT_WORK(&lo->nowait_work, loop_nowait_workfn);
+	INIT_LIST_HEAD(&lo->nowait_cmd_list);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
 	disk->minors		= 1 << part_shift;
@@ -33,7 +33,9 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <net/sock.h>
+#include <net/tcp.h>
 #include <linux/net.h>
+#include <linux/tcp.h>
 #include <linux/kthread.h>
 #include <linux/types.h>
 #include <linux/debugfs.h>
@@ -60,8 +62,12 @@ struct nbd_sock {
 	struct request *pending;
 	int sent;
 	bool dead;
+	/* last send used MSG_MORE for batching, see nbd_push_socks() */
+	bool corked;
 	int fallback_index;
 	int cookie;
+	/* payload and header bytes of requests waiting for a reply */
+	atomic_long_t inflight_bytes;
 };
 
 struct recv_thread_args {
@@ -150,6 +156,8 @@ struct nbd_cmd {
 	blk_status_t status;
 	unsigned long flags;
 	u32 cmd_cookie;
+	/* socket whose inflight_bytes this request is accounted to */
+	struct nbd_sock *inflight_sock;
 };
 
 #if IS_ENABLED(CONFIG_DEBUG_FS)
@@ -348,6 +356,22 @@ static int nbd_set_size(struct nbd_device *nbd, loff_t bytesize,
 	return 0;
 }
 
+/*
+ * Move the request's bytes to @nsock's inflight_bytes, or drop them if
+ * @nsock is NULL. Called with cmd->lock held.
+ */
+static void nbd_cmd_account(struct nbd_cmd *cmd, struct nbd_sock *nsock)
+{
+	long bytes = blk_rq_bytes(blk_mq_rq_from_pdu(cmd)) +
+		sizeof(struct nbd_request);
+
+	if (cmd->inflight_sock)
+		atomic_long_sub(bytes, &cmd->inflight_sock->inflight_bytes);
+	cmd->inflight_sock = nsock;
+	if (nsock)
+		atomic_long_add(bytes, &nsock->inflight_bytes);
+}
+
 static void nbd_complete_rq(struct request *req)
 {
 	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
@@ -430,6 +454,7 @@ static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req)
 	if (!config) {
 		cmd->status = BLK_STS_TIMEOUT;
 		__clear_bit(NBD_CMD_INFLIGHT, &cmd->flags);
+		nbd_cmd_account(cmd, NULL);
 		mutex_unlock(&cmd->lock);
 		goto done;
 	}
@@ -461,6 +486,7 @@ static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req)
 					nbd_mark_nsock_dead(nbd, nsock, 1);
 				mutex_unlock(&nsock->tx_lock);
 			}
+			nbd_cmd_account(cmd, NULL);
 			mutex_unlock(&cmd->lock);
 			nbd_requeue_cmd(cmd);
 			nbd_config_put(nbd);
@@ -482,6 +508,7 @@ static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req)
 
 		mutex_lock(&nsock->tx_lock);
 		if (cmd->cookie != nsock->cookie) {
+			nbd_cmd_account(cmd, NULL);
 			nbd_requeue_cmd(cmd);
 			mutex_unlock(&nsock->tx_lock);
 			mutex_unlock(&cmd->lock);
@@ -498,6 +525,7 @@ static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req)
 	set_bit(NBD_RT_TIMEDOUT, &config->runtime_flags);
 	cmd->status = BLK_STS_IOERR;
 	__clear_bit(NBD_CMD_INFLIGHT, &cmd->flags);
+	nbd_cmd_account(cmd, NULL);
 	mutex_unlock(&cmd->lock);
 	sock_shutdown(nbd);
 	nbd_config_put(nbd);
@@ -569,8 +597,15 @@ static inline int was_interrupted(int result)
 	return result == -ERESTARTSYS || result == -EINTR;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
+/*
+ * always call with the tx_lock held
+ *
+ * Unless @last is set, more requests follow right away, so the final send
+ * of this one is done with MSG_MORE too and nbd_push_socks() flushes the
+ * socket once the batch is complete.
+ */
+static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index,
+			bool last)
 {
 	struct request *req = blk_mq_rq_from_pdu(cmd);
 	struct nbd_config *config = nbd->config;
@@ -636,7 +671,7 @@ static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 		req, nbdcmd_to_ascii(type),
 		(unsigned long long)blk_rq_pos(req) << 9, blk_rq_bytes(req));
 	result = sock_xmit(nbd, index, 1, &from,
-			(type == NBD_CMD_WRITE) ? MSG_MORE : 0, &sent);
+			(type == NBD_CMD_WRITE || !last) ? MSG_MORE : 0, &sent);
 	trace_nbd_header_sent(req, handle);
 	if (result < 0) {
 		if (was_interrupted(result)) {
@@ -668,7 +703,17 @@ static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 
 		bio_for_each_segment(bvec, bio, iter) {
 			bool is_last = !next && bio_iter_last(bvec, iter);
-			int flags = is_last ? 0 : MSG_MORE;
+			int flags = is_last && last ? 0 : MSG_MORE;
+
+			/*
+			 * Let the socket take references on the pages instead
+			 * of copying them. The request may complete before
+			 * they were sent, on a timeout or when the requests
+			 * are cleared, but the socket holds its own page
+			 * references and is marked dead and shut down first.
+			 */
+			if (sendpage_ok(bvec.bv_page))
+				flags |= MSG_SPLICE_PAGES;
 
 			dev_dbg(nbd_to_dev(nbd), "request %p: sending %d bytes data\n",
 				req, bvec.bv_len);
@@ -713,9 +758,92 @@ static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 	trace_nbd_payload_sent(req, handle);
 	nsock->pending = NULL;
 	nsock->sent = 0;
+	nsock->corked = !last;
 	return 0;
 }
 
+/*
+ * Push out what MSG_MORE held back on a TCP socket.  Uncorking is how the
+ * TCP stack exports a push, but if userspace corked the socket itself the
+ * data stays queued as it would have without batching, and so does the cork.
+ */
+static void nbd_push_sock(struct sock *sk)
+{
+	bool user_cork;
+
+	lock_sock(sk);
+	user_cork = tcp_sk(sk)->nonagle & TCP_NAGLE_CORK;
+	release_sock(sk);
+
+	if (!user_cork)
+		tcp_sock_set_cork(sk, false);
+}
+
+/* Send out whatever was held back by MSG_MORE on the live sockets. */
+static void nbd_push_socks(struct nbd_device *nbd)
+{
+	struct nbd_config *config;
+	int i;
+
+	config = nbd_get_config_unlocked(nbd);
+	if (!config)
+		return;
+
+	for (i = 0; i < config->num_connections; i++) {
+		struct nbd_sock *nsock = config->socks[i];
+
+		if (!READ_ONCE(nsock->corked))
+			continue;
+
+		mutex_lock(&nsock->tx_lock);
+		if (nsock->corked && !nsock->dead && nsock->sock &&
+		    sk_is_tcp(nsock->sock->sk))
+			nbd_push_sock(nsock->sock->sk);
+		nsock->corked = false;
+		mutex_unlock(&nsock->tx_lock);
+	}
+	nbd_config_put(nbd);
+}
+
+/*
+ * With multiple connections, send to the live one with the fewest bytes
+ * waiting for a reply rather than always to the hctx's own one. Sockets
+ * which still have another request partially sent are skipped.
+ */
+static int nbd_pick_sock(struct nbd_config *config, struct nbd_cmd *cmd,
+			 int index)
+{
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+	long bytes, min_bytes = LONG_MAX;
+	int i, best = index;
+
+	if (config->num_connections == 1)
+		return index;
+
+	/* a partially sent request has to be finished on its socket */
+	if (cmd->index < config->num_connections &&
+	    READ_ONCE(config->socks[cmd->index]->pending) == req)
+		return cmd->index;
+
+	if (!READ_ONCE(config->socks[index]->dead) &&
+	    !READ_ONCE(config->socks[index]->pending))
+		min_bytes = atomic_long_read(&config->socks[index]->inflight_bytes);
+
+	for (i = 0; i < config->num_connections; i++) {
+		struct nbd_sock *nsock = config->socks[i];
+
+		if (i == index || READ_ONCE(nsock->dead) ||
+		    READ_ONCE(nsock->pending))
+			continue;
+		bytes = atomic_long_read(&nsock->inflight_bytes);
+		if (bytes < min_bytes) {
+			min_bytes = bytes;
+			best = i;
+		}
+	}
+	return best;
+}
+
 static int nbd_read_reply(struct nbd_device *nbd, struct socket *sock,
 			  struct nbd_reply *reply)
 {
@@ -884,6 +1012,8 @@ static void recv_work(struct work_struct *work)
 			mutex_lock(&cmd->lock);
 			complete = __test_and_clear_bit(NBD_CMD_INFLIGHT,
 							&cmd->flags);
+			if (complete)
+				nbd_cmd_account(cmd, NULL);
 			mutex_unlock(&cmd->lock);
 			if (complete)
 				blk_mq_complete_request(rq);
@@ -914,6 +1044,7 @@ static bool nbd_clear_req(struct request *req, void *data)
 		mutex_unlock(&cmd->lock);
 		return true;
 	}
+	nbd_cmd_account(cmd, NULL);
 	cmd->status = BLK_STS_IOERR;
 	mutex_unlock(&cmd->lock);
 
@@ -988,7 +1119,7 @@ static int wait_for_reconnect(struct nbd_device *nbd)
 	return !test_bit(NBD_RT_DISCONNECTED, &config->runtime_flags);
 }
 
-static int nbd_handle_cmd(struct nbd_cmd *cmd, int index)
+static int nbd_handle_cmd(struct nbd_cmd *cmd, int index, bool last)
 {
 	struct request *req = blk_mq_rq_from_pdu(cmd);
 	struct nbd_device *nbd = cmd->nbd;
@@ -1010,6 +1141,7 @@ static int nbd_handle_cmd(struct nbd_cmd *cmd, int index)
 		return -EINVAL;
 	}
 	cmd->status = BLK_STS_OK;
+	index = nbd_pick_sock(config, cmd, index);
 again:
 	nsock = config->socks[index];
 	mutex_lock(&nsock->tx_lock);
@@ -1050,13 +1182,15 @@ static int nbd_handle_cmd(struct nbd_cmd *cmd, int index)
 	 * Some failures are related to the link going down, so anything that
 	 * returns EAGAIN can be retried on a different socket.
 	 */
-	ret = nbd_send_cmd(nbd, cmd, index);
+	ret = nbd_send_cmd(nbd, cmd, index, last);
 	/*
 	 * Access to this flag is protected by cmd->lock, thus it's safe to set
 	 * the flag after nbd_send_cmd() succeed to send request to server.
 	 */
-	if (!ret)
+	if (!ret) {
 		__set_bit(NBD_CMD_INFLIGHT, &cmd->flags);
+		nbd_cmd_account(cmd, nsock);
+	}
 	else if (ret == -EAGAIN) {
 		dev_err_ratelimited(disk_to_dev(nbd->disk),
 				    "Request send failed, requeueing\n");
@@ -1093,16 +1227,28 @@ static blk_status_t nbd_queue_rq(struct blk_mq_hw_ctx *hctx,
 	 * this case we need to return that we are busy, otherwise error out as
 	 * appropriate.
 	 */
-	ret = nbd_handle_cmd(cmd, hctx->queue_num);
+	ret = nbd_handle_cmd(cmd, hctx->queue_num, bd->last);
 	if (ret < 0)
 		ret = BLK_STS_IOERR;
 	else if (!ret)
 		ret = BLK_STS_OK;
 	mutex_unlock(&cmd->lock);
 
+	if (bd->last)
+		nbd_push_socks(cmd->nbd);
+
 	return ret;
 }
 
+/*
+ * Called by blk-mq if it stopped dispatching before the request marked
+ * last, e.g. because one returned BLK_STS_RESOURCE.
+ */
+static void nbd_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	nbd_push_socks(hctx->queue->tag_set->driver_data);
+}
+
 static struct socket *nbd_get_socket(struct nbd_device *nbd, unsigned long fd,
 				     int *err)
 {
@@ -1779,6 +1925,7 @@ static int nbd_init_request(struct blk_mq_tag_set *set, struct request *rq,
 
 static const struct blk_mq_ops nbd_mq_ops = {
 	.queue_rq	= nbd_queue_rq,
+	.commit_rqs	= nbd_commit_rqs,
 	.complete	= nbd_complete_rq,
 	.init_request	= nbd_init_request,
 	.timeout	= nbd_xmit_timeout,
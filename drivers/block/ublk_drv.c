@@ -44,6 +44,8 @@
 #include <linux/task_work.h>
 #include <linux/namei.h>
 #include <linux/kref.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <uapi/linux/ublk_cmd.h>
 
 #define UBLK_MINORS		(1U << MINORBITS)
@@ -57,7 +59,8 @@
 		| UBLK_F_UNPRIVILEGED_DEV \
 		| UBLK_F_CMD_IOCTL_ENCODE \
 		| UBLK_F_USER_COPY \
-		| UBLK_F_ZONED)
+		| UBLK_F_ZONED \
+		| UBLK_F_BATCH_IO)
 
 /* All UBLK_PARAM_TYPE_* should be included here */
 #define UBLK_PARAM_TYPE_ALL                                \
@@ -66,6 +69,8 @@
 
 struct ublk_rq_data {
 	struct llist_node node;
+	/* on ubq->batch_pending until handed to ublk server */
+	struct list_head batch_node;
 
 	struct kref ref;
 	__u64 sector;
@@ -75,6 +80,10 @@ struct ublk_rq_data {
 
 struct ublk_uring_cmd_pdu {
 	struct ublk_queue *ubq;
+
+	/* tag array and its capacity of UBLK_U_IO_FETCH_REQS */
+	u16 __user *tags;
+	u16 nr_tags;
 };
 
 /*
@@ -118,6 +127,14 @@ struct ublk_uring_cmd_pdu {
 /* atomic RW with ubq->cancel_lock */
 #define UBLK_IO_FLAG_CANCELED	0x80000000
 
+/* updated from ubq_daemon context only */
+struct ublk_batch_stats {
+	unsigned long	fetch_cmds;
+	unsigned long	fetched_reqs;
+	unsigned long	commit_cmds;
+	unsigned long	committed_reqs;
+};
+
 struct ublk_io {
 	/* userspace buffer address from io cmd */
 	__u64	addr;
@@ -144,6 +161,16 @@ struct ublk_queue {
 	unsigned short nr_io_ready;	/* how many ios setup */
 	spinlock_t		cancel_lock;
 	struct ublk_device *dev;
+
+	/*
+	 * UBLK_F_BATCH_IO: the parked UBLK_U_IO_FETCH_REQS command, and
+	 * requests moved off ->io_cmds which haven't been fetched yet
+	 */
+	spinlock_t		batch_lock;
+	struct io_uring_cmd	*batch_cmd;
+	struct list_head	batch_pending;
+	struct ublk_batch_stats	batch_stats;
+
 	struct ublk_io ios[];
 };
 
@@ -203,6 +230,16 @@ static inline bool ublk_dev_is_user_copy(const struct ublk_device *ub)
 	return ub->dev_info.flags & UBLK_F_USER_COPY;
 }
 
+static inline bool ublk_dev_support_zero_copy(const struct ublk_device *ub)
+{
+	return ub->dev_info.flags & UBLK_F_SUPPORT_ZERO_COPY;
+}
+
+static inline bool ublk_dev_support_batch_io(const struct ublk_device *ub)
+{
+	return ub->dev_info.flags & UBLK_F_BATCH_IO;
+}
+
 static inline bool ublk_dev_is_zoned(const struct ublk_device *ub)
 {
 	return ub->dev_info.flags & UBLK_F_ZONED;
@@ -600,6 +637,11 @@ static inline bool ublk_support_user_copy(const struct ublk_queue *ubq)
 	return ubq->flags & UBLK_F_USER_COPY;
 }
 
+static inline bool ublk_support_batch_io(const struct ublk_queue *ubq)
+{
+	return ubq->flags & UBLK_F_BATCH_IO;
+}
+
 static inline bool ublk_need_req_ref(const struct ublk_queue *ubq)
 {
 	/*
@@ -1233,6 +1275,141 @@ static void ublk_rq_task_work_cb(struct io_uring_cmd *cmd, unsigned issue_flags)
 	ublk_forward_io_cmds(ubq, issue_flags);
 }
 
+/*
+ * Move everything queued on ->io_cmds to ->batch_pending, then take up to
+ * @max requests from its head. Called with ->batch_lock held.
+ */
+static unsigned int ublk_batch_pop_reqs(struct ublk_queue *ubq,
+		struct list_head *reqs, unsigned int max)
+{
+	struct llist_node *io_cmds = llist_del_all(&ubq->io_cmds);
+	struct ublk_rq_data *data, *tmp;
+	unsigned int nr = 0;
+
+	io_cmds = llist_reverse_order(io_cmds);
+	llist_for_each_entry_safe(data, tmp, io_cmds, node)
+		list_add_tail(&data->batch_node, &ubq->batch_pending);
+
+	list_for_each_entry_safe(data, tmp, &ubq->batch_pending, batch_node) {
+		if (nr == max)
+			break;
+		list_move_tail(&data->batch_node, reqs);
+		nr++;
+	}
+	return nr;
+}
+
+static inline bool ublk_batch_has_reqs(struct ublk_queue *ubq)
+{
+	return !llist_empty(&ubq->io_cmds) || !list_empty(&ubq->batch_pending);
+}
+
+/*
+ * Hand queued requests over to ublk server by filling the tag array of
+ * UBLK_U_IO_FETCH_REQS, or park the command again if nothing is queued.
+ */
+static void ublk_batch_fetch_reqs(struct ublk_queue *ubq,
+		struct io_uring_cmd *cmd, unsigned issue_flags)
+{
+	struct ublk_uring_cmd_pdu *pdu = ublk_get_uring_cmd_pdu(cmd);
+	struct ublk_rq_data *data, *tmp;
+	LIST_HEAD(reqs);
+	LIST_HEAD(undelivered);
+	int nr = 0, ret = 0;
+
+	spin_lock(&ubq->batch_lock);
+	if (!ublk_batch_pop_reqs(ubq, &reqs, pdu->nr_tags)) {
+		/* only one UBLK_U_IO_FETCH_REQS can be parked */
+		if (ubq->batch_cmd)
+			ret = -EBUSY;
+		else
+			ubq->batch_cmd = cmd;
+		spin_unlock(&ubq->batch_lock);
+		if (ret)
+			io_uring_cmd_done(cmd, ret, 0, issue_flags);
+		return;
+	}
+	spin_unlock(&ubq->batch_lock);
+
+	list_for_each_entry_safe(data, tmp, &reqs, batch_node) {
+		struct request *req = blk_mq_rq_from_pdu(data);
+		struct ublk_io *io = &ubq->ios[req->tag];
+
+		list_del_init(&data->batch_node);
+
+		/* see __ublk_rq_task_work() */
+		if (unlikely(current != ubq->ubq_daemon ||
+			     current->flags & PF_EXITING)) {
+			__ublk_abort_rq(ubq, req);
+			continue;
+		}
+
+		/* keep what can't be delivered for the next fetch */
+		if (unlikely(ret || put_user(req->tag, &pdu->tags[nr]))) {
+			list_add_tail(&data->batch_node, &undelivered);
+			ret = -EFAULT;
+			continue;
+		}
+
+		/* nothing to map, data is copied via pread()/pwrite() */
+		ublk_init_req_ref(ubq, req);
+		io->flags |= UBLK_IO_FLAG_OWNED_BY_SRV;
+		nr++;
+	}
+
+	if (!list_empty(&undelivered)) {
+		spin_lock(&ubq->batch_lock);
+		list_splice(&undelivered, &ubq->batch_pending);
+		spin_unlock(&ubq->batch_lock);
+	}
+
+	ubq->batch_stats.fetch_cmds++;
+	ubq->batch_stats.fetched_reqs += nr;
+
+	if (nr)
+		ret = nr;
+	else if (!ret)
+		ret = UBLK_IO_RES_ABORT;
+	io_uring_cmd_done(cmd, ret, 0, issue_flags);
+}
+
+static void ublk_batch_task_work_cb(struct io_uring_cmd *cmd,
+		unsigned issue_flags)
+{
+	struct ublk_uring_cmd_pdu *pdu = ublk_get_uring_cmd_pdu(cmd);
+
+	ublk_batch_fetch_reqs(pdu->ubq, cmd, issue_flags);
+}
+
+/* wake up the parked UBLK_U_IO_FETCH_REQS, if there is one */
+static void ublk_batch_kick(struct ublk_queue *ubq)
+{
+	struct io_uring_cmd *cmd;
+
+	spin_lock(&ubq->batch_lock);
+	cmd = ubq->batch_cmd;
+	ubq->batch_cmd = NULL;
+	spin_unlock(&ubq->batch_lock);
+
+	if (cmd)
+		io_uring_cmd_complete_in_task(cmd, ublk_batch_task_work_cb);
+}
+
+static void ublk_batch_abort_reqs(struct ublk_queue *ubq)
+{
+	struct ublk_rq_data *data, *tmp;
+	LIST_HEAD(reqs);
+
+	spin_lock(&ubq->batch_lock);
+	ublk_batch_pop_reqs(ubq, &reqs, UINT_MAX);
+	spin_unlock(&ubq->batch_lock);
+
+	list_for_each_entry_safe(data, tmp, &reqs, batch_node) {
+		list_del_init(&data->batch_node);
+		__ublk_abort_rq(ubq, blk_mq_rq_from_pdu(data));
+	}
+}
+
 static void ublk_queue_cmd(struct ublk_queue *ubq, struct request *rq)
 {
 	struct ublk_rq_data *data = blk_mq_rq_to_pdu(rq);
@@ -1256,6 +1433,8 @@ static void ublk_queue_cmd(struct ublk_queue *ubq, struct request *rq)
 	 */
 	if (unlikely(io->flags & UBLK_IO_FLAG_ABORTED)) {
 		ublk_abort_io_cmds(ubq);
+	} else if (ublk_support_batch_io(ubq)) {
+		ublk_batch_kick(ubq);
 	} else {
 		struct io_uring_cmd *cmd = io->cmd;
 		struct ublk_uring_cmd_pdu *pdu = ublk_get_uring_cmd_pdu(cmd);
@@ -1429,6 +1608,11 @@ static void ublk_abort_queue(struct ublk_device *ub, struct ublk_queue *ubq)
 	for (i = 0; i < ubq->q_depth; i++) {
 		struct ublk_io *io = &ubq->ios[i];
 
+		/* batch io never marks io ACTIVE, only fail fetched ones */
+		if (ublk_support_batch_io(ubq) &&
+		    !(io->flags & UBLK_IO_FLAG_OWNED_BY_SRV))
+			continue;
+
 		if (!(io->flags & UBLK_IO_FLAG_ACTIVE)) {
 			struct request *rq;
 
@@ -1441,6 +1625,9 @@ static void ublk_abort_queue(struct ublk_device *ub, struct ublk_queue *ubq)
 				__ublk_fail_req(ubq, io, rq);
 		}
 	}
+
+	if (ublk_support_batch_io(ubq))
+		ublk_batch_abort_reqs(ubq);
 	ublk_put_device(ub);
 }
 
@@ -1485,6 +1672,20 @@ static void ublk_cancel_queue(struct ublk_queue *ubq)
 {
 	int i;
 
+	if (ublk_support_batch_io(ubq)) {
+		struct io_uring_cmd *cmd;
+
+		spin_lock(&ubq->batch_lock);
+		cmd = ubq->batch_cmd;
+		ubq->batch_cmd = NULL;
+		spin_unlock(&ubq->batch_lock);
+
+		if (cmd)
+			io_uring_cmd_done(cmd, UBLK_IO_RES_ABORT, 0,
+					IO_URING_F_UNLOCKED);
+		return;
+	}
+
 	for (i = 0; i < ubq->q_depth; i++) {
 		struct ublk_io *io = &ubq->ios[i];
 
@@ -1617,10 +1818,11 @@ static void ublk_stop_dev(struct ublk_device *ub)
 }
 
 /* device can only be started after all IOs are ready */
-static void ublk_mark_io_ready(struct ublk_device *ub, struct ublk_queue *ubq)
+static void __ublk_mark_io_ready(struct ublk_device *ub,
+		struct ublk_queue *ubq, unsigned short nr)
 {
 	mutex_lock(&ub->mutex);
-	ubq->nr_io_ready++;
+	ubq->nr_io_ready += nr;
 	if (ublk_queue_ready(ubq)) {
 		ubq->ubq_daemon = current;
 		get_task_struct(ubq->ubq_daemon);
@@ -1634,6 +1836,11 @@ static void ublk_mark_io_ready(struct ublk_device *ub, struct ublk_queue *ubq)
 	mutex_unlock(&ub->mutex);
 }
 
+static void ublk_mark_io_ready(struct ublk_device *ub, struct ublk_queue *ubq)
+{
+	__ublk_mark_io_ready(ub, ubq, 1);
+}
+
 static void ublk_handle_need_get_data(struct ublk_device *ub, int q_id,
 		int tag)
 {
@@ -1664,6 +1871,105 @@ static inline void ublk_fill_io_cmd(struct ublk_io *io,
 	io->addr = buf_addr;
 }
 
+static int ublk_batch_fetch_cmd(struct ublk_device *ub,
+		struct ublk_queue *ubq, struct io_uring_cmd *cmd,
+		const struct ublksrv_io_cmd *ub_cmd, unsigned int issue_flags)
+{
+	struct ublk_uring_cmd_pdu *pdu = ublk_get_uring_cmd_pdu(cmd);
+
+	/* `tag` is the capacity of the tag array pointed by `addr` */
+	if (!ub_cmd->tag || ub_cmd->tag > ubq->q_depth || !ub_cmd->addr)
+		return -EINVAL;
+
+	/* the first FETCH_REQS sets up the whole queue */
+	if (!ublk_queue_ready(ubq))
+		__ublk_mark_io_ready(ub, ubq, ubq->q_depth - ubq->nr_io_ready);
+
+	pdu->ubq = ubq;
+	pdu->tags = u64_to_user_ptr(ub_cmd->addr);
+	pdu->nr_tags = ub_cmd->tag;
+
+	spin_lock(&ubq->batch_lock);
+	if (ubq->batch_cmd) {
+		spin_unlock(&ubq->batch_lock);
+		return -EBUSY;
+	}
+	if (!ublk_batch_has_reqs(ubq)) {
+		ubq->batch_cmd = cmd;
+		spin_unlock(&ubq->batch_lock);
+		return 0;
+	}
+	spin_unlock(&ubq->batch_lock);
+
+	ublk_batch_fetch_reqs(ubq, cmd, issue_flags);
+	return 0;
+}
+
+static int ublk_batch_commit_cmd(struct ublk_device *ub,
+		struct ublk_queue *ubq, const struct ublksrv_io_cmd *ub_cmd)
+{
+	struct ublk_batch_commit __user *elems = u64_to_user_ptr(ub_cmd->addr);
+	int i, ret = -EINVAL;
+
+	/* `tag` is the number of elements in the array pointed by `addr` */
+	if (!ub_cmd->tag || ub_cmd->tag > ubq->q_depth)
+		return -EINVAL;
+
+	for (i = 0; i < ub_cmd->tag; i++) {
+		struct ublk_batch_commit elem;
+		struct ublksrv_io_cmd commit;
+
+		if (copy_from_user(&elem, &elems[i], sizeof(elem))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (elem.tag >= ubq->q_depth || elem.reserved ||
+		    !(ubq->ios[elem.tag].flags & UBLK_IO_FLAG_OWNED_BY_SRV)) {
+			ret = -EINVAL;
+			break;
+		}
+
+		commit = (struct ublksrv_io_cmd) {
+			.q_id		 = ubq->q_id,
+			.tag		 = elem.tag,
+			.result		 = elem.result,
+			.zone_append_lba = elem.zone_append_lba,
+		};
+		ublk_commit_completion(ub, &commit);
+	}
+
+	ubq->batch_stats.commit_cmds++;
+	ubq->batch_stats.committed_reqs += i;
+
+	/* report how many were committed, the server retries from there */
+	return i ? i : ret;
+}
+
+/*
+ * UBLK_F_BATCH_IO replaces the per-tag commands: ios are never ACTIVE,
+ * and the cqe of both commands carries the number of handled requests.
+ */
+static int ublk_ch_batch_cmd(struct ublk_device *ub, struct ublk_queue *ubq,
+		struct io_uring_cmd *cmd, const struct ublksrv_io_cmd *ub_cmd,
+		unsigned int issue_flags)
+{
+	int ret = -EINVAL;
+
+	switch (cmd->cmd_op) {
+	case UBLK_U_IO_FETCH_REQS:
+		ret = ublk_batch_fetch_cmd(ub, ubq, cmd, ub_cmd, issue_flags);
+		if (!ret)
+			return -EIOCBQUEUED;
+		break;
+	case UBLK_U_IO_COMMIT_REQS:
+		ret = ublk_batch_commit_cmd(ub, ubq, ub_cmd);
+		break;
+	}
+
+	io_uring_cmd_done(cmd, ret, 0, issue_flags);
+	return -EIOCBQUEUED;
+}
+
 static int __ublk_ch_uring_cmd(struct io_uring_cmd *cmd,
 			       unsigned int issue_flags,
 			       const struct ublksrv_io_cmd *ub_cmd)
@@ -1690,6 +1996,9 @@ static int __ublk_ch_uring_cmd(struct io_uring_cmd *cmd,
 	if (ubq->ubq_daemon && ubq->ubq_daemon != current)
 		goto out;
 
+	if (ublk_support_batch_io(ubq))
+		return ublk_ch_batch_cmd(ub, ubq, cmd, ub_cmd, issue_flags);
+
 	if (tag >= ubq->q_depth)
 		goto out;
 
@@ -1852,27 +2161,20 @@ static inline bool ublk_check_ubuf_dir(const struct request *req,
 	return false;
 }
 
-static struct request *ublk_check_and_get_req(struct kiocb *iocb,
-		struct iov_iter *iter, size_t *off, int dir)
+static struct request *ublk_check_and_get_req_pos(struct ublk_device *ub,
+		loff_t pos, size_t *off, int dir)
 {
-	struct ublk_device *ub = iocb->ki_filp->private_data;
 	struct ublk_queue *ubq;
 	struct request *req;
 	size_t buf_off;
 	u16 tag, q_id;
 
-	if (!ub)
-		return ERR_PTR(-EACCES);
-
-	if (!user_backed_iter(iter))
-		return ERR_PTR(-EACCES);
-
 	if (ub->dev_info.state == UBLK_S_DEV_DEAD)
 		return ERR_PTR(-EACCES);
 
-	tag = ublk_pos_to_tag(iocb->ki_pos);
-	q_id = ublk_pos_to_hwq(iocb->ki_pos);
-	buf_off = ublk_pos_to_buf_off(iocb->ki_pos);
+	tag = ublk_pos_to_tag(pos);
+	q_id = ublk_pos_to_hwq(pos);
+	buf_off = ublk_pos_to_buf_off(pos);
 
 	if (q_id >= ub->dev_info.nr_hw_queues)
 		return ERR_PTR(-EINVAL);
@@ -1901,6 +2203,24 @@ static struct request *ublk_check_and_get_req(struct kiocb *iocb,
 	return ERR_PTR(-EACCES);
 }
 
+static struct request *ublk_check_and_get_req(struct kiocb *iocb,
+		struct iov_iter *iter, size_t *off, int dir)
+{
+	struct ublk_device *ub = iocb->ki_filp->private_data;
+
+	if (!ub)
+		return ERR_PTR(-EACCES);
+
+	/*
+	 * With zero copy, the request may also be filled from a pipe by
+	 * splice(), which passes a bvec iter
+	 */
+	if (!user_backed_iter(iter) && !ublk_dev_support_zero_copy(ub))
+		return ERR_PTR(-EACCES);
+
+	return ublk_check_and_get_req_pos(ub, iocb->ki_pos, off, dir);
+}
+
 static ssize_t ublk_ch_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	struct ublk_queue *ubq;
@@ -1937,6 +2257,92 @@ static ssize_t ublk_ch_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	return ret;
 }
 
+static void ublk_pipe_buf_release(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf)
+{
+	struct request *req = (struct request *)buf->private;
+
+	ublk_put_req_ref(req->mq_hctx->driver_data, req);
+}
+
+static bool ublk_pipe_buf_get(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf)
+{
+	struct request *req = (struct request *)buf->private;
+
+	return ublk_get_req_ref(req->mq_hctx->driver_data, req);
+}
+
+/*
+ * Request pages lent to a pipe can't be stolen or merged into, and
+ * every pipe buffer holds one request reference, so the request can't
+ * be completed before its pages are consumed.
+ */
+static const struct pipe_buf_operations ublk_pipe_buf_ops = {
+	.release	= ublk_pipe_buf_release,
+	.get		= ublk_pipe_buf_get,
+};
+
+/*
+ * Zero copy for WRITE requests: lend the request's bio pages to a pipe,
+ * so that the ublk server can splice them straight into its backing
+ * file or socket without copying the data through its own buffer.
+ */
+static ssize_t ublk_ch_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct ublk_device *ub = in->private_data;
+	struct ublk_io_iter iter;
+	struct ublk_queue *ubq;
+	struct request *req;
+	ssize_t ret = 0, done = 0;
+	size_t buf_off;
+
+	if (!ub || !ublk_dev_support_zero_copy(ub))
+		return -EACCES;
+
+	req = ublk_check_and_get_req_pos(ub, *ppos, &buf_off, ITER_DEST);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+	ubq = req->mq_hctx->driver_data;
+
+	if (!ublk_advance_io_iter(req, &iter, buf_off))
+		goto out;
+
+	while (done < len && iter.bio) {
+		struct bio_vec bv = bio_iter_iovec(iter.bio, iter.iter);
+		unsigned int bytes = min_t(size_t, bv.bv_len, len - done);
+		struct pipe_buffer buf = {
+			.ops = &ublk_pipe_buf_ops,
+			.page = bv.bv_page,
+			.offset = bv.bv_offset,
+			.len = bytes,
+			.private = (unsigned long)req,
+		};
+
+		if (!ublk_get_req_ref(ubq, req))
+			break;
+
+		/* add_to_pipe() drops the reference on failure */
+		ret = add_to_pipe(pipe, &buf);
+		if (ret < 0)
+			break;
+		done += bytes;
+
+		bio_advance_iter_single(iter.bio, &iter.iter, bytes);
+		if (!iter.iter.bi_size) {
+			iter.bio = iter.bio->bi_next;
+			if (iter.bio)
+				iter.iter = iter.bio->bi_iter;
+		}
+	}
+out:
+	ublk_put_req_ref(ubq, req);
+	*ppos += done;
+
+	return done ? done : ret;
+}
+
 static const struct file_operations ublk_ch_fops = {
 	.owner = THIS_MODULE,
 	.open = ublk_ch_open,
@@ -1944,6 +2350,8 @@ static const struct file_operations ublk_ch_fops = {
 	.llseek = no_llseek,
 	.read_iter = ublk_ch_read_iter,
 	.write_iter = ublk_ch_write_iter,
+	.splice_read = ublk_ch_splice_read,
+	.splice_write = iter_file_splice_write,
 	.uring_cmd = ublk_ch_uring_cmd,
 	.mmap = ublk_ch_mmap,
 };
@@ -1967,6 +2375,8 @@ static int ublk_init_queue(struct ublk_device *ub, int q_id)
 	int size;
 
 	spin_lock_init(&ubq->cancel_lock);
+	spin_lock_init(&ubq->batch_lock);
+	INIT_LIST_HEAD(&ubq->batch_pending);
 	ubq->flags = ub->dev_info.flags;
 	ubq->q_id = q_id;
 	ubq->q_depth = ub->dev_info.queue_depth;
@@ -2060,6 +2470,54 @@ static void ublk_cdev_rel(struct device *dev)
 	kfree(ub);
 }
 
+/*
+ * One line per queue: q_id, then the number of FETCH_REQS commands and
+ * requests fetched by them, then the same for COMMIT_REQS
+ */
+static ssize_t batch_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ublk_device *ub = container_of(dev, struct ublk_device, cdev_dev);
+	int i, len = 0;
+
+	for (i = 0; i < ub->dev_info.nr_hw_queues; i++) {
+		const struct ublk_batch_stats *st =
+			&ublk_get_queue(ub, i)->batch_stats;
+
+		len += sysfs_emit_at(buf, len, "%d %lu %lu %lu %lu\n", i,
+				READ_ONCE(st->fetch_cmds),
+				READ_ONCE(st->fetched_reqs),
+				READ_ONCE(st->commit_cmds),
+				READ_ONCE(st->committed_reqs));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(batch_stats);
+
+static struct attribute *ublk_chdev_attrs[] = {
+	&dev_attr_batch_stats.attr,
+	NULL,
+};
+
+static umode_t ublk_chdev_attrs_visible(struct kobject *kobj,
+		struct attribute *attr, int n)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct ublk_device *ub = container_of(dev, struct ublk_device, cdev_dev);
+
+	return ublk_dev_support_batch_io(ub) ? attr->mode : 0;
+}
+
+static const struct attribute_group ublk_chdev_attr_group = {
+	.attrs		= ublk_chdev_attrs,
+	.is_visible	= ublk_chdev_attrs_visible,
+};
+
+static const struct attribute_group *ublk_chdev_attr_groups[] = {
+	&ublk_chdev_attr_group,
+	NULL,
+};
+
 static int ublk_add_chdev(struct ublk_device *ub)
 {
 	struct device *dev = &ub->cdev_dev;
@@ -2070,6 +2528,7 @@ static int ublk_add_chdev(struct ublk_device *ub)
 	dev->devt = MKDEV(MAJOR(ublk_chr_devt), minor);
 	dev->class = &ublk_chr_class;
 	dev->release = ublk_cdev_rel;
+	dev->groups = ublk_chdev_attr_groups;
 	device_initialize(dev);
 
 	ret = dev_set_name(dev, "ublkc%d", minor);
@@ -2361,8 +2820,22 @@ static int ublk_ctrl_add_dev(struct io_uring_cmd *cmd)
 		goto out_free_dev_number;
 	}
 
-	/* We are not ready to support zero copy */
-	ub->dev_info.flags &= ~UBLK_F_SUPPORT_ZERO_COPY;
+	/*
+	 * Zero copy is built on top of user copy's request addressing and
+	 * reference counting, so it isn't supported without it
+	 */
+	if (!ublk_dev_is_user_copy(ub))
+		ub->dev_info.flags &= ~UBLK_F_SUPPORT_ZERO_COPY;
+
+	/*
+	 * Batch io relies on user copy since there is no per-tag buffer,
+	 * and recovery's per-tag re-fetch doesn't apply to it
+	 */
+	if (!ublk_dev_is_user_copy(ub))
+		ub->dev_info.flags &= ~UBLK_F_BATCH_IO;
+	if (ublk_dev_support_batch_io(ub))
+		ub->dev_info.flags &= ~(UBLK_F_USER_RECOVERY_REISSUE |
+				UBLK_F_USER_RECOVERY);
 
 	ub->dev_info.nr_hw_queues = min_t(unsigned int,
 			ub->dev_info.nr_hw_queues, nr_cpu_ids);
@@ -2678,7 +3151,7 @@ static int ublk_ctrl_get_features(struct io_uring_cmd *cmd)
 {
 	const struct ublksrv_ctrl_cmd *header = io_uring_sqe_cmd(cmd->sqe);
 	void __user *argp = (void __user *)(unsigned long)header->addr;
-	u64 features = UBLK_F_ALL & ~UBLK_F_SUPPORT_ZERO_COPY;
+	u64 features = UBLK_F_ALL;
 
 	if (header->len != UBLK_FEATURES_LEN || !header->addr)
 		return -EINVAL;
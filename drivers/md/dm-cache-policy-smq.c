@@ -45,6 +45,8 @@ struct entry {
 	bool allocated:1;
 	bool sentinel:1;
 	bool pending_work:1;
+	bool hit:1;	/* hit since it was promoted */
+	bool ghost:1;	/* promoted because of a ghost hit */
 
 	dm_oblock_t oblock;
 };
@@ -726,6 +728,8 @@ static void init_entry(struct entry *e)
 	e->allocated = true;
 	e->sentinel = false;
 	e->pending_work = false;
+	e->hit = false;
+	e->ghost = false;
 }
 
 static struct entry *alloc_entry(struct entry_alloc *ea)
@@ -794,6 +798,22 @@ static struct entry *get_entry(struct entry_alloc *ea, unsigned int index)
 #define HOTSPOT_UPDATE_PERIOD (HZ)
 #define CACHE_UPDATE_PERIOD (60ul * HZ)
 
+/*
+ * The hotspot block size is reconsidered every this many hotspot periods,
+ * and may grow to at most 4 times its initial size.
+ */
+#define HOTSPOT_RESIZE_PERIODS 16u
+#define MAX_HOTSPOT_GROWTH_SHIFT 2u
+
+/*
+ * A ghost remembers the origin block of a recent demotion.  stamp is the
+ * value of nr_demotions after the demotion, 0 marks an empty slot.
+ */
+struct ghost {
+	dm_oblock_t oblock;
+	unsigned int stamp;
+};
+
 struct smq_policy {
 	struct dm_cache_policy policy;
 
@@ -806,6 +826,8 @@ struct smq_policy {
 	unsigned int nr_hotspot_blocks;
 	unsigned int cache_blocks_per_hotspot_block;
 	unsigned int hotspot_level_jump;
+	unsigned int hotspot_shift;
+	unsigned int max_hotspot_shift;
 
 	struct entry_space es;
 	struct entry_alloc writeback_sentinel_alloc;
@@ -852,8 +874,38 @@ struct smq_policy {
 	unsigned int write_promote_level;
 	unsigned int read_promote_level;
 
+	/*
+	 * Promotion levels are raised by promote_restraint when too many
+	 * promoted blocks get demoted again without ever being hit.
+	 */
+	unsigned int promote_restraint;
+
+	/*
+	 * Recently demoted blocks.  A miss on one of these is promoted
+	 * straight away, much like a hit in an ARC ghost list.  Only the
+	 * last ghost_window demotions count; the window grows when ghosts
+	 * are hit near its far end and shrinks when ghost promotions turn
+	 * out to be wasted.
+	 */
+	struct ghost *ghosts;
+	unsigned int ghost_bits;
+	unsigned int ghost_window;
+
 	unsigned long next_hotspot_period;
 	unsigned long next_cache_period;
+	unsigned int hotspot_periods;
+
+	/* lifetime counters, reported in the status line */
+	unsigned long long nr_promotions;
+	unsigned long long nr_demotions_total;
+	unsigned long long nr_wasted_promotions;
+	unsigned long long nr_ghost_hits;
+	unsigned int nr_demotions;
+
+	/* counters for the current hotspot resize window */
+	unsigned int window_promotions;
+	unsigned int window_wasted;
+	unsigned int window_poor_periods;
 
 	struct background_tracker *bg_work;
 
@@ -1074,6 +1126,8 @@ static void update_promote_levels(struct smq_policy *mq)
 		break;
 	}
 
+	threshold_level -= min(mq->promote_restraint, threshold_level - 1u);
+
 	mq->read_promote_level = NR_HOTSPOT_LEVELS - threshold_level;
 	mq->write_promote_level = (NR_HOTSPOT_LEVELS - threshold_level);
 }
@@ -1099,6 +1153,76 @@ static void update_level_jump(struct smq_policy *mq)
 	}
 }
 
+/*
+ * Drops every hotspot entry and switches to a hotspot block of
+ * cache_block_size << shift.  The hotspot queue is keyed by hotspot
+ * block, so its contents can't be carried over.
+ */
+static void set_hotspot_shift(struct smq_policy *mq, unsigned int shift)
+{
+	unsigned int i;
+	struct entry *e;
+
+	for (i = 0; i < mq->nr_hotspot_blocks; i++) {
+		e = get_entry(&mq->hotspot_alloc, i);
+		if (!e->allocated)
+			continue;
+
+		q_del(&mq->hotspot, e);
+		h_remove(&mq->hotspot_table, e);
+		free_entry(&mq->hotspot_alloc, e);
+	}
+	clear_bitset(mq->hotspot_hit_bits, mq->nr_hotspot_blocks);
+
+	mq->hotspot_shift = shift;
+	mq->hotspot_block_size = mq->cache_block_size << shift;
+	mq->cache_blocks_per_hotspot_block = 1u << shift;
+	mq->hotspot.nr_in_top_levels = min(mq->nr_hotspot_blocks / NR_HOTSPOT_LEVELS,
+					   from_cblock(mq->cache_size) >> shift);
+}
+
+/*
+ * Promoting a whole coarse hotspot block drags in cold neighbours, which
+ * shows up as promotions that are demoted without a hit: use a finer
+ * hotspot block.  If promotions are paying off but the hotspot queue
+ * keeps missing, it can't cover the working set: use a coarser one.
+ */
+static void update_hotspot_size(struct smq_policy *mq)
+{
+	unsigned int promotions = mq->window_promotions;
+	unsigned int wasted = mq->window_wasted;
+	unsigned int shift = mq->hotspot_shift;
+
+	if (++mq->hotspot_periods < HOTSPOT_RESIZE_PERIODS)
+		return;
+
+	if (promotions >= 16u && wasted * 2u > promotions && shift)
+		shift--;
+	else if (mq->window_poor_periods > HOTSPOT_RESIZE_PERIODS / 2u &&
+		 wasted * 8u <= promotions && shift < mq->max_hotspot_shift)
+		shift++;
+
+	if (shift != mq->hotspot_shift)
+		set_hotspot_shift(mq, shift);
+
+	mq->hotspot_periods = 0;
+	mq->window_promotions = 0;
+	mq->window_wasted = 0;
+	mq->window_poor_periods = 0;
+}
+
+static void update_promote_restraint(struct smq_policy *mq)
+{
+	if (mq->window_promotions < 16u)
+		return;
+
+	if (mq->window_wasted * 2u > mq->window_promotions)
+		mq->promote_restraint = min(mq->promote_restraint + 4u,
+					    NR_HOTSPOT_LEVELS / 2u);
+	else if (mq->window_wasted * 8u < mq->window_promotions)
+		mq->promote_restraint -= min(mq->promote_restraint, 4u);
+}
+
 static void end_hotspot_period(struct smq_policy *mq)
 {
 	clear_bitset(mq->hotspot_hit_bits, mq->nr_hotspot_blocks);
@@ -1106,6 +1230,10 @@ static void end_hotspot_period(struct smq_policy *mq)
 
 	if (time_after(jiffies, mq->next_hotspot_period)) {
 		update_level_jump(mq);
+		if (stats_assess(&mq->hotspot_stats) == Q_POOR)
+			mq->window_poor_periods++;
+		update_promote_restraint(mq);
+		update_hotspot_size(mq);
 		q_redistribute(&mq->hotspot);
 		stats_reset(&mq->hotspot_stats);
 		mq->next_hotspot_period = jiffies + HOTSPOT_UPDATE_PERIOD;
@@ -1234,15 +1362,18 @@ static void queue_demotion(struct smq_policy *mq)
 	}
 }
 
-static void queue_promotion(struct smq_policy *mq, dm_oblock_t oblock,
-			    struct policy_work **workp)
+/*
+ * Returns true if a promotion of oblock was queued.
+ */
+static bool queue_promotion(struct smq_policy *mq, dm_oblock_t oblock,
+			    bool ghost, struct policy_work **workp)
 {
 	int r;
 	struct entry *e;
 	struct policy_work work;
 
 	if (!mq->migrations_allowed)
-		return;
+		return false;
 
 	if (allocator_empty(&mq->cache_alloc)) {
 		/*
@@ -1251,11 +1382,11 @@ static void queue_promotion(struct smq_policy *mq, dm_oblock_t oblock,
 		 */
 		if (!free_target_met(mq))
 			queue_demotion(mq);
-		return;
+		return false;
 	}
 
 	if (btracker_promotion_already_present(mq->bg_work, oblock))
-		return;
+		return false;
 
 	/*
 	 * We allocate the entry now to reserve the cblock.  If the
@@ -1264,12 +1395,17 @@ static void queue_promotion(struct smq_policy *mq, dm_oblock_t oblock,
 	e = alloc_entry(&mq->cache_alloc);
 	BUG_ON(!e);
 	e->pending_work = true;
+	e->ghost = ghost;
 	work.op = POLICY_PROMOTE;
 	work.oblock = oblock;
 	work.cblock = infer_cblock(mq, e);
 	r = btracker_queue(mq->bg_work, &work, workp);
-	if (r)
+	if (r) {
 		free_entry(&mq->cache_alloc, e);
+		return false;
+	}
+
+	return true;
 }
 
 /*----------------------------------------------------------------*/
@@ -1348,6 +1484,82 @@ static struct entry *update_hotspot_queue(struct smq_policy *mq, dm_oblock_t b)
 
 /*----------------------------------------------------------------*/
 
+static struct ghost *ghost_slot(struct smq_policy *mq, dm_oblock_t b)
+{
+	return mq->ghosts + hash_64(from_oblock(b), mq->ghost_bits);
+}
+
+static void ghost_insert(struct smq_policy *mq, dm_oblock_t b)
+{
+	struct ghost *g;
+
+	if (!mq->ghosts)
+		return;
+
+	/* skip 0, it marks an empty slot */
+	if (!++mq->nr_demotions)
+		mq->nr_demotions++;
+
+	g = ghost_slot(mq, b);
+	g->oblock = b;
+	g->stamp = mq->nr_demotions;
+}
+
+/*
+ * Returns the ghost of b if it was demoted within the last ghost_window
+ * demotions.  The ghost is left in place until ghost_hit() is called.
+ */
+static struct ghost *ghost_lookup(struct smq_policy *mq, dm_oblock_t b)
+{
+	struct ghost *g;
+
+	if (!mq->ghosts)
+		return NULL;
+
+	g = ghost_slot(mq, b);
+	if (!g->stamp || g->oblock != b)
+		return NULL;
+
+	if (mq->nr_demotions - g->stamp >= mq->ghost_window)
+		return NULL;
+
+	return g;
+}
+
+/*
+ * Forgets a ghost that brought its block back into the cache.
+ */
+static void ghost_hit(struct smq_policy *mq, struct ghost *g)
+{
+	unsigned int age = mq->nr_demotions - g->stamp;
+
+	g->stamp = 0;
+	mq->nr_ghost_hits++;
+	if (age > mq->ghost_window / 2u)
+		mq->ghost_window = min(mq->ghost_window + max(mq->ghost_window / 8u, 1u),
+				       1u << mq->ghost_bits);
+}
+
+/*
+ * Book keeping for a completed demotion of e.
+ */
+static void account_demotion(struct smq_policy *mq, struct entry *e)
+{
+	mq->nr_demotions_total++;
+	ghost_insert(mq, e->oblock);
+
+	if (e->hit)
+		return;
+
+	mq->nr_wasted_promotions++;
+	mq->window_wasted++;
+	if (e->ghost && mq->ghosts)
+		mq->ghost_window = max(mq->ghost_window - mq->ghost_window / 8u,
+				       (1u << mq->ghost_bits) / 8u);
+}
+
+/*----------------------------------------------------------------*/
+
 /*
  * Public interface, via the policy struct.  See dm-cache-policy.h for a
  * description of these.
@@ -1363,6 +1575,7 @@ static void smq_destroy(struct dm_cache_policy *p)
 	struct smq_policy *mq = to_smq_policy(p);
 
 	btracker_destroy(mq->bg_work);
+	kvfree(mq->ghosts);
 	h_exit(&mq->hotspot_table);
 	h_exit(&mq->table);
 	free_bitset(mq->hotspot_hit_bits);
@@ -1386,11 +1599,14 @@ static int __lookup(struct smq_policy *mq, dm_oblock_t oblock, dm_cblock_t *cblo
 	if (e) {
 		stats_level_accessed(&mq->cache_stats, e->level);
 
+		e->hit = true;
 		requeue(mq, e);
 		*cblock = infer_cblock(mq, e);
 		return 0;
 
 	} else {
+		struct ghost *g;
+
 		stats_miss(&mq->cache_stats);
 
 		/*
@@ -1398,9 +1614,20 @@ static int __lookup(struct smq_policy *mq, dm_oblock_t oblock, dm_cblock_t *cblo
 		 */
 		hs_e = update_hotspot_queue(mq, oblock);
 
-		pr = should_promote(mq, hs_e, data_dir, fast_copy);
+		/*
+		 * A block we demoted recently is wanted again, so bring it
+		 * back without waiting for it to climb the hotspot queue.
+		 */
+		g = ghost_lookup(mq, oblock);
+		pr = g ? PROMOTE_PERMANENT :
+			should_promote(mq, hs_e, data_dir, fast_copy);
 		if (pr != PROMOTE_NOT) {
-			queue_promotion(mq, oblock, work);
+			/*
+			 * Only a queued promotion uses up the ghost, with a
+			 * full cache we just demote and try again next time.
+			 */
+			if (queue_promotion(mq, oblock, !!g, work) && g)
+				ghost_hit(mq, g);
 			*background_work = true;
 		}
 
@@ -1481,6 +1708,8 @@ static void __complete_background_work(struct smq_policy *mq,
 			e->oblock = work->oblock;
 			e->level = NR_CACHE_LEVELS - 1;
 			push(mq, e);
+			mq->nr_promotions++;
+			mq->window_promotions++;
 			// h, q, a
 		} else {
 			free_entry(&mq->cache_alloc, e);
@@ -1491,6 +1720,7 @@ static void __complete_background_work(struct smq_policy *mq,
 	case POLICY_DEMOTE:
 		// h, !q, a
 		if (success) {
+			account_demotion(mq, e);
 			h_remove(&mq->table, e);
 			free_entry(&mq->cache_alloc, e);
 			// !h, !q, !a
@@ -1575,6 +1805,8 @@ static int smq_load_mapping(struct dm_cache_policy *p,
 	e->dirty = dirty;
 	e->level = hint_valid ? min(hint, NR_CACHE_LEVELS - 1) : random_level(cblock);
 	e->pending_work = false;
+	/* not promoted by us, so never count it as a wasted promotion */
+	e->hit = true;
 
 	/*
 	 * When we load mappings we push ahead of both sentinels in order to
@@ -1645,9 +1877,44 @@ static void smq_allow_migrations(struct dm_cache_policy *p, bool allow)
 }
 
 /*
- * smq has no config values, but the old mq policy did.  To avoid breaking
- * software we continue to accept these configurables for the mq policy,
- * but they have no effect.
+ * smq has no config values, but reports its promotion statistics as
+ * read-only key/value pairs in the status line.
+ */
+#define NR_SMQ_STATS_ARGS 12u
+
+static void __smq_emit_stats(struct smq_policy *mq, char *result,
+			     unsigned int maxlen, ssize_t *sz_ptr)
+{
+	ssize_t sz = *sz_ptr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mq->lock, flags);
+	DMEMIT("promotions %llu demotions %llu wasted_promotions %llu "
+	       "ghost_hits %llu ghost_window %u hotspot_block_size %llu ",
+	       mq->nr_promotions, mq->nr_demotions_total,
+	       mq->nr_wasted_promotions, mq->nr_ghost_hits,
+	       mq->ghost_window,
+	       (unsigned long long) mq->hotspot_block_size);
+	spin_unlock_irqrestore(&mq->lock, flags);
+
+	*sz_ptr = sz;
+}
+
+static int smq_emit_config_values(struct dm_cache_policy *p, char *result,
+				  unsigned int maxlen, ssize_t *sz_ptr)
+{
+	ssize_t sz = *sz_ptr;
+
+	DMEMIT("%u ", NR_SMQ_STATS_ARGS);
+	*sz_ptr = sz;
+	__smq_emit_stats(to_smq_policy(p), result, maxlen, sz_ptr);
+	return 0;
+}
+
+/*
+ * The old mq policy had config values.  To avoid breaking software we
+ * continue to accept these configurables for the mq policy, but they
+ * have no effect.
  */
 static int mq_set_config_value(struct dm_cache_policy *p,
 			       const char *key, const char *value)
@@ -1674,13 +1941,14 @@ static int mq_emit_config_values(struct dm_cache_policy *p, char *result,
 {
 	ssize_t sz = *sz_ptr;
 
-	DMEMIT("10 random_threshold 0 "
+	DMEMIT("%u random_threshold 0 "
 	       "sequential_threshold 0 "
 	       "discard_promote_adjustment 0 "
 	       "read_promote_adjustment 0 "
-	       "write_promote_adjustment 0 ");
+	       "write_promote_adjustment 0 ", 10u + NR_SMQ_STATS_ARGS);
 
 	*sz_ptr = sz;
+	__smq_emit_stats(to_smq_policy(p), result, maxlen, sz_ptr);
 	return 0;
 }
 
@@ -1704,7 +1972,8 @@ static void init_policy_functions(struct smq_policy *mq, bool mimic_mq)
 	if (mimic_mq) {
 		mq->policy.set_config_value = mq_set_config_value;
 		mq->policy.emit_config_values = mq_emit_config_values;
-	}
+	} else
+		mq->policy.emit_config_values = smq_emit_config_values;
 }
 
 static bool too_many_hotspot_blocks(sector_t origin_size,
@@ -1748,6 +2017,13 @@ __smq_create(dm_cblock_t cache_size, sector_t origin_size, sector_t cache_block_
 			    &mq->hotspot_block_size, &mq->nr_hotspot_blocks);
 
 	mq->cache_blocks_per_hotspot_block = div64_u64(mq->hotspot_block_size, mq->cache_block_size);
+	mq->hotspot_shift = ilog2(mq->cache_blocks_per_hotspot_block);
+	mq->max_hotspot_shift = mq->hotspot_shift;
+	while (mq->max_hotspot_shift < mq->hotspot_shift + MAX_HOTSPOT_GROWTH_SHIFT &&
+	       !too_many_hotspot_blocks(origin_size,
+					cache_block_size << (mq->max_hotspot_shift + 1u),
+					mq->nr_hotspot_blocks))
+		mq->max_hotspot_shift++;
 	mq->hotspot_level_jump = 1u;
 	if (space_init(&mq->es, total_sentinels + mq->nr_hotspot_blocks + from_cblock(cache_size))) {
 		DMERR("couldn't initialize entry space");
@@ -1806,6 +2082,16 @@ __smq_create(dm_cblock_t cache_size, sector_t origin_size, sector_t cache_block_
 	if (h_init(&mq->hotspot_table, &mq->es, mq->nr_hotspot_blocks))
 		goto bad_alloc_hotspot_table;
 
+	if (from_cblock(cache_size)) {
+		unsigned int nr_ghosts = roundup_pow_of_two(max(from_cblock(cache_size) / 2u, 64u));
+
+		mq->ghosts = kvcalloc(nr_ghosts, sizeof(*mq->ghosts), GFP_KERNEL);
+		if (!mq->ghosts)
+			goto bad_alloc_ghosts;
+		mq->ghost_bits = ilog2(nr_ghosts);
+		mq->ghost_window = nr_ghosts / 2u;
+	}
+
 	sentinels_init(mq);
 	mq->write_promote_level = mq->read_promote_level = NR_HOTSPOT_LEVELS;
 
@@ -1822,6 +2108,8 @@ __smq_create(dm_cblock_t cache_size, sector_t origin_size, sector_t cache_block_
 	return &mq->policy;
 
 bad_btracker:
+	kvfree(mq->ghosts);
+bad_alloc_ghosts:
 	h_exit(&mq->hotspot_table);
 bad_alloc_hotspot_table:
 	h_exit(&mq->table);
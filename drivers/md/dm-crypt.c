@@ -12,8 +12,10 @@
 #include <linux/err.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
 #include <linux/kernel.h>
 #include <linux/key.h>
+#include <linux/llist.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/blk-integrity.h>
@@ -77,6 +79,7 @@ struct dm_crypt_io {
 	bool integrity_metadata_from_pool:1;
 
 	struct work_struct work;
+	struct llist_node bh_node;
 
 	struct convert_context ctx;
 
@@ -91,11 +94,22 @@ struct dm_crypt_io {
 
 struct dm_crypt_request {
 	struct convert_context *ctx;
+	struct dm_crypt_batch *batch;
 	struct scatterlist sg_in[4];
 	struct scatterlist sg_out[4];
 	u64 iv_sector;
 };
 
+/*
+ * Requests for consecutive sectors allocated and completed together, see
+ * crypt_convert_batch().  The requests follow at cc->batch_stride apart.
+ */
+struct dm_crypt_batch {
+	atomic_t pending;
+} CRYPTO_MINALIGN_ATTR;
+
+#define DM_CRYPT_BATCH_MAX	32
+
 struct crypt_config;
 
 struct crypt_iv_operations {
@@ -145,6 +159,7 @@ enum cipher_flags {
 	CRYPT_MODE_INTEGRITY_AEAD,	/* Use authenticated mode for cipher */
 	CRYPT_IV_LARGE_SECTORS,		/* Calculate IV from sector_size, not 512B sectors */
 	CRYPT_ENCRYPT_PREPROCESS,	/* Must preprocess data for encryption (elephant) */
+	CRYPT_BATCH,			/* Async cipher, submit sectors in batches */
 };
 
 /*
@@ -200,6 +215,7 @@ struct crypt_config {
 	 * correctly aligned.
 	 */
 	unsigned int dmreq_start;
+	unsigned int batch_stride;	/* request size rounded to CRYPTO_MINALIGN */
 
 	unsigned int per_bio_data_size;
 
@@ -1497,6 +1513,7 @@ static int crypt_alloc_req_skcipher(struct crypt_config *cc,
 	skcipher_request_set_callback(ctx->r.req,
 	    CRYPTO_TFM_REQ_MAY_BACKLOG,
 	    kcryptd_async_done, dmreq_of_req(cc, ctx->r.req));
+	dmreq_of_req(cc, ctx->r.req)->batch = NULL;
 
 	return 0;
 }
@@ -1519,6 +1536,7 @@ static int crypt_alloc_req_aead(struct crypt_config *cc,
 	aead_request_set_callback(ctx->r.req_aead,
 	    CRYPTO_TFM_REQ_MAY_BACKLOG,
 	    kcryptd_async_done, dmreq_of_req(cc, ctx->r.req_aead));
+	dmreq_of_req(cc, ctx->r.req_aead)->batch = NULL;
 
 	return 0;
 }
@@ -1558,6 +1576,81 @@ static void crypt_free_req(struct crypt_config *cc, void *req, struct bio *base_
 		crypt_free_req_skcipher(cc, req, base_bio);
 }
 
+/*
+ * Convert up to DM_CRYPT_BATCH_MAX sectors with requests taken from one
+ * allocation instead of one mempool allocation each.  Every sector still
+ * gets its own request and IV, but the batch holds a single cc_pending
+ * reference, so the bio sees one completion for all of them.  Only used
+ * for async ciphers outside interrupt context: a sync cipher completes
+ * each request inline and already reuses a single one.
+ *
+ * Returns the number of sectors submitted, 0 if batching isn't worth it or
+ * the batch can't be allocated, or a negative error.
+ */
+static int crypt_convert_batch(struct crypt_config *cc,
+			       struct convert_context *ctx,
+			       unsigned int *tag_offset)
+{
+	unsigned int sector_step = cc->sector_size >> SECTOR_SHIFT;
+	unsigned int i, nr;
+	struct dm_crypt_batch *batch;
+	int r = 0;
+
+	if (!test_bit(CRYPT_BATCH, &cc->cipher_flags) || in_interrupt())
+		return 0;
+
+	nr = min(ctx->iter_in.bi_size, ctx->iter_out.bi_size) / cc->sector_size;
+	nr = min_t(unsigned int, nr, DM_CRYPT_BATCH_MAX);
+	if (nr < 2)
+		return 0;
+
+	batch = kmalloc(sizeof(*batch) + nr * cc->batch_stride,
+			GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+	if (!batch)
+		return 0;
+
+	/* one reference for the submitter, one per request in flight */
+	atomic_set(&batch->pending, 1);
+	atomic_inc(&ctx->cc_pending);
+
+	for (i = 0; i < nr; i++) {
+		struct skcipher_request *req = (void *)(batch + 1) +
+					       i * cc->batch_stride;
+		unsigned int key_index = ctx->cc_sector & (cc->tfms_count - 1);
+
+		skcipher_request_set_tfm(req, cc->cipher_tfm.tfms[key_index]);
+		skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+					      kcryptd_async_done,
+					      dmreq_of_req(cc, req));
+		dmreq_of_req(cc, req)->batch = batch;
+
+		atomic_inc(&batch->pending);
+		r = crypt_convert_block_skcipher(cc, ctx, req, *tag_offset);
+		if (r == -EBUSY) {
+			/* backlogged, wait for the driver to take it */
+			wait_for_completion(&ctx->restart);
+			reinit_completion(&ctx->restart);
+			r = -EINPROGRESS;
+		}
+		if (r != -EINPROGRESS) {
+			atomic_dec(&batch->pending);
+			if (r)
+				break;
+		}
+		ctx->cc_sector += sector_step;
+		(*tag_offset)++;
+		r = 0;
+	}
+
+	/* all done already, the async completion won't free the batch */
+	if (atomic_dec_and_test(&batch->pending)) {
+		kfree(batch);
+		atomic_dec(&ctx->cc_pending);
+	}
+
+	return r ? r : nr;
+}
+
 /*
  * Encrypt / decrypt data from one bio to another one (can be the same one)
  */
@@ -1578,6 +1671,15 @@ static blk_status_t crypt_convert(struct crypt_config *cc,
 
 	while (ctx->iter_in.bi_size && ctx->iter_out.bi_size) {
 
+		r = crypt_convert_batch(cc, ctx, &tag_offset);
+		if (r < 0)
+			return BLK_STS_IOERR;
+		if (r) {
+			if (!atomic)
+				cond_resched();
+			continue;
+		}
+
 		r = crypt_alloc_req(cc, ctx);
 		if (r) {
 			complete(&ctx->restart);
@@ -2259,7 +2361,14 @@ static void kcryptd_async_done(void *data, int error)
 	} else if (error < 0)
 		io->error = BLK_STS_IOERR;
 
-	crypt_free_req(cc, req_of_dmreq(cc, dmreq), io->base_bio);
+	if (dmreq->batch) {
+		/* the batch holds a single cc_pending reference */
+		if (!atomic_dec_and_test(&dmreq->batch->pending))
+			return;
+		kfree(dmreq->batch);
+	} else {
+		crypt_free_req(cc, req_of_dmreq(cc, dmreq), io->base_bio);
+	}
 
 	if (!atomic_dec_and_test(&ctx->cc_pending))
 		return;
@@ -2291,6 +2400,56 @@ static void kcryptd_crypt(struct work_struct *work)
 		kcryptd_crypt_write_convert(io);
 }
 
+/*
+ * Reads completing in hard interrupt context can't be decrypted right there,
+ * see kcryptd_queue_crypt().  Rather than bouncing them to kcryptd, decrypt
+ * them from a per-CPU tasklet.  Each run decrypts about DM_CRYPT_BH_BUDGET
+ * sectors, so that a burst of completions, or a few large ones, gets pushed
+ * to ksoftirqd instead of hogging the CPU.  The tasklets live as long as the module, unlike the ios they
+ * process, so they can't be freed under the softirq code running them.
+ */
+#define DM_CRYPT_BH_BUDGET	512	/* sectors */
+
+struct kcryptd_bh {
+	struct llist_head list;
+	struct llist_node *pending;	/* left over from the last run */
+	struct tasklet_struct tasklet;
+};
+
+static DEFINE_PER_CPU(struct kcryptd_bh, kcryptd_bh);
+
+static void kcryptd_bh_fn(struct tasklet_struct *t)
+{
+	struct kcryptd_bh *bh = from_tasklet(bh, t, tasklet);
+	struct llist_node *node = bh->pending;
+	int budget = DM_CRYPT_BH_BUDGET;
+
+	if (!node)
+		node = llist_reverse_order(llist_del_all(&bh->list));
+
+	while (node && budget > 0) {
+		struct dm_crypt_io *io = llist_entry(node, struct dm_crypt_io,
+						     bh_node);
+
+		node = llist_next(node);
+		/* io may be gone once decrypted */
+		budget -= bio_sectors(io->base_bio);
+		kcryptd_crypt_read_convert(io);
+	}
+
+	bh->pending = node;
+	if (node || !llist_empty(&bh->list))
+		tasklet_schedule(&bh->tasklet);
+}
+
+static void kcryptd_queue_bh(struct dm_crypt_io *io)
+{
+	struct kcryptd_bh *bh = this_cpu_ptr(&kcryptd_bh);
+
+	if (llist_add(&io->bh_node, &bh->list))
+		tasklet_schedule(&bh->tasklet);
+}
+
 static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 {
 	struct crypt_config *cc = io->cc;
@@ -2306,6 +2465,10 @@ static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 			kcryptd_crypt(&io->work);
 			return;
 		}
+		if (bio_data_dir(io->base_bio) == READ) {
+			kcryptd_queue_bh(io);
+			return;
+		}
 	}
 
 	INIT_WORK(&io->work, kcryptd_crypt);
@@ -3319,6 +3482,18 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	/*
+	 * Async ciphers get whole batches of sector requests at once, unless
+	 * the IV mode has to post-process each sector or integrity tags are
+	 * involved, see crypt_convert_batch().
+	 */
+	cc->batch_stride = ALIGN(cc->dmreq_start + additional_req_size,
+				 CRYPTO_MINALIGN);
+	if (!crypt_integrity_aead(cc) && !cc->on_disk_tag_size &&
+	    !(cc->iv_gen_ops && cc->iv_gen_ops->post) &&
+	    crypto_skcipher_alg(any_tfm(cc))->base.cra_flags & CRYPTO_ALG_ASYNC)
+		set_bit(CRYPT_BATCH, &cc->cipher_flags);
+
 	cc->per_bio_data_size = ti->per_io_data_size =
 		ALIGN(sizeof(struct dm_crypt_io) + cc->dmreq_start + additional_req_size,
 		      ARCH_DMA_MINALIGN);
@@ -3724,7 +3899,33 @@ static struct target_type crypt_target = {
 	.iterate_devices = crypt_iterate_devices,
 	.io_hints = crypt_io_hints,
 };
-module_dm(crypt);
+
+static int __init dm_crypt_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct kcryptd_bh *bh = per_cpu_ptr(&kcryptd_bh, cpu);
+
+		init_llist_head(&bh->list);
+		tasklet_setup(&bh->tasklet, kcryptd_bh_fn);
+	}
+
+	return dm_register_target(&crypt_target);
+}
+
+static void __exit dm_crypt_exit(void)
+{
+	int cpu;
+
+	dm_unregister_target(&crypt_target);
+
+	for_each_possible_cpu(cpu)
+		tasklet_kill(&per_cpu_ptr(&kcryptd_bh, cpu)->tasklet);
+}
+
+module_init(dm_crypt_init);
+module_exit(dm_crypt_exit);
 
 MODULE_AUTHOR("Jana Saout <jana@saout.de>");
 MODULE_DESCRIPTION(DM_NAME " target for transparent encryption / decryption");
@@ -32,8 +32,10 @@
 #define MAPPING_POOL_SIZE 1024
 #define COMMIT_PERIOD HZ
 #define NO_SPACE_TIMEOUT_SECS 60
+#define MAX_POOL_WORKERS 64
 
 static unsigned int no_space_timeout_secs = NO_SPACE_TIMEOUT_SECS;
+static unsigned int pool_workers = 1;
 
 DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(snapshot_copy_throttle,
 		"A percentage of time allocated for copy on write");
@@ -229,6 +231,21 @@ typedef void (*process_mapping_fn)(struct dm_thin_new_mapping *m);
 
 #define CELL_SORT_ARRAY_SIZE 8192
 
+/*
+ * Thin devices are sharded over the pool's workers by device id.  Each
+ * shard maps the deferred bios and cells of its own thins; the main pool
+ * worker completes prepared mappings and commits metadata for all of them.
+ */
+struct pool_shard {
+	struct work_struct worker;
+	struct pool *pool;
+	struct throttle throttle;
+	struct list_head thins;	/* protected by pool->lock, rcu for readers */
+
+	struct dm_thin_new_mapping *next_mapping;
+	struct dm_bio_prison_cell **cell_sort_array;
+};
+
 struct pool {
 	struct list_head list;
 	struct dm_target *ti;	/* Only set if a pool target is bound */
@@ -259,6 +276,9 @@ struct pool {
 	unsigned long last_commit_jiffies;
 	unsigned int ref_count;
 
+	struct mutex mode_lock;		/* Serialises set_pool_mode() */
+	struct mutex alloc_lock;	/* Serialises commits for free data space */
+
 	spinlock_t lock;
 	struct bio_list deferred_flush_bios;
 	struct bio_list deferred_flush_completions;
@@ -270,7 +290,9 @@ struct pool {
 	struct dm_deferred_set *shared_read_ds;
 	struct dm_deferred_set *all_io_ds;
 
-	struct dm_thin_new_mapping *next_mapping;
+	unsigned int nr_shards;
+	struct pool_shard *shards;
+	struct workqueue_struct *shard_wq;
 
 	process_bio_fn process_bio;
 	process_bio_fn process_discard;
@@ -282,8 +304,6 @@ struct pool {
 	process_mapping_fn process_prepared_discard;
 	process_mapping_fn process_prepared_discard_pt2;
 
-	struct dm_bio_prison_cell **cell_sort_array;
-
 	mempool_t mapping_pool;
 };
 
@@ -338,12 +358,14 @@ struct pool_c {
  */
 struct thin_c {
 	struct list_head list;
+	struct list_head shard_list;
 	struct dm_dev *pool_dev;
 	struct dm_dev *origin_dev;
 	sector_t origin_size;
 	dm_thin_id dev_id;
 
 	struct pool *pool;
+	struct pool_shard *shard;
 	struct dm_thin_device *td;
 	struct mapped_device *thin_md;
 
@@ -356,7 +378,7 @@ struct thin_c {
 
 	/*
 	 * Ensures the thin is not destroyed until the worker has finished
-	 * iterating the active_thins list.
+	 * iterating the active_thins or its shard's thins list.
 	 */
 	refcount_t refcount;
 	struct completion can_destroy;
@@ -438,6 +460,30 @@ static void wake_worker(struct pool *pool)
 	queue_work(pool->wq, &pool->worker);
 }
 
+/*
+ * The throttle held by whichever worker maps this thin's deferred bios.
+ */
+static struct throttle *thin_throttle(struct thin_c *tc)
+{
+	struct pool *pool = tc->pool;
+
+	return pool->nr_shards > 1 ? &tc->shard->throttle : &pool->throttle;
+}
+
+/*
+ * wake_thin_worker() is used when new bios or cells are deferred to a
+ * thin device.  With a single shard the pool worker maps them itself.
+ */
+static void wake_thin_worker(struct thin_c *tc)
+{
+	struct pool *pool = tc->pool;
+
+	if (pool->nr_shards > 1)
+		queue_work(pool->shard_wq, &tc->shard->worker);
+	else
+		wake_worker(pool);
+}
+
 /*----------------------------------------------------------------*/
 
 static int bio_detain(struct pool *pool, struct dm_cell_key *key, struct bio *bio,
@@ -893,7 +939,7 @@ static void cell_defer_no_holder(struct thin_c *tc, struct dm_bio_prison_cell *c
 		spin_lock_irqsave(&tc->lock, flags);
 		bio_list_merge(&tc->deferred_bio_list, &bios);
 		spin_unlock_irqrestore(&tc->lock, flags);
-		wake_worker(pool);
+		wake_thin_worker(tc);
 	}
 }
 
@@ -1255,27 +1301,27 @@ static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
 	bio->bi_end_io = fn;
 }
 
-static int ensure_next_mapping(struct pool *pool)
+static int ensure_next_mapping(struct pool_shard *shard)
 {
-	if (pool->next_mapping)
+	if (shard->next_mapping)
 		return 0;
 
-	pool->next_mapping = mempool_alloc(&pool->mapping_pool, GFP_ATOMIC);
+	shard->next_mapping = mempool_alloc(&shard->pool->mapping_pool, GFP_ATOMIC);
 
-	return pool->next_mapping ? 0 : -ENOMEM;
+	return shard->next_mapping ? 0 : -ENOMEM;
 }
 
-static struct dm_thin_new_mapping *get_next_mapping(struct pool *pool)
+static struct dm_thin_new_mapping *get_next_mapping(struct pool_shard *shard)
 {
-	struct dm_thin_new_mapping *m = pool->next_mapping;
+	struct dm_thin_new_mapping *m = shard->next_mapping;
 
-	BUG_ON(!pool->next_mapping);
+	BUG_ON(!shard->next_mapping);
 
 	memset(m, 0, sizeof(struct dm_thin_new_mapping));
 	INIT_LIST_HEAD(&m->list);
 	m->bio = NULL;
 
-	pool->next_mapping = NULL;
+	shard->next_mapping = NULL;
 
 	return m;
 }
@@ -1316,7 +1362,7 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 			  sector_t len)
 {
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc->shard);
 
 	m->tc = tc;
 	m->virt_begin = virt_block;
@@ -1384,7 +1430,7 @@ static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 			  struct bio *bio)
 {
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc->shard);
 
 	atomic_set(&m->prepare_actions, 1); /* no need to quiesce */
 	m->tc = tc;
@@ -1514,14 +1560,75 @@ static void check_low_water_mark(struct pool *pool, dm_block_t free_blocks)
 	}
 }
 
+/*
+ * With several shards, another shard may have switched the pool out of
+ * write mode after this bio was passed to process_bio().
+ */
+static int alloc_mode_error(struct pool *pool)
+{
+	switch (get_pool_mode(pool)) {
+	case PM_WRITE:
+		return 0;
+	case PM_OUT_OF_DATA_SPACE:
+		return -ENOSPC;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Try to commit to see if that will free up some more space.  Shards
+ * take turns, so only one of them commits and switches the pool to
+ * out-of-data-space mode.
+ */
+static int commit_for_free_space(struct pool *pool)
+{
+	int r;
+	dm_block_t free_blocks;
+
+	mutex_lock(&pool->alloc_lock);
+
+	r = alloc_mode_error(pool);
+	if (r)
+		goto out;
+
+	r = dm_pool_get_free_block_count(pool->pmd, &free_blocks);
+	if (r) {
+		metadata_operation_failed(pool, "dm_pool_get_free_block_count", r);
+		goto out;
+	}
+	if (free_blocks)
+		goto out;
+
+	r = commit(pool);
+	if (r)
+		goto out;
+
+	r = dm_pool_get_free_block_count(pool->pmd, &free_blocks);
+	if (r) {
+		metadata_operation_failed(pool, "dm_pool_get_free_block_count", r);
+		goto out;
+	}
+
+	if (!free_blocks) {
+		set_pool_mode(pool, PM_OUT_OF_DATA_SPACE);
+		r = -ENOSPC;
+	}
+out:
+	mutex_unlock(&pool->alloc_lock);
+
+	return r;
+}
+
 static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 {
 	int r;
 	dm_block_t free_blocks;
 	struct pool *pool = tc->pool;
 
-	if (WARN_ON(get_pool_mode(pool) != PM_WRITE))
-		return -EINVAL;
+	r = alloc_mode_error(pool);
+	if (r)
+		return r;
 
 	r = dm_pool_get_free_block_count(pool->pmd, &free_blocks);
 	if (r) {
@@ -1532,24 +1639,9 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 	check_low_water_mark(pool, free_blocks);
 
 	if (!free_blocks) {
-		/*
-		 * Try to commit to see if that will free up some
-		 * more space.
-		 */
-		r = commit(pool);
+		r = commit_for_free_space(pool);
 		if (r)
 			return r;
-
-		r = dm_pool_get_free_block_count(pool->pmd, &free_blocks);
-		if (r) {
-			metadata_operation_failed(pool, "dm_pool_get_free_block_count", r);
-			return r;
-		}
-
-		if (!free_blocks) {
-			set_pool_mode(pool, PM_OUT_OF_DATA_SPACE);
-			return -ENOSPC;
-		}
 	}
 
 	r = dm_pool_alloc_data_block(pool->pmd, result);
@@ -1649,7 +1741,7 @@ static void process_discard_cell_no_passdown(struct thin_c *tc,
 					     struct dm_bio_prison_cell *virt_cell)
 {
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc->shard);
 
 	/*
 	 * We don't need to lock the data blocks, since there's no
@@ -1695,7 +1787,7 @@ static void break_up_discard_bio(struct thin_c *tc, dm_block_t begin, dm_block_t
 		 * Make sure the data region obeys the bio prison restrictions.
 		 */
 		while (data_begin < data_end) {
-			r = ensure_next_mapping(pool);
+			r = ensure_next_mapping(tc->shard);
 			if (r)
 				return; /* we did our best */
 
@@ -1715,7 +1807,7 @@ static void break_up_discard_bio(struct thin_c *tc, dm_block_t begin, dm_block_t
 			 * IO may still be going to the destination block.  We must
 			 * quiesce before we can do the removal.
 			 */
-			m = get_next_mapping(pool);
+			m = get_next_mapping(tc->shard);
 			m->tc = tc;
 			m->maybe_shared = maybe_shared;
 			m->virt_begin = virt_begin;
@@ -2217,7 +2309,7 @@ static void process_thin_deferred_bios(struct thin_c *tc)
 		 * this bio might require one, we pause until there are some
 		 * prepared mappings to process.
 		 */
-		if (ensure_next_mapping(pool)) {
+		if (ensure_next_mapping(tc->shard)) {
 			spin_lock_irq(&tc->lock);
 			bio_list_add(&tc->deferred_bio_list, bio);
 			bio_list_merge(&tc->deferred_bio_list, &bios);
@@ -2231,7 +2323,7 @@ static void process_thin_deferred_bios(struct thin_c *tc)
 			pool->process_bio(tc, bio);
 
 		if ((count++ & 127) == 0) {
-			throttle_work_update(&pool->throttle);
+			throttle_work_update(thin_throttle(tc));
 			dm_pool_issue_prefetches(pool->pmd);
 		}
 		cond_resched();
@@ -2256,7 +2348,7 @@ static int cmp_cells(const void *lhs, const void *rhs)
 	return 0;
 }
 
-static unsigned int sort_cells(struct pool *pool, struct list_head *cells)
+static unsigned int sort_cells(struct pool_shard *shard, struct list_head *cells)
 {
 	unsigned int count = 0;
 	struct dm_bio_prison_cell *cell, *tmp;
@@ -2265,11 +2357,11 @@ static unsigned int sort_cells(struct pool *pool, struct list_head *cells)
 		if (count >= CELL_SORT_ARRAY_SIZE)
 			break;
 
-		pool->cell_sort_array[count++] = cell;
+		shard->cell_sort_array[count++] = cell;
 		list_del(&cell->user_list);
 	}
 
-	sort(pool->cell_sort_array, count, sizeof(cell), cmp_cells, NULL);
+	sort(shard->cell_sort_array, count, sizeof(cell), cmp_cells, NULL);
 
 	return count;
 }
@@ -2277,6 +2369,7 @@ static unsigned int sort_cells(struct pool *pool, struct list_head *cells)
 static void process_thin_deferred_cells(struct thin_c *tc)
 {
 	struct pool *pool = tc->pool;
+	struct pool_shard *shard = tc->shard;
 	struct list_head cells;
 	struct dm_bio_prison_cell *cell;
 	unsigned int i, j, count;
@@ -2291,10 +2384,10 @@ static void process_thin_deferred_cells(struct thin_c *tc)
 		return;
 
 	do {
-		count = sort_cells(tc->pool, &cells);
+		count = sort_cells(shard, &cells);
 
 		for (i = 0; i < count; i++) {
-			cell = pool->cell_sort_array[i];
+			cell = shard->cell_sort_array[i];
 			BUG_ON(!cell->holder);
 
 			/*
@@ -2302,9 +2395,9 @@ static void process_thin_deferred_cells(struct thin_c *tc)
 			 * this bio might require one, we pause until there are some
 			 * prepared mappings to process.
 			 */
-			if (ensure_next_mapping(pool)) {
+			if (ensure_next_mapping(shard)) {
 				for (j = i; j < count; j++)
-					list_add(&pool->cell_sort_array[j]->user_list, &cells);
+					list_add(&shard->cell_sort_array[j]->user_list, &cells);
 
 				spin_lock_irq(&tc->lock);
 				list_splice(&cells, &tc->deferred_cells);
@@ -2360,17 +2453,68 @@ static struct thin_c *get_next_thin(struct pool *pool, struct thin_c *tc)
 	return NULL;
 }
 
-static void process_deferred_bios(struct pool *pool)
+static struct thin_c *get_first_shard_thin(struct pool_shard *shard)
+{
+	struct thin_c *tc = NULL;
+
+	rcu_read_lock();
+	if (!list_empty(&shard->thins)) {
+		tc = list_entry_rcu(shard->thins.next, struct thin_c, shard_list);
+		thin_get(tc);
+	}
+	rcu_read_unlock();
+
+	return tc;
+}
+
+static struct thin_c *get_next_shard_thin(struct pool_shard *shard,
+					  struct thin_c *tc)
+{
+	struct thin_c *old_tc = tc;
+
+	rcu_read_lock();
+	list_for_each_entry_continue_rcu(tc, &shard->thins, shard_list) {
+		thin_get(tc);
+		thin_put(old_tc);
+		rcu_read_unlock();
+		return tc;
+	}
+	thin_put(old_tc);
+	rcu_read_unlock();
+
+	return NULL;
+}
+
+static void process_shard_deferred(struct pool_shard *shard)
 {
-	struct bio *bio;
-	struct bio_list bios, bio_completions;
 	struct thin_c *tc;
 
-	tc = get_first_thin(pool);
+	tc = get_first_shard_thin(shard);
 	while (tc) {
 		process_thin_deferred_cells(tc);
 		process_thin_deferred_bios(tc);
-		tc = get_next_thin(pool, tc);
+		tc = get_next_shard_thin(shard, tc);
+	}
+}
+
+static void process_deferred_bios(struct pool *pool)
+{
+	struct bio *bio;
+	struct bio_list bios, bio_completions;
+	unsigned int i;
+
+	if (pool->nr_shards == 1) {
+		process_shard_deferred(pool->shards);
+	} else if (!list_empty(&pool->active_thins)) {
+		/*
+		 * Kick every shard; one may have stalled waiting for the
+		 * mappings we just completed.  The shards map concurrently
+		 * with the commit below and wake us again for any flush
+		 * bios they defer.  A pool without thins never kicks them,
+		 * which __pool_destroy() relies on.
+		 */
+		for (i = 0; i < pool->nr_shards; i++)
+			queue_work(pool->shard_wq, &pool->shards[i].worker);
 	}
 
 	/*
@@ -2433,6 +2577,41 @@ static void do_worker(struct work_struct *ws)
 	throttle_work_complete(&pool->throttle);
 }
 
+static void do_shard_worker(struct work_struct *ws)
+{
+	struct pool_shard *shard = container_of(ws, struct pool_shard, worker);
+	struct pool *pool = shard->pool;
+	bool need_commit;
+
+	throttle_work_start(&shard->throttle);
+	dm_pool_issue_prefetches(pool->pmd);
+	process_shard_deferred(shard);
+	throttle_work_complete(&shard->throttle);
+
+	/*
+	 * Flush bios are batched into a single commit by the pool worker,
+	 * whichever shard they were mapped on.
+	 */
+	spin_lock_irq(&pool->lock);
+	need_commit = !bio_list_empty(&pool->deferred_flush_bios);
+	spin_unlock_irq(&pool->lock);
+
+	if (need_commit)
+		wake_worker(pool);
+}
+
+/*
+ * Wait for the pool worker and any shard workers it has kicked.
+ */
+static void flush_pool_workers(struct pool *pool)
+{
+	flush_workqueue(pool->wq);
+	if (pool->shard_wq) {
+		flush_workqueue(pool->shard_wq);
+		flush_workqueue(pool->wq);
+	}
+}
+
 /*
  * We want to commit periodically so that not too much
  * unwritten data builds up.
@@ -2523,6 +2702,13 @@ static void noflush_work(struct thin_c *tc, void (*fn)(struct work_struct *))
 
 	w.tc = tc;
 	pool_work_wait(&w.pw, tc->pool, fn);
+
+	/*
+	 * A shard may still be mapping bios it took before requeue_mode
+	 * changed.
+	 */
+	if (tc->pool->nr_shards > 1)
+		flush_work(&tc->shard->worker);
 }
 
 /*----------------------------------------------------------------*/
@@ -2544,10 +2730,18 @@ static void set_discard_callbacks(struct pool *pool)
 static void set_pool_mode(struct pool *pool, enum pool_mode new_mode)
 {
 	struct pool_c *pt = pool->ti->private;
-	bool needs_check = dm_pool_metadata_needs_check(pool->pmd);
-	enum pool_mode old_mode = get_pool_mode(pool);
+	bool needs_check;
+	enum pool_mode old_mode;
 	unsigned long no_space_timeout = READ_ONCE(no_space_timeout_secs) * HZ;
 
+	/*
+	 * Shards may change the mode concurrently, don't let them mix the
+	 * process_* callbacks of different modes.
+	 */
+	mutex_lock(&pool->mode_lock);
+	needs_check = dm_pool_metadata_needs_check(pool->pmd);
+	old_mode = get_pool_mode(pool);
+
 	/*
 	 * Never allow the pool to transition to PM_WRITE mode if user
 	 * intervention is required to verify metadata and data consistency.
@@ -2634,6 +2828,7 @@ static void set_pool_mode(struct pool *pool, enum pool_mode new_mode)
 	 * doesn't cause an unexpected mode transition on resume.
 	 */
 	pt->adjusted_pf.mode = new_mode;
+	mutex_unlock(&pool->mode_lock);
 
 	if (old_mode != new_mode)
 		notify_of_pool_mode_change(pool);
@@ -2675,35 +2870,33 @@ static void metadata_operation_failed(struct pool *pool, const char *op, int r)
  */
 static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
 {
-	struct pool *pool = tc->pool;
-
 	spin_lock_irq(&tc->lock);
 	bio_list_add(&tc->deferred_bio_list, bio);
 	spin_unlock_irq(&tc->lock);
 
-	wake_worker(pool);
+	wake_thin_worker(tc);
 }
 
 static void thin_defer_bio_with_throttle(struct thin_c *tc, struct bio *bio)
 {
-	struct pool *pool = tc->pool;
+	struct throttle *t = thin_throttle(tc);
 
-	throttle_lock(&pool->throttle);
+	throttle_lock(t);
 	thin_defer_bio(tc, bio);
-	throttle_unlock(&pool->throttle);
+	throttle_unlock(t);
 }
 
 static void thin_defer_cell(struct thin_c *tc, struct dm_bio_prison_cell *cell)
 {
-	struct pool *pool = tc->pool;
+	struct throttle *t = thin_throttle(tc);
 
-	throttle_lock(&pool->throttle);
+	throttle_lock(t);
 	spin_lock_irq(&tc->lock);
 	list_add_tail(&cell->user_list, &tc->deferred_cells);
 	spin_unlock_irq(&tc->lock);
-	throttle_unlock(&pool->throttle);
+	throttle_unlock(t);
 
-	wake_worker(pool);
+	wake_thin_worker(tc);
 }
 
 static void thin_hook_bio(struct thin_c *tc, struct bio *bio)
@@ -2909,11 +3102,22 @@ static void pool_features_init(struct pool_features *pf)
 	pf->error_if_no_space = false;
 }
 
+static void __pool_destroy_shards(struct pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_shards; i++) {
+		vfree(pool->shards[i].cell_sort_array);
+		if (pool->shards[i].next_mapping)
+			mempool_free(pool->shards[i].next_mapping, &pool->mapping_pool);
+	}
+	kfree(pool->shards);
+}
+
 static void __pool_destroy(struct pool *pool)
 {
 	__pool_table_remove(pool);
 
-	vfree(pool->cell_sort_array);
 	if (dm_pool_metadata_close(pool->pmd) < 0)
 		DMWARN("%s: dm_pool_metadata_close() failed.", __func__);
 
@@ -2922,11 +3126,16 @@ static void __pool_destroy(struct pool *pool)
 
 	cancel_delayed_work_sync(&pool->waker);
 	cancel_delayed_work_sync(&pool->no_space_timeout);
+	/*
+	 * No thins remain, so the pool worker won't kick the shards and
+	 * the shards have no flush bios to wake the pool worker for.
+	 */
+	if (pool->shard_wq)
+		destroy_workqueue(pool->shard_wq);
 	if (pool->wq)
 		destroy_workqueue(pool->wq);
 
-	if (pool->next_mapping)
-		mempool_free(pool->next_mapping, &pool->mapping_pool);
+	__pool_destroy_shards(pool);
 	mempool_exit(&pool->mapping_pool);
 	dm_deferred_set_destroy(pool->shared_read_ds);
 	dm_deferred_set_destroy(pool->all_io_ds);
@@ -2942,6 +3151,7 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 				int read_only, char **error)
 {
 	int r;
+	unsigned int i;
 	void *err_p;
 	struct pool *pool;
 	struct dm_pool_metadata *pmd;
@@ -2995,6 +3205,8 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 	}
 
 	throttle_init(&pool->throttle);
+	mutex_init(&pool->mode_lock);
+	mutex_init(&pool->alloc_lock);
 	INIT_WORK(&pool->worker, do_worker);
 	INIT_DELAYED_WORK(&pool->waker, do_waker);
 	INIT_DELAYED_WORK(&pool->no_space_timeout, do_no_space_timeout);
@@ -3023,7 +3235,6 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		goto bad_all_io_ds;
 	}
 
-	pool->next_mapping = NULL;
 	r = mempool_init_slab_pool(&pool->mapping_pool, MAPPING_POOL_SIZE,
 				   _new_mapping_cache);
 	if (r) {
@@ -3032,13 +3243,40 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		goto bad_mapping_pool;
 	}
 
-	pool->cell_sort_array =
-		vmalloc(array_size(CELL_SORT_ARRAY_SIZE,
-				   sizeof(*pool->cell_sort_array)));
-	if (!pool->cell_sort_array) {
-		*error = "Error allocating cell sort array";
+	pool->nr_shards = clamp_val(READ_ONCE(pool_workers), 1, MAX_POOL_WORKERS);
+	pool->shards = kcalloc(pool->nr_shards, sizeof(*pool->shards), GFP_KERNEL);
+	if (!pool->shards) {
+		*error = "Error allocating pool shards";
 		err_p = ERR_PTR(-ENOMEM);
-		goto bad_sort_array;
+		goto bad_shards;
+	}
+
+	for (i = 0; i < pool->nr_shards; i++) {
+		struct pool_shard *shard = &pool->shards[i];
+
+		INIT_WORK(&shard->worker, do_shard_worker);
+		shard->pool = pool;
+		INIT_LIST_HEAD(&shard->thins);
+		throttle_init(&shard->throttle);
+		shard->cell_sort_array =
+			vmalloc(array_size(CELL_SORT_ARRAY_SIZE,
+					   sizeof(*shard->cell_sort_array)));
+		if (!shard->cell_sort_array) {
+			*error = "Error allocating cell sort array";
+			err_p = ERR_PTR(-ENOMEM);
+			goto bad_sort_array;
+		}
+	}
+
+	if (pool->nr_shards > 1) {
+		pool->shard_wq = alloc_workqueue("dm-" DM_MSG_PREFIX "-shard",
+						 WQ_MEM_RECLAIM | WQ_UNBOUND,
+						 pool->nr_shards);
+		if (!pool->shard_wq) {
+			*error = "Error creating pool's shard workqueue";
+			err_p = ERR_PTR(-ENOMEM);
+			goto bad_sort_array;
+		}
 	}
 
 	pool->ref_count = 1;
@@ -3051,6 +3289,8 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 	return pool;
 
 bad_sort_array:
+	__pool_destroy_shards(pool);
+bad_shards:
 	mempool_exit(&pool->mapping_pool);
 bad_mapping_pool:
 	dm_deferred_set_destroy(pool->all_io_ds);
@@ -3675,7 +3915,7 @@ static void pool_postsuspend(struct dm_target *ti)
 
 	cancel_delayed_work_sync(&pool->waker);
 	cancel_delayed_work_sync(&pool->no_space_timeout);
-	flush_workqueue(pool->wq);
+	flush_pool_workers(pool);
 	(void) commit(pool);
 }
 
@@ -4152,6 +4392,7 @@ static void thin_dtr(struct dm_target *ti)
 
 	spin_lock_irq(&tc->pool->lock);
 	list_del_rcu(&tc->list);
+	list_del_rcu(&tc->shard_list);
 	spin_unlock_irq(&tc->pool->lock);
 	synchronize_rcu();
 
@@ -4292,9 +4533,11 @@ static int thin_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		r = -EINVAL;
 		goto bad;
 	}
+	tc->shard = &tc->pool->shards[(unsigned int)tc->dev_id % tc->pool->nr_shards];
 	refcount_set(&tc->refcount, 1);
 	init_completion(&tc->can_destroy);
 	list_add_tail_rcu(&tc->list, &tc->pool->active_thins);
+	list_add_tail_rcu(&tc->shard_list, &tc->shard->thins);
 	spin_unlock_irq(&tc->pool->lock);
 	/*
 	 * This synchronize_rcu() call is needed here otherwise we risk a
@@ -4559,6 +4802,9 @@ module_exit(dm_thin_exit);
 module_param_named(no_space_timeout, no_space_timeout_secs, uint, 0644);
 MODULE_PARM_DESC(no_space_timeout, "Out of data space queue IO timeout in seconds");
 
+module_param(pool_workers, uint, 0644);
+MODULE_PARM_DESC(pool_workers, "Number of workers mapping the thin devices of a newly created pool");
+
 MODULE_DESCRIPTION(DM_NAME " thin provisioning target");
 MODULE_AUTHOR("Joe Thornber <dm-devel@redhat.com>");
 MODULE_LICENSE("GPL");
@@ -38,8 +38,9 @@
 #define DM_VERITY_OPT_IGN_ZEROES	"ignore_zero_blocks"
 #define DM_VERITY_OPT_AT_MOST_ONCE	"check_at_most_once"
 #define DM_VERITY_OPT_TASKLET_VERIFY	"try_verify_in_tasklet"
+#define DM_VERITY_OPT_PRELOAD_LEVELS	"preload_levels"
 
-#define DM_VERITY_OPTS_MAX		(4 + DM_VERITY_OPTS_FEC + \
+#define DM_VERITY_OPTS_MAX		(6 + DM_VERITY_OPTS_FEC + \
 					 DM_VERITY_ROOT_HASH_VERIFICATION_OPTS)
 
 static unsigned int dm_verity_prefetch_cluster = DM_VERITY_DEFAULT_PREFETCH_SIZE;
@@ -145,6 +146,17 @@ static int verity_hash_init(struct dm_verity *v, struct ahash_request *req,
 		crypto_req_done, (void *)wait);
 	crypto_init_wait(wait);
 
+	/*
+	 * Start from the precomputed state of the salt, rather than hashing
+	 * the salt again for every block.
+	 */
+	if (likely(v->initial_hashstate)) {
+		r = crypto_ahash_import(req, v->initial_hashstate);
+		if (unlikely(r < 0))
+			DMERR("crypto_ahash_import failed: %d", r);
+		return r;
+	}
+
 	r = crypto_wait_req(crypto_ahash_init(req), wait);
 
 	if (unlikely(r < 0)) {
@@ -558,6 +570,61 @@ static inline void verity_bv_skip_block(struct dm_verity *v,
 	bio_advance_iter(bio, iter, 1 << v->data_dev_block_bits);
 }
 
+/*
+ * Find the wanted digest of a data block.  Consecutive data blocks share
+ * their level 0 hash block, so while "more" blocks of the same io follow,
+ * keep a verified level 0 hash block in *hbuf and take the digests of the
+ * following blocks straight from it instead of looking it up in dm-bufio
+ * again for every data block.
+ */
+static int verity_io_block_digest(struct dm_verity *v, struct dm_verity_io *io,
+				  sector_t block, bool more,
+				  struct dm_buffer **hbuf, bool *is_zero)
+{
+	u8 *want_digest = verity_io_want_digest(v, io);
+	struct buffer_aux *aux;
+	sector_t hash_block;
+	unsigned int offset;
+	u8 *data;
+	int r;
+
+	if (unlikely(!v->levels))
+		return verity_hash_for_block(v, io, block, want_digest, is_zero);
+
+	verity_hash_at_level(v, block, 0, &hash_block, &offset);
+
+	if (*hbuf) {
+		if (dm_bufio_get_block_number(*hbuf) == hash_block) {
+			data = dm_bufio_get_block_data(*hbuf);
+			memcpy(want_digest, data + offset, v->digest_size);
+			*is_zero = v->zero_digest &&
+				!memcmp(v->zero_digest, want_digest, v->digest_size);
+			return 0;
+		}
+		dm_bufio_release(*hbuf);
+		*hbuf = NULL;
+	}
+
+	r = verity_hash_for_block(v, io, block, want_digest, is_zero);
+	if (r || !more)
+		return r;
+
+	data = dm_bufio_get(v->bufio, hash_block, hbuf);
+	if (IS_ERR_OR_NULL(data)) {
+		*hbuf = NULL;
+		return 0;
+	}
+
+	/* only hash blocks that passed verification may be reused */
+	aux = dm_bufio_get_aux_data(*hbuf);
+	if (!aux->hash_verified) {
+		dm_bufio_release(*hbuf);
+		*hbuf = NULL;
+	}
+
+	return 0;
+}
+
 /*
  * Verify one "dm_verity_io" structure.
  */
@@ -570,7 +637,9 @@ static int verity_verify_io(struct dm_verity_io *io)
 	struct bvec_iter *iter;
 	struct crypto_wait wait;
 	struct bio *bio = dm_bio_from_per_bio_data(io, v->ti->per_io_data_size);
+	struct dm_buffer *hbuf = NULL;
 	unsigned int b;
+	int r = 0;
 
 	if (static_branch_unlikely(&use_tasklet_enabled) && io->in_tasklet) {
 		/*
@@ -583,7 +652,6 @@ static int verity_verify_io(struct dm_verity_io *io)
 		iter = &io->iter;
 
 	for (b = 0; b < io->n_blocks; b++) {
-		int r;
 		sector_t cur_block = io->block + b;
 		struct ahash_request *req = verity_io_hash_req(v, io);
 
@@ -593,11 +661,11 @@ static int verity_verify_io(struct dm_verity_io *io)
 			continue;
 		}
 
-		r = verity_hash_for_block(v, io, cur_block,
-					  verity_io_want_digest(v, io),
-					  &is_zero);
+		r = verity_io_block_digest(v, io, cur_block,
+					   b + 1 < io->n_blocks, &hbuf,
+					   &is_zero);
 		if (unlikely(r < 0))
-			return r;
+			goto out;
 
 		if (is_zero) {
 			/*
@@ -607,24 +675,24 @@ static int verity_verify_io(struct dm_verity_io *io)
 			r = verity_for_bv_block(v, io, iter,
 						verity_bv_zero);
 			if (unlikely(r < 0))
-				return r;
+				goto out;
 
 			continue;
 		}
 
 		r = verity_hash_init(v, req, &wait, !io->in_tasklet);
 		if (unlikely(r < 0))
-			return r;
+			goto out;
 
 		start = *iter;
 		r = verity_for_io_block(v, io, iter, &wait);
 		if (unlikely(r < 0))
-			return r;
+			goto out;
 
 		r = verity_hash_final(v, req, verity_io_real_digest(v, io),
 					&wait);
 		if (unlikely(r < 0))
-			return r;
+			goto out;
 
 		if (likely(memcmp(verity_io_real_digest(v, io),
 				  verity_io_want_digest(v, io), v->digest_size) == 0)) {
@@ -637,7 +705,8 @@ static int verity_verify_io(struct dm_verity_io *io)
 			 * Error handling code (FEC included) cannot be run in a
 			 * tasklet since it may sleep, so fallback to work-queue.
 			 */
-			return -EAGAIN;
+			r = -EAGAIN;
+			goto out;
 		} else if (verity_recheck(v, io, start, cur_block) == 0) {
 			if (v->validated_blocks)
 				set_bit(cur_block, v->validated_blocks);
@@ -652,18 +721,24 @@ static int verity_verify_io(struct dm_verity_io *io)
 				/*
 				 * Error correction failed; Just return error
 				 */
-				return -EIO;
+				r = -EIO;
+				goto out;
 			}
 			if (verity_handle_err(v, DM_VERITY_BLOCK_TYPE_DATA,
 					      cur_block)) {
 				dm_audit_log_bio(DM_MSG_PREFIX, "verify-data",
 						 bio, cur_block, 0);
-				return -EIO;
+				r = -EIO;
+				goto out;
 			}
 		}
 	}
 
-	return 0;
+	r = 0;
+out:
+	if (hbuf)
+		dm_bufio_release(hbuf);
+	return r;
 }
 
 /*
@@ -759,12 +834,47 @@ static void verity_prefetch_io(struct work_struct *work)
 	kfree(pw);
 }
 
+/*
+ * For sequential reads, extend the prefetch by the data covered by one
+ * prefetch cluster of level 0 hash blocks, so that the next cluster and
+ * the upper level blocks leading to it are read before the data catches
+ * up with them.  Ios that stay well inside the range already prefetched
+ * ahead don't queue any prefetch work at all.
+ */
+static bool verity_prefetch_ahead(struct dm_verity *v, sector_t *block,
+				  unsigned int *n_blocks)
+{
+	sector_t io_block = *block, end = *block + *n_blocks;
+	unsigned int cluster = READ_ONCE(dm_verity_prefetch_cluster);
+	sector_t window, ahead;
+	bool seq;
+
+	seq = io_block == READ_ONCE(v->seq_next_block);
+	WRITE_ONCE(v->seq_next_block, end);
+
+	cluster >>= v->data_dev_block_bits;
+	if (!seq || !cluster)
+		return true;
+
+	window = (sector_t)rounddown_pow_of_two(cluster) << v->hash_per_block_bits;
+	if (end + window / 2 <= READ_ONCE(v->seq_prefetched))
+		return false;
+
+	ahead = min(end + window, v->data_blocks);
+	WRITE_ONCE(v->seq_prefetched, ahead);
+	*n_blocks = min_t(sector_t, ahead - *block, UINT_MAX);
+	return true;
+}
+
 static void verity_submit_prefetch(struct dm_verity *v, struct dm_verity_io *io)
 {
 	sector_t block = io->block;
 	unsigned int n_blocks = io->n_blocks;
 	struct dm_verity_prefetch_work *pw;
 
+	if (!verity_prefetch_ahead(v, &block, &n_blocks))
+		return;
+
 	if (v->validated_blocks) {
 		while (n_blocks && test_bit(block, v->validated_blocks)) {
 			block++;
@@ -790,6 +900,23 @@ static void verity_submit_prefetch(struct dm_verity *v, struct dm_verity_io *io)
 	queue_work(v->verify_wq, &pw->work);
 }
 
+/*
+ * Start reading the top "preload_levels" levels of the hash tree, so that
+ * the first reads after the table is loaded only have to wait for the
+ * lowest levels.  Verification of these blocks still happens on first use.
+ */
+static void verity_preload_levels(struct dm_verity *v)
+{
+	int i;
+
+	for (i = v->levels - 1; i >= (int)v->levels - (int)v->preload_levels; i--) {
+		sector_t end = i ? v->hash_level_block[i - 1] : v->hash_blocks;
+
+		dm_bufio_prefetch(v->bufio, v->hash_level_block[i],
+				  end - v->hash_level_block[i]);
+	}
+}
+
 /*
  * Bio map function. It allocates dm_verity_io structure and bio vector and
  * fills them. Then it issues prefetches and the I/O.
@@ -880,6 +1007,8 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 			args++;
 		if (v->use_tasklet)
 			args++;
+		if (v->preload_levels)
+			args += 2;
 		if (v->signature_key_desc)
 			args += DM_VERITY_ROOT_HASH_VERIFICATION_OPTS;
 		if (!args)
@@ -907,6 +1036,9 @@ static void verity_status(struct dm_target *ti, status_type_t type,
 			DMEMIT(" " DM_VERITY_OPT_AT_MOST_ONCE);
 		if (v->use_tasklet)
 			DMEMIT(" " DM_VERITY_OPT_TASKLET_VERIFY);
+		if (v->preload_levels)
+			DMEMIT(" " DM_VERITY_OPT_PRELOAD_LEVELS " %u",
+			       v->preload_levels);
 		sz = verity_fec_status_table(v, sz, result, maxlen);
 		if (v->signature_key_desc)
 			DMEMIT(" " DM_VERITY_ROOT_HASH_VERIFICATION_OPT_SIG_KEY
@@ -1008,6 +1140,7 @@ static void verity_dtr(struct dm_target *ti)
 	kfree(v->salt);
 	kfree(v->root_digest);
 	kfree(v->zero_digest);
+	kfree(v->initial_hashstate);
 
 	if (v->tfm)
 		crypto_free_ahash(v->tfm);
@@ -1163,6 +1296,18 @@ static int verity_parse_opt_args(struct dm_arg_set *as, struct dm_verity *v,
 			static_branch_inc(&use_tasklet_enabled);
 			continue;
 
+		} else if (!strcasecmp(arg_name, DM_VERITY_OPT_PRELOAD_LEVELS)) {
+			if (only_modifier_opts)
+				continue;
+			if (!argc || kstrtouint(dm_shift_arg(as), 10,
+						&v->preload_levels) ||
+			    v->preload_levels > DM_VERITY_MAX_LEVELS) {
+				ti->error = "Invalid " DM_VERITY_OPT_PRELOAD_LEVELS;
+				return -EINVAL;
+			}
+			argc--;
+			continue;
+
 		} else if (verity_is_fec_opt_arg(arg_name)) {
 			if (only_modifier_opts)
 				continue;
@@ -1199,6 +1344,51 @@ static int verity_parse_opt_args(struct dm_arg_set *as, struct dm_verity *v,
 	return r;
 }
 
+/*
+ * Version 1 hashes start with the salt.  Hash it once here and keep the
+ * exported state, verity_hash_init() imports it for every block.  Not
+ * all hash drivers support export, in which case the salt is hashed for
+ * each block as before.
+ */
+static int verity_setup_initial_hashstate(struct dm_verity *v)
+{
+	struct ahash_request *req;
+	struct crypto_wait wait;
+	int r;
+
+	if (!v->salt_size || !v->version)
+		return 0;
+
+	v->initial_hashstate = kmalloc(crypto_ahash_statesize(v->tfm),
+				       GFP_KERNEL);
+	if (!v->initial_hashstate)
+		return -ENOMEM;
+
+	req = ahash_request_alloc(v->tfm, GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	ahash_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP |
+				   CRYPTO_TFM_REQ_MAY_BACKLOG,
+				   crypto_req_done, (void *)&wait);
+	crypto_init_wait(&wait);
+
+	r = crypto_wait_req(crypto_ahash_init(req), &wait);
+	if (!r)
+		r = verity_hash_update(v, req, v->salt, v->salt_size, &wait);
+	if (!r)
+		r = crypto_ahash_export(req, v->initial_hashstate);
+	ahash_request_free(req);
+
+	if (r) {
+		kfree(v->initial_hashstate);
+		v->initial_hashstate = NULL;
+		if (r == -ENOMEM)
+			return r;
+	}
+	return 0;
+}
+
 /*
  * Target parameters:
  *	<version>	The current format is version 1.
@@ -1386,6 +1576,12 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		}
 	}
 
+	r = verity_setup_initial_hashstate(v);
+	if (r) {
+		ti->error = "Cannot set up initial hash state";
+		goto bad;
+	}
+
 	argv += 10;
 	argc -= 10;
 
@@ -1422,6 +1618,7 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		r = -E2BIG;
 		goto bad;
 	}
+	v->preload_levels = min_t(unsigned int, v->preload_levels, v->levels);
 
 	hash_position = v->hash_start;
 	for (i = v->levels - 1; i >= 0; i--) {
@@ -1496,6 +1693,9 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	ti->per_io_data_size = roundup(ti->per_io_data_size,
 				       __alignof__(struct dm_verity_io));
 
+	if (v->preload_levels)
+		verity_preload_levels(v);
+
 	verity_verify_sig_opts_cleanup(&verify_args);
 
 	dm_audit_log_ctr(DM_MSG_PREFIX, ti, 1);
@@ -1560,7 +1760,7 @@ int dm_verity_get_root_digest(struct dm_target *ti, u8 **root_digest, unsigned i
 static struct target_type verity_target = {
 	.name		= "verity",
 	.features	= DM_TARGET_IMMUTABLE,
-	.version	= {1, 9, 0},
+	.version	= {1, 10, 0},
 	.module		= THIS_MODULE,
 	.ctr		= verity_ctr,
 	.dtr		= verity_dtr,
@@ -43,6 +43,7 @@ struct dm_verity {
 	u8 *root_digest;	/* digest of the root block */
 	u8 *salt;		/* salt: its size is salt_size */
 	u8 *zero_digest;	/* digest for a zero block */
+	u8 *initial_hashstate;	/* exported hash state after the salt */
 	unsigned int salt_size;
 	sector_t data_start;	/* data offset in 512-byte sectors */
 	sector_t hash_start;	/* hash start in blocks */
@@ -59,6 +60,7 @@ struct dm_verity {
 	unsigned int ahash_reqsize;/* the size of temporary space for crypto */
 	enum verity_mode mode;	/* mode for handling verification errors */
 	unsigned int corrupted_errs;/* Number of errors for corrupted blocks */
+	unsigned int preload_levels;/* top tree levels read at table load */
 
 	struct workqueue_struct *verify_wq;
 
@@ -68,6 +70,10 @@ struct dm_verity {
 	struct dm_verity_fec *fec;	/* forward error correction */
 	unsigned long *validated_blocks; /* bitset blocks validated */
 
+	/* sequential read detection for hash prefetch, updated racily */
+	sector_t seq_next_block;	/* block following the last io */
+	sector_t seq_prefetched;	/* end of the data prefetched ahead */
+
 	char *signature_key_desc; /* signature keyring reference */
 
 	struct dm_io_client *io;
@@ -31,6 +31,8 @@
 #define MAX_AGE_DIV			16
 #define MAX_AGE_UNSPECIFIED		-1UL
 #define PAUSE_WRITEBACK			(HZ * 3)
+#define MAX_WRITEBACK_STREAMS		64
+#define WRITEBACK_STREAM_REGION_SHIFT	21
 
 #define BITMAP_GRANULARITY	65536
 #if BITMAP_GRANULARITY < PAGE_SIZE
@@ -106,6 +108,17 @@ struct wc_entry {
 #endif
 #define WC_MODE_SORT_FREELIST(wc)		(!WC_MODE_PMEM(wc))
 
+struct writeback_list {
+	struct list_head list;
+	size_t size;
+};
+
+struct writeback_stream {
+	struct work_struct work;
+	struct dm_writecache *wc;
+	struct writeback_list wbl;
+};
+
 struct dm_writecache {
 	struct mutex lock;
 	struct list_head lru;
@@ -174,6 +187,7 @@ struct dm_writecache {
 	bool cleaner_set:1;
 	bool metadata_only:1;
 	bool pause_set:1;
+	bool writeback_streams_set:1;
 
 	unsigned int high_wm_percent_value;
 	unsigned int low_wm_percent_value;
@@ -186,6 +200,10 @@ struct dm_writecache {
 	struct work_struct writeback_work;
 	struct work_struct flush_work;
 
+	unsigned int writeback_streams;
+	struct writeback_stream *wb_streams;
+	struct workqueue_struct *stream_wq;
+
 	struct dm_io_tracker iot;
 
 	struct dm_io_client *dm_io;
@@ -1809,17 +1827,33 @@ static bool wc_add_block(struct writeback_struct *wb, struct wc_entry *e)
 			    block_size, persistent_memory_page_offset(address)) != 0;
 }
 
-struct writeback_list {
-	struct list_head list;
-	size_t size;
-};
+/*
+ * Entries that were selected for writeback but not submitted yet. With
+ * multiple streams, the unsubmitted entries of all the streams must be
+ * discounted, otherwise streams could wait on each other forever.
+ */
+static size_t writeback_unsubmitted(struct dm_writecache *wc, struct writeback_list *wbl)
+{
+	size_t size = 0;
+	unsigned int i;
+
+	if (likely(wc->writeback_streams == 1))
+		return READ_ONCE(wbl->size);
+
+	for (i = 0; i < wc->writeback_streams; i++)
+		size += READ_ONCE(wc->wb_streams[i].wbl.size);
+
+	return size;
+}
 
 static void __writeback_throttle(struct dm_writecache *wc, struct writeback_list *wbl)
 {
 	if (unlikely(wc->max_writeback_jobs)) {
-		if (READ_ONCE(wc->writeback_size) - wbl->size >= wc->max_writeback_jobs) {
+		if (READ_ONCE(wc->writeback_size) - writeback_unsubmitted(wc, wbl) >=
+		    wc->max_writeback_jobs) {
 			wc_lock(wc);
-			while (wc->writeback_size - wbl->size >= wc->max_writeback_jobs)
+			while (wc->writeback_size - writeback_unsubmitted(wc, wbl) >=
+			       wc->max_writeback_jobs)
 				writecache_wait_on_freelist(wc);
 			wc_unlock(wc);
 		}
@@ -1835,7 +1869,7 @@ static void __writecache_writeback_pmem(struct dm_writecache *wc, struct writeba
 	unsigned int max_pages;
 
 	while (wbl->size) {
-		wbl->size--;
+		WRITE_ONCE(wbl->size, wbl->size - 1);
 		e = container_of(wbl->list.prev, struct wc_entry, lru);
 		list_del(&e->lru);
 
@@ -1870,7 +1904,7 @@ static void __writecache_writeback_pmem(struct dm_writecache *wc, struct writeba
 				break;
 			if (!wc_add_block(wb, f))
 				break;
-			wbl->size--;
+			WRITE_ONCE(wbl->size, wbl->size - 1);
 			list_del(&f->lru);
 			wb->wc_list[wb->wc_list_n++] = f;
 			e = f;
@@ -1900,7 +1934,7 @@ static void __writecache_writeback_ssd(struct dm_writecache *wc, struct writebac
 	while (wbl->size) {
 		unsigned int n_sectors;
 
-		wbl->size--;
+		WRITE_ONCE(wbl->size, wbl->size - 1);
 		e = container_of(wbl->list.prev, struct wc_entry, lru);
 		list_del(&e->lru);
 
@@ -1919,7 +1953,7 @@ static void __writecache_writeback_ssd(struct dm_writecache *wc, struct writebac
 		c->n_entries = e->wc_list_contiguous;
 
 		while ((n_sectors -= wc->block_size >> SECTOR_SHIFT)) {
-			wbl->size--;
+			WRITE_ONCE(wbl->size, wbl->size - 1);
 			f = container_of(wbl->list.prev, struct wc_entry, lru);
 			BUG_ON(f != e + 1);
 			list_del(&f->lru);
@@ -1940,15 +1974,54 @@ static void __writecache_writeback_ssd(struct dm_writecache *wc, struct writebac
 	}
 }
 
+static void __writecache_writeback_submit(struct dm_writecache *wc, struct writeback_list *wbl)
+{
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+
+	if (WC_MODE_PMEM(wc))
+		__writecache_writeback_pmem(wc, wbl);
+	else
+		__writecache_writeback_ssd(wc, wbl);
+
+	blk_finish_plug(&plug);
+}
+
+static void writecache_writeback_stream(struct work_struct *work)
+{
+	struct writeback_stream *s = container_of(work, struct writeback_stream, work);
+
+	__writecache_writeback_submit(s->wc, &s->wbl);
+}
+
+/*
+ * Runs are distributed to the streams by the region of the origin device
+ * they belong to, so that each stream submits a sorted sequence of writes
+ * to its own part of the origin device.
+ */
+static struct writeback_list *writeback_stream_list(struct dm_writecache *wc,
+						     struct wc_entry *e)
+{
+	sector_t region;
+
+	if (likely(wc->writeback_streams == 1))
+		return &wc->wb_streams[0].wbl;
+
+	region = read_original_sector(wc, e) >> WRITEBACK_STREAM_REGION_SHIFT;
+	return &wc->wb_streams[sector_div(region, wc->writeback_streams)].wbl;
+}
+
 static void writecache_writeback(struct work_struct *work)
 {
 	struct dm_writecache *wc = container_of(work, struct dm_writecache, writeback_work);
-	struct blk_plug plug;
 	struct wc_entry *f, *g, *e = NULL;
 	struct rb_node *node, *next_node;
 	struct list_head skipped;
-	struct writeback_list wbl;
+	struct writeback_list *wbl;
 	unsigned long n_walked;
+	size_t n_selected;
+	unsigned int i;
 
 	if (!WC_MODE_PMEM(wc)) {
 		/* Wait for any active kcopyd work on behalf of ssd writeback */
@@ -1988,9 +2061,12 @@ static void writecache_writeback(struct work_struct *work)
 		writecache_wait_for_ios(wc, WRITE);
 
 	n_walked = 0;
+	n_selected = 0;
 	INIT_LIST_HEAD(&skipped);
-	INIT_LIST_HEAD(&wbl.list);
-	wbl.size = 0;
+	for (i = 0; i < wc->writeback_streams; i++) {
+		INIT_LIST_HEAD(&wc->wb_streams[i].wbl.list);
+		wc->wb_streams[i].wbl.size = 0;
+	}
 	while (!list_empty(&wc->lru) &&
 	       (wc->writeback_all ||
 		wc->freelist_size + wc->writeback_size <= wc->freelist_low_watermark ||
@@ -1998,7 +2074,7 @@ static void writecache_writeback(struct work_struct *work)
 		 wc->max_age - wc->max_age / MAX_AGE_DIV))) {
 
 		n_walked++;
-		if (unlikely(n_walked > WRITEBACK_LATENCY) &&
+		if (unlikely(n_walked > WRITEBACK_LATENCY * wc->writeback_streams) &&
 		    likely(!wc->writeback_all)) {
 			if (likely(!dm_suspended(wc->ti)))
 				queue_work(wc->writeback_wq, &wc->writeback_work);
@@ -2028,9 +2104,11 @@ static void writecache_writeback(struct work_struct *work)
 				continue;
 			}
 		}
+		wbl = writeback_stream_list(wc, e);
 		wc->writeback_size++;
-		list_move(&e->lru, &wbl.list);
-		wbl.size++;
+		list_move(&e->lru, &wbl->list);
+		wbl->size++;
+		n_selected++;
 		e->write_in_progress = true;
 		e->wc_list_contiguous = 1;
 
@@ -2064,8 +2142,9 @@ static void writecache_writeback(struct work_struct *work)
 			//	break;
 
 			wc->writeback_size++;
-			list_move(&g->lru, &wbl.list);
-			wbl.size++;
+			list_move(&g->lru, &wbl->list);
+			wbl->size++;
+			n_selected++;
 			g->write_in_progress = true;
 			g->wc_list_contiguous = BIO_MAX_VECS;
 			f = g;
@@ -2088,20 +2167,21 @@ static void writecache_writeback(struct work_struct *work)
 		 * If we didn't do any progress, we must wait until some
 		 * writeback finishes to avoid burning CPU in a loop
 		 */
-		if (unlikely(!wbl.size))
+		if (unlikely(!n_selected))
 			writecache_wait_for_writeback(wc);
 	}
 
 	wc_unlock(wc);
 
-	blk_start_plug(&plug);
-
-	if (WC_MODE_PMEM(wc))
-		__writecache_writeback_pmem(wc, &wbl);
-	else
-		__writecache_writeback_ssd(wc, &wbl);
-
-	blk_finish_plug(&plug);
+	if (likely(wc->writeback_streams == 1)) {
+		__writecache_writeback_submit(wc, &wc->wb_streams[0].wbl);
+	} else {
+		for (i = 0; i < wc->writeback_streams; i++)
+			if (wc->wb_streams[i].wbl.size)
+				queue_work(wc->stream_wq, &wc->wb_streams[i].work);
+		for (i = 0; i < wc->writeback_streams; i++)
+			flush_work(&wc->wb_streams[i].work);
+	}
 
 	if (unlikely(wc->writeback_all)) {
 		wc_lock(wc);
@@ -2200,6 +2280,11 @@ static void writecache_dtr(struct dm_target *ti)
 	if (wc->writeback_wq)
 		destroy_workqueue(wc->writeback_wq);
 
+	if (wc->stream_wq)
+		destroy_workqueue(wc->stream_wq);
+
+	kfree(wc->wb_streams);
+
 	if (wc->dev)
 		dm_put_device(ti, wc->dev);
 
@@ -2241,7 +2326,7 @@ static int writecache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	struct wc_memory_superblock s;
 
 	static struct dm_arg _args[] = {
-		{0, 18, "Invalid number of feature args"},
+		{0, 20, "Invalid number of feature args"},
 	};
 
 	as.argc = argc;
@@ -2389,6 +2474,7 @@ static int writecache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	wc->block_size_bits = __ffs(wc->block_size);
 
 	wc->max_writeback_jobs = MAX_WRITEBACK_JOBS;
+	wc->writeback_streams = 1;
 	wc->autocommit_blocks = !WC_MODE_PMEM(wc) ? AUTOCOMMIT_BLOCKS_SSD : AUTOCOMMIT_BLOCKS_PMEM;
 	wc->autocommit_jiffies = msecs_to_jiffies(AUTOCOMMIT_MSEC);
 
@@ -2490,6 +2576,16 @@ static int writecache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			wc->pause = msecs_to_jiffies(pause_msecs);
 			wc->pause_set = true;
 			wc->pause_value = pause_msecs;
+		} else if (!strcasecmp(string, "writeback_streams") && opt_params >= 1) {
+			unsigned int streams;
+
+			string = dm_shift_arg(&as), opt_params--;
+			if (sscanf(string, "%u%c", &streams, &dummy) != 1)
+				goto invalid_optional;
+			if (!streams || streams > MAX_WRITEBACK_STREAMS)
+				goto invalid_optional;
+			wc->writeback_streams = streams;
+			wc->writeback_streams_set = true;
 		} else {
 invalid_optional:
 			r = -EINVAL;
@@ -2504,6 +2600,27 @@ static int writecache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	wc->wb_streams = kcalloc(wc->writeback_streams, sizeof(struct writeback_stream),
+				 GFP_KERNEL);
+	if (!wc->wb_streams) {
+		r = -ENOMEM;
+		ti->error = "Cannot allocate writeback streams";
+		goto bad;
+	}
+	for (i = 0; i < wc->writeback_streams; i++) {
+		wc->wb_streams[i].wc = wc;
+		INIT_WORK(&wc->wb_streams[i].work, writecache_writeback_stream);
+	}
+	if (wc->writeback_streams > 1) {
+		wc->stream_wq = alloc_workqueue("writecache-stream", WQ_MEM_RECLAIM | WQ_UNBOUND,
+						wc->writeback_streams);
+		if (!wc->stream_wq) {
+			r = -ENOMEM;
+			ti->error = "Could not allocate writeback stream workqueue";
+			goto bad;
+		}
+	}
+
 	if (WC_MODE_PMEM(wc)) {
 		if (!dax_synchronous(wc->ssd_dev->dax_dev)) {
 			r = -EOPNOTSUPP;
@@ -2727,6 +2844,8 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 			extra_args++;
 		if (wc->pause_set)
 			extra_args += 2;
+		if (wc->writeback_streams_set)
+			extra_args += 2;
 
 		DMEMIT("%u", extra_args);
 		if (wc->start_sector_set)
@@ -2751,6 +2870,8 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 			DMEMIT(" metadata_only");
 		if (wc->pause_set)
 			DMEMIT(" pause_writeback %u", wc->pause_value);
+		if (wc->writeback_streams_set)
+			DMEMIT(" writeback_streams %u", wc->writeback_streams);
 		break;
 	case STATUSTYPE_IMA:
 		*result = '\0';
@@ -2760,7 +2881,7 @@ static void writecache_status(struct dm_target *ti, status_type_t type,
 
 static struct target_type writecache_target = {
 	.name			= "writecache",
-	.version		= {1, 6, 0},
+	.version		= {1, 7, 0},
 	.module			= THIS_MODULE,
 	.ctr			= writecache_ctr,
 	.dtr			= writecache_dtr,
@@ -216,6 +216,19 @@ static void raid5_wakeup_stripe_thread(struct stripe_head *sh)
 	}
 }
 
+/*
+ * Take device_lock from the stripe handling paths, recording in the
+ * stripe_cache_stats whether we had to wait for it.
+ */
+static void lock_device_irq(struct r5conf *conf)
+	__acquires(&conf->device_lock)
+{
+	if (!spin_trylock_irq(&conf->device_lock)) {
+		this_cpu_inc(conf->percpu->device_lock_contended);
+		spin_lock_irq(&conf->device_lock);
+	}
+}
+
 static void do_release_stripe(struct r5conf *conf, struct stripe_head *sh,
 			      struct list_head *temp_inactive_list)
 	__must_hold(&conf->device_lock)
@@ -366,23 +379,33 @@ static int release_stripe_list(struct r5conf *conf,
 	struct stripe_head *sh, *t;
 	int count = 0;
 	struct llist_node *head;
+	int cpu;
 
-	head = llist_del_all(&conf->released_stripes);
-	head = llist_reverse_order(head);
-	llist_for_each_entry_safe(sh, t, head, release_list) {
-		int hash;
-
-		/* sh could be readded after STRIPE_ON_RELEASE_LIST is cleard */
-		smp_mb();
-		clear_bit(STRIPE_ON_RELEASE_LIST, &sh->state);
+	for_each_cpu(cpu, conf->released_cpus) {
 		/*
-		 * Don't worry the bit is set here, because if the bit is set
-		 * again, the count is always > 1. This is true for
-		 * STRIPE_ON_UNPLUG_LIST bit too.
+		 * Clear the bit before emptying the list: a release that
+		 * finds the list empty after this point sets it again.
 		 */
-		hash = sh->hash_lock_index;
-		__release_stripe(conf, sh, &temp_inactive_list[hash]);
-		count++;
+		cpumask_clear_cpu(cpu, conf->released_cpus);
+		smp_mb__after_atomic();
+		head = llist_del_all(
+			&per_cpu_ptr(conf->percpu, cpu)->released_stripes);
+		head = llist_reverse_order(head);
+		llist_for_each_entry_safe(sh, t, head, release_list) {
+			int hash;
+
+			/* sh could be readded after STRIPE_ON_RELEASE_LIST is cleard */
+			smp_mb();
+			clear_bit(STRIPE_ON_RELEASE_LIST, &sh->state);
+			/*
+			 * Don't worry the bit is set here, because if the bit
+			 * is set again, the count is always > 1. This is true
+			 * for STRIPE_ON_UNPLUG_LIST bit too.
+			 */
+			hash = sh->hash_lock_index;
+			__release_stripe(conf, sh, &temp_inactive_list[hash]);
+			count++;
+		}
 	}
 
 	return count;
@@ -393,8 +416,7 @@ void raid5_release_stripe(struct stripe_head *sh)
 	struct r5conf *conf = sh->raid_conf;
 	unsigned long flags;
 	struct list_head list;
-	int hash;
-	bool wakeup;
+	int hash, cpu;
 
 	/* Avoid release_list until the last reference.
 	 */
@@ -404,9 +426,17 @@ void raid5_release_stripe(struct stripe_head *sh)
 	if (unlikely(!conf->mddev->thread) ||
 		test_and_set_bit(STRIPE_ON_RELEASE_LIST, &sh->state))
 		goto slow_path;
-	wakeup = llist_add(&sh->release_list, &conf->released_stripes);
-	if (wakeup)
+	/*
+	 * Queue on this CPU's list so that concurrent submitters don't all
+	 * bounce one llist head; only the first stripe on a list needs to
+	 * publish the CPU and wake raid5d.
+	 */
+	cpu = raw_smp_processor_id();
+	if (llist_add(&sh->release_list,
+		      &per_cpu_ptr(conf->percpu, cpu)->released_stripes)) {
+		cpumask_set_cpu(cpu, conf->released_cpus);
 		md_wakeup_thread(conf->mddev->thread);
+	}
 	return;
 slow_path:
 	/* we are ok here if STRIPE_ON_RELEASE_LIST is set or not */
@@ -636,6 +666,7 @@ static struct stripe_head *find_get_stripe(struct r5conf *conf,
 	if (!sh)
 		return NULL;
 
+	this_cpu_inc(conf->percpu->cache_hits);
 	if (atomic_inc_not_zero(&sh->count))
 		return sh;
 
@@ -645,7 +676,10 @@ static struct stripe_head *find_get_stripe(struct r5conf *conf,
 	 * references it with the device_lock held.
 	 */
 
-	spin_lock(&conf->device_lock);
+	if (!spin_trylock(&conf->device_lock)) {
+		this_cpu_inc(conf->percpu->device_lock_contended);
+		spin_lock(&conf->device_lock);
+	}
 	if (!atomic_read(&sh->count)) {
 		if (!test_bit(STRIPE_HANDLE, &sh->state))
 			atomic_inc(&conf->active_stripes);
@@ -838,6 +872,7 @@ struct stripe_head *raid5_get_active_stripe(struct r5conf *conf,
 		if (!test_bit(R5_INACTIVE_BLOCKED, &conf->cache_state)) {
 			sh = get_free_stripe(conf, hash);
 			if (sh) {
+				this_cpu_inc(conf->percpu->cache_misses);
 				r5c_check_stripe_cache_usage(conf);
 				init_stripe(sh, sector, previous);
 				atomic_inc(&sh->count);
@@ -851,6 +886,7 @@ struct stripe_head *raid5_get_active_stripe(struct r5conf *conf,
 		if (flags & R5_GAS_NOBLOCK)
 			break;
 
+		this_cpu_inc(conf->percpu->cache_waits);
 		set_bit(R5_INACTIVE_BLOCKED, &conf->cache_state);
 		r5l_wake_reclaim(conf->log, 0);
 
@@ -5708,7 +5744,6 @@ static struct stripe_head *__get_priority_stripe(struct r5conf *conf, int group)
 struct raid5_plug_cb {
 	struct blk_plug_cb	cb;
 	struct list_head	list;
-	struct list_head	temp_inactive_list[NR_STRIPE_HASH_LOCKS];
 };
 
 static void raid5_unplug(struct blk_plug_cb *blk_cb, bool from_schedule)
@@ -5717,12 +5752,15 @@ static void raid5_unplug(struct blk_plug_cb *blk_cb, bool from_schedule)
 		blk_cb, struct raid5_plug_cb, cb);
 	struct stripe_head *sh;
 	struct mddev *mddev = cb->cb.data;
-	struct r5conf *conf = mddev->private;
 	int cnt = 0;
-	int hash;
 
-	if (cb->list.next && !list_empty(&cb->list)) {
-		spin_lock_irq(&conf->device_lock);
+	/*
+	 * Every stripe on the plug list has STRIPE_HANDLE set, so releasing
+	 * it only moves it to the handle list.  Go through the per-CPU
+	 * release lists rather than taking device_lock here, which would
+	 * serialize all submitters against raid5d and the worker groups.
+	 */
+	if (cb->list.next) {
 		while (!list_empty(&cb->list)) {
 			sh = list_first_entry(&cb->list, struct stripe_head, lru);
 			list_del_init(&sh->lru);
@@ -5733,18 +5771,10 @@ static void raid5_unplug(struct blk_plug_cb *blk_cb, bool from_schedule)
 			 */
 			smp_mb__before_atomic();
 			clear_bit(STRIPE_ON_UNPLUG_LIST, &sh->state);
-			/*
-			 * STRIPE_ON_RELEASE_LIST could be set here. In that
-			 * case, the count is always > 1 here
-			 */
-			hash = sh->hash_lock_index;
-			__release_stripe(conf, sh, &cb->temp_inactive_list[hash]);
+			raid5_release_stripe(sh);
 			cnt++;
 		}
-		spin_unlock_irq(&conf->device_lock);
 	}
-	release_inactive_stripe_list(conf, cb->temp_inactive_list,
-				     NR_STRIPE_HASH_LOCKS);
 	if (mddev->queue)
 		trace_block_unplug(mddev->queue, cnt, !from_schedule);
 	kfree(cb);
@@ -5765,12 +5795,8 @@ static void release_stripe_plug(struct mddev *mddev,
 
 	cb = container_of(blk_cb, struct raid5_plug_cb, cb);
 
-	if (cb->list.next == NULL) {
-		int i;
+	if (cb->list.next == NULL)
 		INIT_LIST_HEAD(&cb->list);
-		for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
-			INIT_LIST_HEAD(cb->temp_inactive_list + i);
-	}
 
 	if (!test_and_set_bit(STRIPE_ON_UNPLUG_LIST, &sh->state))
 		list_add_tail(&sh->lru, &cb->list);
@@ -6058,6 +6084,7 @@ static enum stripe_result make_stripe_request(struct mddev *mddev,
 	}
 
 	if (stripe_can_batch(sh)) {
+		this_cpu_inc(conf->percpu->full_stripe_batched);
 		stripe_add_to_batch_list(conf, sh, ctx->batch_last);
 		if (ctx->batch_last)
 			raid5_release_stripe(ctx->batch_last);
@@ -6750,7 +6777,7 @@ static void raid5_do_work(struct work_struct *work)
 
 	blk_start_plug(&plug);
 	handled = 0;
-	spin_lock_irq(&conf->device_lock);
+	lock_device_irq(conf);
 	while (1) {
 		int batch_size, released;
 
@@ -6800,7 +6827,7 @@ static void raid5d(struct md_thread *thread)
 
 	blk_start_plug(&plug);
 	handled = 0;
-	spin_lock_irq(&conf->device_lock);
+	lock_device_irq(conf);
 	while (1) {
 		struct bio *bio;
 		int batch_size, released;
@@ -7190,6 +7217,39 @@ stripe_cache_active_show(struct mddev *mddev, char *page)
 static struct md_sysfs_entry
 raid5_stripecache_active = __ATTR_RO(stripe_cache_active);
 
+static ssize_t
+stripe_cache_stats_show(struct mddev *mddev, char *page)
+{
+	unsigned long hits = 0, misses = 0, waits = 0, batched = 0;
+	unsigned long contended = 0;
+	struct r5conf *conf;
+	int cpu, ret = 0;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf && conf->percpu) {
+		for_each_possible_cpu(cpu) {
+			struct raid5_percpu *percpu =
+				per_cpu_ptr(conf->percpu, cpu);
+
+			hits += READ_ONCE(percpu->cache_hits);
+			misses += READ_ONCE(percpu->cache_misses);
+			waits += READ_ONCE(percpu->cache_waits);
+			batched += READ_ONCE(percpu->full_stripe_batched);
+			contended += READ_ONCE(percpu->device_lock_contended);
+		}
+		ret = sprintf(page,
+			      "hits %lu\nmisses %lu\nwaits %lu\n"
+			      "full_stripe_batched %lu\ndevice_lock_contended %lu\n",
+			      hits, misses, waits, batched, contended);
+	}
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+static struct md_sysfs_entry
+raid5_stripecache_stats = __ATTR_RO(stripe_cache_stats);
+
 static ssize_t
 raid5_show_group_thread_cnt(struct mddev *mddev, char *page)
 {
@@ -7263,6 +7323,7 @@ raid5_group_thread_cnt = __ATTR(group_thread_cnt, S_IRUGO | S_IWUSR,
 static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
+	&raid5_stripecache_stats.attr,
 	&raid5_preread_bypass_threshold.attr,
 	&raid5_group_thread_cnt.attr,
 	&raid5_skip_copy.attr,
@@ -7410,6 +7471,7 @@ static void free_conf(struct r5conf *conf)
 	bioset_exit(&conf->bio_split);
 	kfree(conf->stripe_hashtbl);
 	kfree(conf->pending_data);
+	free_cpumask_var(conf->released_cpus);
 	kfree(conf);
 }
 
@@ -7556,7 +7618,8 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	INIT_LIST_HEAD(&conf->hold_list);
 	INIT_LIST_HEAD(&conf->delayed_list);
 	INIT_LIST_HEAD(&conf->bitmap_list);
-	init_llist_head(&conf->released_stripes);
+	if (!zalloc_cpumask_var(&conf->released_cpus, GFP_KERNEL))
+		goto abort;
 	atomic_set(&conf->active_stripes, 0);
 	atomic_set(&conf->preread_active_stripes, 0);
 	atomic_set(&conf->active_aligned_reads, 0);
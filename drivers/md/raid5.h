@@ -569,6 +569,16 @@ struct raid5_percpu {
 				     */
 	int             scribble_obj_size;
 	local_lock_t    lock;
+
+	/* stripes dropped by raid5_release_stripe(), drained by raid5d */
+	struct llist_head	released_stripes;
+
+	/* stripe cache statistics, see stripe_cache_stats_show() */
+	unsigned long	cache_hits;
+	unsigned long	cache_misses;
+	unsigned long	cache_waits;
+	unsigned long	full_stripe_batched;
+	unsigned long	device_lock_contended;
 };
 
 struct r5conf {
@@ -665,7 +675,8 @@ struct r5conf {
 	atomic_t		r5c_flushing_partial_stripes;
 
 	atomic_t		empty_inactive_list_nr;
-	struct llist_head	released_stripes;
+	/* CPUs whose percpu released_stripes list may be non-empty */
+	cpumask_var_t		released_cpus;
 	wait_queue_head_t	wait_for_quiescent;
 	wait_queue_head_t	wait_for_stripe;
 	wait_queue_head_t	wait_for_overlap;
@@ -10,6 +10,7 @@
 #include <linux/blk-mq.h>
 #include <linux/blk-mq-pci.h>
 #include <linux/blk-integrity.h>
+#include <linux/dim.h>
 #include <linux/dmi.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
@@ -105,6 +106,11 @@ static bool noacpi;
 module_param(noacpi, bool, 0444);
 MODULE_PARM_DESC(noacpi, "disable acpi bios quirks");
 
+static bool irq_dim;
+module_param(irq_dim, bool, 0644);
+MODULE_PARM_DESC(irq_dim,
+	"adapt interrupt coalescing to the completion rate of each queue");
+
 struct nvme_dev;
 struct nvme_queue;
 
@@ -159,6 +165,11 @@ struct nvme_dev {
 	unsigned int nr_allocated_queues;
 	unsigned int nr_write_queues;
 	unsigned int nr_poll_queues;
+
+	/* adaptive interrupt coalescing: */
+	bool irq_dim;
+	u8 irq_coalesce_level;
+	struct mutex dim_lock;
 };
 
 static int io_queue_depth_set(const char *val, const struct kernel_param *kp)
@@ -209,11 +220,15 @@ struct nvme_queue {
 #define NVMEQ_SQ_CMB		1
 #define NVMEQ_DELETE_ERROR	2
 #define NVMEQ_POLLED		3
+#define NVMEQ_DIM		4
 	__le32 *dbbuf_sq_db;
 	__le32 *dbbuf_cq_db;
 	__le32 *dbbuf_sq_ei;
 	__le32 *dbbuf_cq_ei;
 	struct completion delete_done;
+	struct dim dim;
+	u8 dim_level;
+	bool irq_cd;
 };
 
 union nvme_descriptor {
@@ -1080,10 +1095,14 @@ static irqreturn_t nvme_irq(int irq, void *data)
 {
 	struct nvme_queue *nvmeq = data;
 	DEFINE_IO_COMP_BATCH(iob);
+	int found;
 
-	if (nvme_poll_cq(nvmeq, &iob)) {
+	found = nvme_poll_cq(nvmeq, &iob);
+	if (found) {
 		if (!rq_list_empty(iob.req_list))
 			nvme_pci_complete_batch(&iob);
+		if (test_bit(NVMEQ_DIM, &nvmeq->flags))
+			rdma_dim(&nvmeq->dim, found);
 		return IRQ_HANDLED;
 	}
 	return IRQ_NONE;
@@ -1405,6 +1424,7 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req)
 
 static void nvme_free_queue(struct nvme_queue *nvmeq)
 {
+	cancel_work_sync(&nvmeq->dim.work);
 	dma_free_coherent(nvmeq->dev->dev, CQ_SIZE(nvmeq),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
 	if (!nvmeq->sq_cmds)
@@ -1440,6 +1460,7 @@ static void nvme_suspend_queue(struct nvme_dev *dev, unsigned int qid)
 	mb();
 
 	nvmeq->dev->online_queues--;
+	clear_bit(NVMEQ_DIM, &nvmeq->flags);
 	if (!nvmeq->qid && nvmeq->dev->ctrl.admin_q)
 		nvme_quiesce_admin_queue(&nvmeq->dev->ctrl);
 	if (!test_and_clear_bit(NVMEQ_POLLED, &nvmeq->flags))
@@ -1522,6 +1543,110 @@ static int nvme_alloc_sq_cmds(struct nvme_dev *dev, struct nvme_queue *nvmeq,
 	return 0;
 }
 
+/*
+ * Interrupt coalescing profiles indexed by the DIM level: aggregation
+ * threshold in completions and aggregation time in 100us units.  Level 0
+ * leaves coalescing off so that lightly loaded queues keep their latency.
+ */
+static const struct {
+	u8 thr;
+	u8 time;
+} nvme_dim_profiles[RDMA_DIM_PARAMS_NUM_PROFILES] = {
+	{   0, 0 },
+	{   2, 1 },
+	{   4, 1 },
+	{   8, 1 },
+	{  16, 1 },
+	{  32, 1 },
+	{  32, 2 },
+	{  64, 2 },
+	{ 128, 2 },
+};
+
+static int nvme_dim_set_cd(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+		bool cd)
+{
+	int ret;
+
+	if (nvmeq->irq_cd == cd)
+		return 0;
+	ret = nvme_set_features(&dev->ctrl, NVME_FEAT_IRQ_CONFIG,
+			nvmeq->cq_vector | (cd << 16), NULL, 0, NULL);
+	if (!ret)
+		nvmeq->irq_cd = cd;
+	return ret;
+}
+
+/*
+ * The aggregation threshold and time are controller wide, so program them
+ * for the busiest interrupt driven queue and use the per-vector Coalescing
+ * Disable bit to exempt queues that DIM still considers idle.
+ */
+static int nvme_dim_apply(struct nvme_dev *dev)
+{
+	u8 level = 0;
+	int i, ret;
+
+	lockdep_assert_held(&dev->dim_lock);
+
+	for (i = 1; i < dev->ctrl.queue_count; i++) {
+		struct nvme_queue *nvmeq = &dev->queues[i];
+
+		if (test_bit(NVMEQ_DIM, &nvmeq->flags))
+			level = max(level, nvmeq->dim_level);
+	}
+
+	if (level != dev->irq_coalesce_level) {
+		ret = nvme_set_features(&dev->ctrl, NVME_FEAT_IRQ_COALESCE,
+				level ? nvme_dim_profiles[level].time << 8 |
+					(nvme_dim_profiles[level].thr - 1) : 0,
+				NULL, 0, NULL);
+		if (ret)
+			return ret;
+		dev->irq_coalesce_level = level;
+	}
+
+	/* with a single vector all queues share the admin queue's vector */
+	if (!level || dev->num_vecs == 1)
+		return 0;
+
+	for (i = 1; i < dev->ctrl.queue_count; i++) {
+		struct nvme_queue *nvmeq = &dev->queues[i];
+
+		if (!test_bit(NVMEQ_DIM, &nvmeq->flags))
+			continue;
+		ret = nvme_dim_set_cd(dev, nvmeq, !nvmeq->dim_level);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void nvme_dim_work(struct work_struct *work)
+{
+	struct dim *dim = container_of(work, struct dim, work);
+	struct nvme_queue *nvmeq = container_of(dim, struct nvme_queue, dim);
+	struct nvme_dev *dev = nvmeq->dev;
+	int ret;
+
+	mutex_lock(&dev->dim_lock);
+	nvmeq->dim_level = dim->profile_ix;
+	if (!dev->irq_dim || !test_bit(NVMEQ_DIM, &nvmeq->flags) ||
+	    nvme_ctrl_state(&dev->ctrl) != NVME_CTRL_LIVE)
+		goto out_unlock;
+
+	ret = nvme_dim_apply(dev);
+	if (ret > 0) {
+		dev_warn(dev->ctrl.device,
+			"interrupt coalescing not supported (%#x), disabling irq_dim\n",
+			ret);
+		dev->irq_dim = false;
+	}
+out_unlock:
+	mutex_unlock(&dev->dim_lock);
+	dim->state = DIM_START_MEASURE;
+}
+
 static int nvme_alloc_queue(struct nvme_dev *dev, int qid, int depth)
 {
 	struct nvme_queue *nvmeq = &dev->queues[qid];
@@ -1542,6 +1667,7 @@ static int nvme_alloc_queue(struct nvme_dev *dev, int qid, int depth)
 	nvmeq->dev = dev;
 	spin_lock_init(&nvmeq->sq_lock);
 	spin_lock_init(&nvmeq->cq_poll_lock);
+	INIT_WORK(&nvmeq->dim.work, nvme_dim_work);
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
@@ -1637,11 +1763,23 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid, bool polled)
 
 	nvmeq->cq_vector = vector;
 
+	/* a freshly enabled controller starts with coalescing disabled */
+	mutex_lock(&dev->dim_lock);
+	nvmeq->dim_level = 0;
+	nvmeq->irq_cd = false;
+	mutex_unlock(&dev->dim_lock);
+
 	result = nvme_setup_io_queues_trylock(dev);
 	if (result)
 		return result;
 	nvme_init_queue(nvmeq, qid);
 	if (!polled) {
+		if (dev->irq_dim) {
+			nvmeq->dim.state = DIM_START_MEASURE;
+			nvmeq->dim.tune_state = DIM_GOING_RIGHT;
+			nvmeq->dim.profile_ix = RDMA_DIM_START_PROFILE;
+			set_bit(NVMEQ_DIM, &nvmeq->flags);
+		}
 		result = queue_request_irq(nvmeq);
 		if (result < 0)
 			goto release_sq;
@@ -2278,6 +2416,11 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	dev->nr_write_queues = write_queues;
 	dev->nr_poll_queues = poll_queues;
 
+	mutex_lock(&dev->dim_lock);
+	dev->irq_dim = irq_dim;
+	dev->irq_coalesce_level = 0;
+	mutex_unlock(&dev->dim_lock);
+
 	nr_io_queues = dev->nr_allocated_queues - 1;
 	result = nvme_set_queue_count(&dev->ctrl, &nr_io_queues);
 	if (result < 0)
@@ -2945,6 +3088,7 @@ static struct nvme_dev *nvme_pci_alloc_dev(struct pci_dev *pdev,
 		return ERR_PTR(-ENOMEM);
 	INIT_WORK(&dev->ctrl.reset_work, nvme_reset_work);
 	mutex_init(&dev->shutdown_lock);
+	mutex_init(&dev->dim_lock);
 
 	dev->nr_write_queues = write_queues;
 	dev->nr_poll_queues = poll_queues;
@@ -8,6 +8,7 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/err.h>
+#include <linux/crc32c.h>
 #include <linux/nvme-tcp.h>
 #include <net/sock.h>
 #include <net/tcp.h>
@@ -21,6 +22,9 @@
 
 struct nvme_tcp_queue;
 
+/* most command PDUs sent at once, see nvme_tcp_try_send_cmd_batch() */
+#define NVME_TCP_CMD_BATCH	16
+
 /* Define the socket priority to use for connections were it is desirable
  * that the NIC consider performing optimized packet processing or filtering.
  * A non-zero value being sufficient to indicate general consideration of any
@@ -144,6 +148,8 @@ struct nvme_tcp_queue {
 	bool			data_digest;
 	struct ahash_request	*rcv_hash;
 	struct ahash_request	*snd_hash;
+	u32			rcv_crc;	/* data digests in progress */
+	u32			snd_crc;
 	__le32			exp_ddgst;
 	__le32			recv_ddgst;
 
@@ -388,22 +394,67 @@ nvme_tcp_fetch_request(struct nvme_tcp_queue *queue)
 	return req;
 }
 
-static inline void nvme_tcp_ddgst_final(struct ahash_request *hash,
-		__le32 *dgst)
+/*
+ * Data digests are computed with the crc32c library rather than the ahash
+ * used for header digests: the payload is walked in chunks no larger than
+ * a page, and the per-call setup of an ahash request would cost more than
+ * the CRC itself.
+ */
+#define NVME_TCP_DDGST_INIT	(~0U)
+
+static inline __le32 nvme_tcp_ddgst_final(u32 crc)
 {
-	ahash_request_set_crypt(hash, NULL, (u8 *)dgst, 0);
-	crypto_ahash_final(hash);
+	return cpu_to_le32(~crc);
 }
 
-static inline void nvme_tcp_ddgst_update(struct ahash_request *hash,
-		struct page *page, off_t off, size_t len)
+static u32 nvme_tcp_ddgst_update(u32 crc, struct page *page, size_t off,
+		size_t len)
 {
-	struct scatterlist sg;
+	page += off / PAGE_SIZE;
+	off = offset_in_page(off);
+
+	while (len) {
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+		void *vaddr = kmap_local_page(page);
 
-	sg_init_table(&sg, 1);
-	sg_set_page(&sg, page, len, off);
-	ahash_request_set_crypt(hash, &sg, NULL, len);
-	crypto_ahash_update(hash);
+		crc = crc32c(crc, vaddr + off, n);
+		kunmap_local(vaddr);
+
+		page++;
+		off = 0;
+		len -= n;
+	}
+	return crc;
+}
+
+/*
+ * Copy @len bytes of payload to the request iterator, folding each chunk
+ * into the data digest right after copying it, while it is still hot.
+ */
+static int nvme_tcp_copy_ddgst(struct nvme_tcp_queue *queue,
+		struct sk_buff *skb, unsigned int offset, struct iov_iter *iter,
+		size_t len)
+{
+	while (len) {
+		const struct bio_vec *bv = iter->bvec;
+		size_t off = bv->bv_offset + iter->iov_offset;
+		struct page *page = bv->bv_page + off / PAGE_SIZE;
+		size_t n;
+		int ret;
+
+		off = offset_in_page(off);
+		n = min3(len, bv->bv_len - iter->iov_offset, PAGE_SIZE - off);
+
+		ret = skb_copy_datagram_iter(skb, offset, iter, n);
+		if (ret)
+			return ret;
+		queue->rcv_crc = nvme_tcp_ddgst_update(queue->rcv_crc, page,
+						       off, n);
+
+		offset += n;
+		len -= n;
+	}
+	return 0;
 }
 
 static inline void nvme_tcp_hdgst(struct ahash_request *hash,
@@ -458,7 +509,7 @@ static int nvme_tcp_check_ddgst(struct nvme_tcp_queue *queue, void *pdu)
 		nvme_tcp_queue_id(queue));
 		return -EPROTO;
 	}
-	crypto_ahash_init(queue->rcv_hash);
+	queue->rcv_crc = NVME_TCP_DDGST_INIT;
 
 	return 0;
 }
@@ -802,8 +853,8 @@ static int nvme_tcp_recv_data(struct nvme_tcp_queue *queue, struct sk_buff *skb,
 				iov_iter_count(&req->iter));
 
 		if (queue->data_digest)
-			ret = skb_copy_and_hash_datagram_iter(skb, *offset,
-				&req->iter, recv_len, queue->rcv_hash);
+			ret = nvme_tcp_copy_ddgst(queue, skb, *offset,
+				&req->iter, recv_len);
 		else
 			ret = skb_copy_datagram_iter(skb, *offset,
 					&req->iter, recv_len);
@@ -821,7 +872,7 @@ static int nvme_tcp_recv_data(struct nvme_tcp_queue *queue, struct sk_buff *skb,
 
 	if (!queue->data_remaining) {
 		if (queue->data_digest) {
-			nvme_tcp_ddgst_final(queue->rcv_hash, &queue->exp_ddgst);
+			queue->exp_ddgst = nvme_tcp_ddgst_final(queue->rcv_crc);
 			queue->ddgst_remaining = NVME_TCP_DIGEST_LENGTH;
 		} else {
 			if (pdu->hdr.flags & NVME_TCP_F_DATA_SUCCESS) {
@@ -1023,8 +1074,8 @@ static int nvme_tcp_try_send_data(struct nvme_tcp_request *req)
 			return ret;
 
 		if (queue->data_digest)
-			nvme_tcp_ddgst_update(queue->snd_hash, page,
-					offset, ret);
+			queue->snd_crc = nvme_tcp_ddgst_update(queue->snd_crc,
+					page, offset, ret);
 
 		/*
 		 * update the request iterator except for the last payload send
@@ -1037,8 +1088,7 @@ static int nvme_tcp_try_send_data(struct nvme_tcp_request *req)
 		/* fully successful last send in current PDU */
 		if (last && ret == len) {
 			if (queue->data_digest) {
-				nvme_tcp_ddgst_final(queue->snd_hash,
-					&req->ddgst);
+				req->ddgst = nvme_tcp_ddgst_final(queue->snd_crc);
 				req->state = NVME_TCP_SEND_DDGST;
 				req->offset = 0;
 			} else {
@@ -1083,7 +1133,7 @@ static int nvme_tcp_try_send_cmd_pdu(struct nvme_tcp_request *req)
 		if (inline_data) {
 			req->state = NVME_TCP_SEND_DATA;
 			if (queue->data_digest)
-				crypto_ahash_init(queue->snd_hash);
+				queue->snd_crc = NVME_TCP_DDGST_INIT;
 		} else {
 			nvme_tcp_done_send_req(queue);
 		}
@@ -1094,6 +1144,69 @@ static int nvme_tcp_try_send_cmd_pdu(struct nvme_tcp_request *req)
 	return -EAGAIN;
 }
 
+/*
+ * Send the command PDU of queue->request together with those of the
+ * requests queued behind it, as long as none of them carries inline data,
+ * in a single sendmsg.  The batched requests are taken off the send_list
+ * before sending: once its command is out, a request may complete and be
+ * reused at any time.  A partially sent command becomes queue->request and
+ * is finished by nvme_tcp_try_send_cmd_pdu(), the unsent ones go back.
+ */
+static int nvme_tcp_try_send_cmd_batch(struct nvme_tcp_queue *queue)
+{
+	struct nvme_tcp_request *reqs[NVME_TCP_CMD_BATCH], *req, *tmp;
+	struct bio_vec bvec[NVME_TCP_CMD_BATCH];
+	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_SPLICE_PAGES, };
+	size_t pdu_len = sizeof(struct nvme_tcp_cmd_pdu) +
+			 nvme_tcp_hdgst_len(queue);
+	int nr = 1, i, ret;
+
+	reqs[0] = queue->request;
+	list_for_each_entry_safe(req, tmp, &queue->send_list, entry) {
+		if (nr == NVME_TCP_CMD_BATCH ||
+		    req->state != NVME_TCP_SEND_CMD_PDU ||
+		    nvme_tcp_has_inline_data(req))
+			break;
+		list_del(&req->entry);
+		reqs[nr++] = req;
+	}
+
+	if (nr == 1)
+		return nvme_tcp_try_send_cmd_pdu(reqs[0]);
+
+	for (i = 0; i < nr; i++) {
+		struct nvme_tcp_cmd_pdu *pdu = nvme_tcp_req_cmd_pdu(reqs[i]);
+
+		if (queue->hdr_digest)
+			nvme_tcp_hdgst(queue->snd_hash, pdu, sizeof(*pdu));
+		bvec_set_virt(&bvec[i], pdu, pdu_len);
+	}
+
+	if (nvme_tcp_queue_more(queue))
+		msg.msg_flags |= MSG_MORE;
+	else
+		msg.msg_flags |= MSG_EOR;
+
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, bvec, nr, nr * pdu_len);
+	ret = sock_sendmsg(queue->sock, &msg);
+	i = ret > 0 ? ret / pdu_len : 0;
+
+	if (i == nr) {
+		nvme_tcp_done_send_req(queue);
+		return 1;
+	}
+
+	/* put back what wasn't sent, in order */
+	while (nr-- > i + 1)
+		list_add(&reqs[nr]->entry, &queue->send_list);
+	if (ret <= 0)
+		return ret;
+
+	queue->request = reqs[i];
+	reqs[i]->offset = ret % pdu_len;
+	return -EAGAIN;
+}
+
 static int nvme_tcp_try_send_data_pdu(struct nvme_tcp_request *req)
 {
 	struct nvme_tcp_queue *queue = req->queue;
@@ -1120,7 +1233,7 @@ static int nvme_tcp_try_send_data_pdu(struct nvme_tcp_request *req)
 	if (!len) {
 		req->state = NVME_TCP_SEND_DATA;
 		if (queue->data_digest)
-			crypto_ahash_init(queue->snd_hash);
+			queue->snd_crc = NVME_TCP_DDGST_INIT;
 		return 1;
 	}
 	req->offset += ret;
@@ -1175,6 +1288,14 @@ static int nvme_tcp_try_send(struct nvme_tcp_queue *queue)
 	req = queue->request;
 
 	noreclaim_flag = memalloc_noreclaim_save();
+	if (req->state == NVME_TCP_SEND_CMD_PDU && !req->offset &&
+	    !nvme_tcp_has_inline_data(req)) {
+		ret = nvme_tcp_try_send_cmd_batch(queue);
+		if (ret <= 0)
+			goto done;
+		goto out;
+	}
+
 	if (req->state == NVME_TCP_SEND_CMD_PDU) {
 		ret = nvme_tcp_try_send_cmd_pdu(req);
 		if (ret <= 0)
@@ -21,8 +21,8 @@ void nvmet_file_ns_revalidate(struct nvmet_ns *ns)
 void nvmet_file_ns_disable(struct nvmet_ns *ns)
 {
 	if (ns->file) {
-		if (ns->buffered_io)
-			flush_workqueue(buffered_io_wq);
+		/* direct IO that would have blocked ends up there too */
+		flush_workqueue(buffered_io_wq);
 		mempool_destroy(ns->bvec_pool);
 		ns->bvec_pool = NULL;
 		fput(ns->file);
@@ -100,11 +100,23 @@ static ssize_t nvmet_file_submit_bvec(struct nvmet_req *req, loff_t pos,
 	return call_iter(iocb, &iter);
 }
 
+static void nvmet_file_submit_buffered_io(struct nvmet_req *req);
+
 static void nvmet_file_io_done(struct kiocb *iocb, long ret)
 {
 	struct nvmet_req *req = container_of(iocb, struct nvmet_req, f.iocb);
 	u16 status = NVME_SC_SUCCESS;
 
+	/*
+	 * Direct IO submitted with IOCB_NOWAIT may still fail with -EAGAIN
+	 * after part of it was issued, reissue it from a context that may
+	 * block.
+	 */
+	if (unlikely(ret == -EAGAIN && (iocb->ki_flags & IOCB_NOWAIT))) {
+		nvmet_file_submit_buffered_io(req);
+		return;
+	}
+
 	if (req->f.bvec != req->inline_bvec) {
 		if (likely(req->f.mpool_alloc == false))
 			kfree(req->f.bvec);
@@ -172,9 +184,10 @@ static bool nvmet_file_execute_io(struct nvmet_req *req, int ki_flags)
 
 	/*
 	 * A NULL ki_complete ask for synchronous execution, which we want
-	 * for the IOCB_NOWAIT case.
+	 * for the buffered IOCB_NOWAIT case: that one either finds everything
+	 * in the page cache or gives up.  Direct IO stays asynchronous.
 	 */
-	if (!(ki_flags & IOCB_NOWAIT))
+	if (!(ki_flags & IOCB_NOWAIT) || !req->ns->buffered_io)
 		req->f.iocb.ki_complete = nvmet_file_io_done;
 
 	ret = nvmet_file_submit_bvec(req, pos, bv_cnt, total_len, ki_flags);
@@ -240,14 +253,20 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 	} else
 		req->f.mpool_alloc = false;
 
-	if (req->ns->buffered_io) {
-		if (likely(!req->f.mpool_alloc) &&
-		    (req->ns->file->f_mode & FMODE_NOWAIT) &&
-		    nvmet_file_execute_io(req, IOCB_NOWAIT))
-			return;
+	/*
+	 * Try to issue the IO without blocking the transport, e.g. on page
+	 * cache misses or on the file system allocating blocks, and leave it
+	 * to a worker if that's not possible.
+	 */
+	if (likely(!req->f.mpool_alloc) &&
+	    (req->ns->file->f_mode & FMODE_NOWAIT)) {
+		if (!nvmet_file_execute_io(req, IOCB_NOWAIT))
+			nvmet_file_submit_buffered_io(req);
+	} else if (req->ns->buffered_io) {
 		nvmet_file_submit_buffered_io(req);
-	} else
+	} else {
 		nvmet_file_execute_io(req, 0);
+	}
 }
 
 u16 nvmet_file_flush(struct nvmet_req *req)
@@ -60,6 +60,8 @@ typedef __u32 __bitwise req_flags_t;
 /* ->timeout has been called, don't expire again */
 #define RQF_TIMED_OUT		((__force req_flags_t)(1 << 21))
 #define RQF_RESV		((__force req_flags_t)(1 << 23))
+/* charged by blk-iocost as random IO */
+#define RQF_IOCOST_RANDIO	((__force req_flags_t)(1 << 24))
 
 /* flags that prevent us from merging requests: */
 #define RQF_NOMERGE_FLAGS \
@@ -396,6 +398,18 @@ struct blk_mq_hw_ctx {
 	/** @run: Number of dispatched requests. */
 	unsigned long		run;
 
+	/**
+	 * @tag_stats: Slow path events of tag allocations on this hardware
+	 * queue, see blk_mq_get_tag().
+	 */
+	struct {
+		unsigned long	nowait_fails;	/* REQ_NOWAIT allocation failed */
+		unsigned long	retries;	/* retried after running queue */
+		unsigned long	sleeps;		/* had to sleep for a tag */
+		unsigned long	wake_hits;	/* got a tag once woken up */
+		unsigned long	wake_misses;	/* woken up only to sleep again */
+	} tag_stats;
+
 	/** @numa_node: NUMA node the storage adapter has been connected to. */
 	unsigned int		numa_node;
 	/** @queue_num: Index of this hardware queue. */
@@ -346,6 +346,7 @@ enum {
 	BIO_QOS_MERGED,		/* but went through rq_qos merge path */
 	BIO_REMAPPED,
 	BIO_ZONE_WRITE_LOCKED,	/* Owns a zoned device zone write lock */
+	BIO_IOCOST_RANDIO,	/* charged by blk-iocost as random IO */
 	BIO_FLAG_LAST
 };
 
@@ -522,6 +522,8 @@ struct bpf_insn_aux_data {
 	 * accepts callback function as a parameter.
 	 */
 	bool calls_callback;
+	/* number of states saved at this instruction for pruning */
+	u32 states_cnt;
 };
 
 #define MAX_USED_MAPS 64 /* max number of maps accessed by one eBPF program */
@@ -659,6 +661,11 @@ struct bpf_verifier_env {
 	u32 peak_states;
 	/* longest register parentage chain walked for liveness marking */
 	u32 longest_mark_read_walk;
+	/* number of times an explored state pruned the current one, and
+	 * number of explored states that failed to do so
+	 */
+	u32 prune_hits;
+	u32 prune_misses;
 	bpfptr_t fd_array;
 
 	/* bit mask to keep track of whether a register has been accessed
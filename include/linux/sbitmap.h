@@ -38,6 +38,21 @@ struct sbitmap_word {
 	unsigned long cleared ____cacheline_aligned_in_smp;
 } ____cacheline_aligned_in_smp;
 
+/**
+ * struct sbitmap_cluster - Part of a &struct sbitmap owned by a CPU cluster.
+ */
+struct sbitmap_cluster {
+	/**
+	 * @start: First bit of the cluster's words.
+	 */
+	unsigned int start;
+
+	/**
+	 * @end: Bit past the cluster's last word.
+	 */
+	unsigned int end;
+};
+
 /**
  * struct sbitmap - Scalable bitmap.
  *
@@ -65,6 +80,13 @@ struct sbitmap {
 	 */
 	bool round_robin;
 
+	/**
+	 * @cluster: Per-cpu range of bits owned by the CPU's cluster, which
+	 * its allocation hint stays within. NULL unless set up by
+	 * sbitmap_spread_alloc_hints().
+	 */
+	struct sbitmap_cluster __percpu *cluster;
+
 	/**
 	 * @map: Allocated bitmap.
 	 */
@@ -165,6 +187,19 @@ struct sbitmap_queue {
 int sbitmap_init_node(struct sbitmap *sb, unsigned int depth, int shift,
 		      gfp_t flags, int node, bool round_robin, bool alloc_hint);
 
+/**
+ * sbitmap_spread_alloc_hints() - Partition the per-cpu allocation hints of a
+ * &struct sbitmap by CPU cluster.
+ * @sb: Bitmap to partition. Must have been initialized with @alloc_hint.
+ *
+ * Meant for bitmaps allocated from by many CPUs, such as tags shared by all
+ * hardware queues of a host: each cluster of CPUs gets its own range of
+ * words that its allocation hints wrap around in, so clusters only contend
+ * on the same cachelines once their range runs dry. Best effort: the map is
+ * left as it is if the ranges can't be allocated.
+ */
+void sbitmap_spread_alloc_hints(struct sbitmap *sb);
+
 /* sbitmap internal helper */
 static inline unsigned int __map_depth(const struct sbitmap *sb, int index)
 {
@@ -179,6 +214,8 @@ static inline unsigned int __map_depth(const struct sbitmap *sb, int index)
  */
 static inline void sbitmap_free(struct sbitmap *sb)
 {
+	free_percpu(sb->cluster);
+	sb->cluster = NULL;
 	free_percpu(sb->alloc_hint);
 	kvfree(sb->map);
 	sb->map = NULL;
@@ -1272,8 +1272,8 @@ enum {
 /* Instead of having one common LRU list in the
  * BPF_MAP_TYPE_LRU_[PERCPU_]HASH map, use a percpu LRU list
  * which can scale and perform better.
- * Note, the LRU nodes (including free nodes) cannot be moved
- * across different LRU lists.
+ * Note, a CPU only takes LRU nodes from the other CPUs' lists
+ * once its own list has no free or evictable nodes left.
  */
 	BPF_F_NO_COMMON_LRU	= (1U << 1),
 /* Specify numa node during map creation */
@@ -1312,6 +1312,11 @@ enum {
 	BPF_F_PATH_FD		= (1U << 14),
 };
 
+/* map_extra flags for BPF_MAP_TYPE_BLOOM_FILTER */
+enum {
+	BPF_BLOOM_BLOCKED	= (1U << 4),
+};
+
 /* Flags for BPF_PROG_QUERY. */
 
 /* Query effective (directly attached + inherited from ancestor cgroups)
@@ -1380,7 +1385,8 @@ union bpf_attr {
 		 *
 		 * BPF_MAP_TYPE_BLOOM_FILTER - the lowest 4 bits indicate the
 		 * number of hash functions (if 0, the bloom filter will default
-		 * to using 5 hash functions).
+		 * to using 5 hash functions). Setting BPF_BLOOM_BLOCKED keeps
+		 * all the bits of a value within one cache line.
 		 */
 		__u64	map_extra;
 	};
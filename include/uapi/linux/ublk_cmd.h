@@ -75,6 +75,17 @@
  *
  *      It is only used if ublksrv set UBLK_F_NEED_GET_DATA flag
  *      while starting a ublk device.
+ *
+ * FETCH_REQS: only used with UBLK_F_BATCH_IO, issued once per queue for
+ *      fetching a batch of IO requests. ublksrv_io_cmd->tag is the capacity
+ *      of the __u16 tag array pointed to by ublksrv_io_cmd->addr; the cqe
+ *      is posted with the number of tags stored in the array, and the
+ *      command has to be issued again for fetching more requests.
+ *
+ * COMMIT_REQS: only used with UBLK_F_BATCH_IO, commits the results of
+ *      ublksrv_io_cmd->tag requests described by the array of
+ *      struct ublk_batch_commit pointed to by ublksrv_io_cmd->addr. The
+ *      cqe is posted with the number of committed requests.
  */
 
 /*
@@ -92,6 +103,10 @@
 	_IOWR('u', UBLK_IO_COMMIT_AND_FETCH_REQ, struct ublksrv_io_cmd)
 #define	UBLK_U_IO_NEED_GET_DATA		\
 	_IOWR('u', UBLK_IO_NEED_GET_DATA, struct ublksrv_io_cmd)
+#define	UBLK_U_IO_FETCH_REQS		\
+	_IOWR('u', 0x23, struct ublksrv_io_cmd)
+#define	UBLK_U_IO_COMMIT_REQS		\
+	_IOWR('u', 0x24, struct ublksrv_io_cmd)
 
 /* only ABORT means that no re-fetch */
 #define UBLK_IO_RES_OK			0
@@ -125,8 +140,19 @@
 #define UBLKSRV_IO_BUF_TOTAL_SIZE	(1ULL << UBLKSRV_IO_BUF_TOTAL_BITS)
 
 /*
- * zero copy requires 4k block size, and can remap ublk driver's io
- * request into ublksrv's vm space
+ * Zero copy, only supported together with UBLK_F_USER_COPY.
+ *
+ * splice() from /dev/ublkcN at the position of a WRITE request lends
+ * the request's pages to a pipe, which can then be spliced into the
+ * backing file or socket without copying the data. splice() from a
+ * pipe into /dev/ublkcN at the position of a READ request fills the
+ * request's pages straight from the pipe.
+ *
+ * Each pipe buffer holds a request reference, so the io can't complete
+ * while the pages are still in a pipe. Once spliced into a socket, the
+ * network stack may still reference the pages after that, so the io
+ * should only be committed after the remote side has acknowledged the
+ * data.
  */
 #define UBLK_F_SUPPORT_ZERO_COPY	(1ULL << 0)
 
@@ -182,6 +208,13 @@
  */
 #define UBLK_F_ZONED (1ULL << 8)
 
+/*
+ * Fetch and commit IO requests in batches via UBLK_U_IO_FETCH_REQS and
+ * UBLK_U_IO_COMMIT_REQS instead of one uring_cmd per tag. Only supported
+ * together with UBLK_F_USER_COPY, and not with user recovery.
+ */
+#define UBLK_F_BATCH_IO (1ULL << 9)
+
 /* device state */
 #define UBLK_S_DEV_DEAD	0
 #define UBLK_S_DEV_LIVE	1
@@ -328,6 +361,14 @@ struct ublksrv_io_cmd {
 	};
 };
 
+/* element of the array passed by UBLK_U_IO_COMMIT_REQS */
+struct ublk_batch_commit {
+	__u16	tag;
+	__u16	reserved;
+	__s32	result;
+	__u64	zone_append_lba;
+};
+
 struct ublk_param_basic {
 #define UBLK_ATTR_READ_ONLY            (1 << 0)
 #define UBLK_ATTR_ROTATIONAL           (1 << 1)
@@ -4,20 +4,36 @@
 #include <linux/bitmap.h>
 #include <linux/bpf.h>
 #include <linux/btf.h>
+#include <linux/cache.h>
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/random.h>
+#include <linux/xxhash.h>
 #include <linux/btf_ids.h>
 
 #define BLOOM_CREATE_FLAG_MASK \
 	(BPF_F_NUMA_NODE | BPF_F_ZERO_SEED | BPF_F_ACCESS_MASK)
 
+/* The lower 4 bits of map_extra specify the number of hash functions,
+ * BPF_BLOOM_BLOCKED selects the cache-blocked layout.
+ */
+#define BLOOM_MAP_EXTRA_MASK	(0xFULL | BPF_BLOOM_BLOCKED)
+
+/* In the blocked layout, all the bits of a value live in one block the
+ * size of a cache line, so a lookup touches a single cache line.
+ */
+#define BLOOM_BLOCK_BITS	(L1_CACHE_BYTES * BITS_PER_BYTE)
+#define BLOOM_BLOCK_SHIFT	ilog2(BLOOM_BLOCK_BITS)
+
 struct bpf_bloom_filter {
 	struct bpf_map map;
 	u32 bitset_mask;
 	u32 hash_seed;
 	u32 nr_hash_funcs;
-	unsigned long bitset[];
+	bool blocked;
+	unsigned long bitset[] ____cacheline_aligned;
 };
 
 static u32 hash(struct bpf_bloom_filter *bloom, void *value,
@@ -33,12 +49,60 @@ static u32 hash(struct bpf_bloom_filter *bloom, void *value,
 	return h & bloom->bitset_mask;
 }
 
+/* The blocked layout derives all of its bit positions from one 64-bit
+ * hash: the upper half selects the block and the lower half seeds a
+ * multiplicative sequence whose top bits index into that block.
+ */
+static u32 blocked_hash(struct bpf_bloom_filter *bloom, void *value,
+			u32 value_size, u32 *probe)
+{
+	u64 h = xxh64(value, value_size, bloom->hash_seed);
+
+	*probe = (u32)h;
+	return ((u32)(h >> 32) << BLOOM_BLOCK_SHIFT) & bloom->bitset_mask;
+}
+
+static u32 blocked_next_bit(u32 *probe)
+{
+	u32 bit = *probe >> (32 - BLOOM_BLOCK_SHIFT);
+
+	*probe *= GOLDEN_RATIO_32;
+	return bit;
+}
+
+static long bloom_map_peek_elem_blocked(struct bpf_bloom_filter *bloom,
+					void *value)
+{
+	u32 i, block, probe;
+
+	block = blocked_hash(bloom, value, bloom->map.value_size, &probe);
+	for (i = 0; i < bloom->nr_hash_funcs; i++) {
+		if (!test_bit(block + blocked_next_bit(&probe), bloom->bitset))
+			return -ENOENT;
+	}
+
+	return 0;
+}
+
+static void bloom_map_push_elem_blocked(struct bpf_bloom_filter *bloom,
+					void *value)
+{
+	u32 i, block, probe;
+
+	block = blocked_hash(bloom, value, bloom->map.value_size, &probe);
+	for (i = 0; i < bloom->nr_hash_funcs; i++)
+		set_bit(block + blocked_next_bit(&probe), bloom->bitset);
+}
+
 static long bloom_map_peek_elem(struct bpf_map *map, void *value)
 {
 	struct bpf_bloom_filter *bloom =
 		container_of(map, struct bpf_bloom_filter, map);
 	u32 i, h;
 
+	if (bloom->blocked)
+		return bloom_map_peek_elem_blocked(bloom, value);
+
 	for (i = 0; i < bloom->nr_hash_funcs; i++) {
 		h = hash(bloom, value, map->value_size, i);
 		if (!test_bit(h, bloom->bitset))
@@ -57,6 +121,11 @@ static long bloom_map_push_elem(struct bpf_map *map, void *value, u64 flags)
 	if (flags != BPF_ANY)
 		return -EINVAL;
 
+	if (bloom->blocked) {
+		bloom_map_push_elem_blocked(bloom, value);
+		return 0;
+	}
+
 	for (i = 0; i < bloom->nr_hash_funcs; i++) {
 		h = hash(bloom, value, map->value_size, i);
 		set_bit(h, bloom->bitset);
@@ -102,13 +171,10 @@ static struct bpf_map *bloom_map_alloc(union bpf_attr *attr)
 	    attr->max_entries == 0 ||
 	    attr->map_flags & ~BLOOM_CREATE_FLAG_MASK ||
 	    !bpf_map_flags_access_ok(attr->map_flags) ||
-	    /* The lower 4 bits of map_extra (0xF) specify the number
-	     * of hash functions
-	     */
-	    (attr->map_extra & ~0xF))
+	    (attr->map_extra & ~BLOOM_MAP_EXTRA_MASK))
 		return ERR_PTR(-EINVAL);
 
-	nr_hash_funcs = attr->map_extra;
+	nr_hash_funcs = attr->map_extra & 0xF;
 	if (nr_hash_funcs == 0)
 		/* Default to using 5 hash functions if unspecified */
 		nr_hash_funcs = 5;
@@ -123,6 +189,11 @@ static struct bpf_map *bloom_map_alloc(union bpf_attr *attr)
 	 *
 	 * If this overflows a u32, the bit array size will have 2^32 (4
 	 * GB) bits.
+	 *
+	 * The blocked layout uses the same sizing. Confining the bits of a
+	 * value to one block raises the false positive rate slightly, which
+	 * the power of two round up mostly absorbs; the array is never
+	 * smaller than one block.
 	 */
 	if (check_mul_overflow(attr->max_entries, nr_hash_funcs, &nr_bits) ||
 	    check_mul_overflow(nr_bits / 5, (u32)7, &nr_bits) ||
@@ -134,7 +205,10 @@ static struct bpf_map *bloom_map_alloc(union bpf_attr *attr)
 		bitset_bytes = BITS_TO_BYTES(U32_MAX);
 		bitset_mask = U32_MAX;
 	} else {
-		if (nr_bits <= BITS_PER_LONG)
+		if (attr->map_extra & BPF_BLOOM_BLOCKED &&
+		    nr_bits <= BLOOM_BLOCK_BITS)
+			nr_bits = BLOOM_BLOCK_BITS;
+		else if (nr_bits <= BITS_PER_LONG)
 			nr_bits = BITS_PER_LONG;
 		else
 			nr_bits = roundup_pow_of_two(nr_bits);
@@ -152,6 +226,7 @@ static struct bpf_map *bloom_map_alloc(union bpf_attr *attr)
 
 	bloom->nr_hash_funcs = nr_hash_funcs;
 	bloom->bitset_mask = bitset_mask;
+	bloom->blocked = !!(attr->map_extra & BPF_BLOOM_BLOCKED);
 
 	if (!(attr->map_flags & BPF_F_ZERO_SEED))
 		bloom->hash_seed = get_random_u32();
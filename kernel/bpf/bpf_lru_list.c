@@ -401,25 +401,101 @@ __local_list_pop_pending(struct bpf_lru *lru, struct bpf_lru_locallist *loc_l)
 	return NULL;
 }
 
-static struct bpf_lru_node *bpf_percpu_lru_pop_free(struct bpf_lru *lru,
-						    u32 hash)
+/* Move up to PERCPU_FREE_TARGET free nodes from the LRU list of a
+ * remote CPU to steal_list.  If the remote list has none and shrink is
+ * set, shrink it instead.  The stolen nodes are off every LRU list when
+ * this returns, so nobody else can look at node->cpu until they are
+ * added back.
+ */
+static unsigned int bpf_percpu_lru_steal(struct bpf_lru *lru,
+					 struct bpf_lru_list *rl,
+					 struct list_head *steal_list,
+					 bool shrink)
+{
+	struct bpf_lru_node *node, *tmp_node;
+	unsigned int nstolen = 0;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&rl->lock, flags);
+
+	list_for_each_entry_safe(node, tmp_node, &rl->lists[BPF_LRU_LIST_T_FREE],
+				 list) {
+		list_move(&node->list, steal_list);
+		if (++nstolen == PERCPU_FREE_TARGET)
+			break;
+	}
+
+	if (!nstolen && shrink) {
+		__bpf_lru_list_rotate(lru, rl);
+		nstolen = __bpf_lru_list_shrink(lru, rl, PERCPU_FREE_TARGET,
+						steal_list, BPF_LRU_LIST_T_FREE);
+	}
+
+	raw_spin_unlock_irqrestore(&rl->lock, flags);
+
+	return nstolen;
+}
+
+/* Steal a batch of nodes for the local LRU list from the remote CPUs
+ * in RR, starting with l->next_steal.  Without shrink only free nodes
+ * are taken, with it the first remote list that has evictable nodes is
+ * shrunk.  Only one list lock is held at a time.
+ */
+static bool bpf_percpu_lru_refill(struct bpf_lru *lru,
+				  struct bpf_lru_list *l, int cpu,
+				  bool shrink)
+{
+	struct bpf_lru_node *node;
+	int steal, first_steal;
+	LIST_HEAD(steal_list);
+	unsigned long flags;
+
+	first_steal = READ_ONCE(l->next_steal);
+	steal = first_steal;
+	do {
+		if (steal != cpu &&
+		    bpf_percpu_lru_steal(lru, per_cpu_ptr(lru->percpu_lru, steal),
+					 &steal_list, shrink))
+			break;
+		steal = get_next_cpu(steal);
+	} while (steal != first_steal);
+
+	WRITE_ONCE(l->next_steal, get_next_cpu(steal));
+
+	if (list_empty(&steal_list))
+		return false;
+
+	list_for_each_entry(node, &steal_list, list)
+		node->cpu = cpu;
+
+	raw_spin_lock_irqsave(&l->lock, flags);
+	list_splice(&steal_list, &l->lists[BPF_LRU_LIST_T_FREE]);
+	raw_spin_unlock_irqrestore(&l->lock, flags);
+
+	return true;
+}
+
+static struct bpf_lru_node *__bpf_percpu_lru_pop_free(struct bpf_lru *lru,
+						      struct bpf_lru_list *l,
+						      u32 hash, bool force)
 {
 	struct list_head *free_list;
 	struct bpf_lru_node *node = NULL;
-	struct bpf_lru_list *l;
 	unsigned long flags;
-	int cpu = raw_smp_processor_id();
-
-	l = per_cpu_ptr(lru->percpu_lru, cpu);
 
 	raw_spin_lock_irqsave(&l->lock, flags);
 
+	free_list = &l->lists[BPF_LRU_LIST_T_FREE];
 	__bpf_lru_list_rotate(lru, l);
 
-	free_list = &l->lists[BPF_LRU_LIST_T_FREE];
-	if (list_empty(free_list))
-		__bpf_lru_list_shrink(lru, l, PERCPU_FREE_TARGET, free_list,
-				      BPF_LRU_LIST_T_FREE);
+	if (list_empty(free_list)) {
+		if (force)
+			__bpf_lru_list_shrink(lru, l, PERCPU_FREE_TARGET,
+					      free_list, BPF_LRU_LIST_T_FREE);
+		else
+			__bpf_lru_list_shrink_inactive(lru, l, PERCPU_FREE_TARGET,
+						       free_list, BPF_LRU_LIST_T_FREE);
+	}
 
 	if (!list_empty(free_list)) {
 		node = list_first_entry(free_list, struct bpf_lru_node, list);
@@ -433,6 +509,40 @@ static struct bpf_lru_node *bpf_percpu_lru_pop_free(struct bpf_lru *lru,
 	return node;
 }
 
+static struct bpf_lru_node *bpf_percpu_lru_pop_free(struct bpf_lru *lru,
+						    u32 hash)
+{
+	struct bpf_lru_node *node;
+	struct bpf_lru_list *l;
+	int cpu = raw_smp_processor_id();
+
+	l = per_cpu_ptr(lru->percpu_lru, cpu);
+
+	/* Evict a cold local node first. */
+	node = __bpf_percpu_lru_pop_free(lru, l, hash, false);
+	if (node)
+		return node;
+
+	/* Every local node is referenced.  Rather than force evicting
+	 * our own hot nodes, take free nodes idling on other CPUs.
+	 */
+	if (bpf_percpu_lru_refill(lru, l, cpu, false)) {
+		node = __bpf_percpu_lru_pop_free(lru, l, hash, false);
+		if (node)
+			return node;
+	}
+
+	node = __bpf_percpu_lru_pop_free(lru, l, hash, true);
+	if (node)
+		return node;
+
+	/* We own no evictable node at all, shrink a remote list. */
+	if (!bpf_percpu_lru_refill(lru, l, cpu, true))
+		return NULL;
+
+	return __bpf_percpu_lru_pop_free(lru, l, hash, false);
+}
+
 static struct bpf_lru_node *bpf_common_lru_pop_free(struct bpf_lru *lru,
 						    u32 hash)
 {
@@ -633,7 +743,7 @@ static void bpf_lru_locallist_init(struct bpf_lru_locallist *loc_l, int cpu)
 	raw_spin_lock_init(&loc_l->lock);
 }
 
-static void bpf_lru_list_init(struct bpf_lru_list *l)
+static void bpf_lru_list_init(struct bpf_lru_list *l, int cpu)
 {
 	int i;
 
@@ -644,6 +754,7 @@ static void bpf_lru_list_init(struct bpf_lru_list *l)
 		l->counts[i] = 0;
 
 	l->next_inactive_rotation = &l->lists[BPF_LRU_LIST_T_INACTIVE];
+	l->next_steal = cpu;
 
 	raw_spin_lock_init(&l->lock);
 }
@@ -662,7 +773,7 @@ int bpf_lru_init(struct bpf_lru *lru, bool percpu, u32 hash_offset,
 			struct bpf_lru_list *l;
 
 			l = per_cpu_ptr(lru->percpu_lru, cpu);
-			bpf_lru_list_init(l);
+			bpf_lru_list_init(l, cpu);
 		}
 		lru->nr_scans = PERCPU_NR_SCANS;
 	} else {
@@ -679,7 +790,7 @@ int bpf_lru_init(struct bpf_lru *lru, bool percpu, u32 hash_offset,
 			bpf_lru_locallist_init(loc_l, cpu);
 		}
 
-		bpf_lru_list_init(&clru->lru_list);
+		bpf_lru_list_init(&clru->lru_list, 0);
 		lru->nr_scans = LOCAL_NR_SCANS;
 	}
 
@@ -33,6 +33,8 @@ struct bpf_lru_list {
 	unsigned int counts[NR_BPF_LRU_LIST_COUNT];
 	/* The next inactive list rotation starts from here */
 	struct list_head *next_inactive_rotation;
+	/* percpu LRU only: the next CPU to steal free nodes from */
+	u16 next_steal;
 
 	raw_spinlock_t lock ____cacheline_aligned_in_smp;
 };
@@ -32,8 +32,9 @@
 #include <trace/events/xdp.h>
 #include <linux/btf_ids.h>
 
-#include <linux/netdevice.h>   /* netif_receive_skb_list */
+#include <linux/netdevice.h>   /* napi_gro_receive */
 #include <linux/etherdevice.h> /* eth_type_trans */
+#include <net/gro.h>           /* gro_normal_list */
 
 /* General idea: XDP packets getting XDP redirected to another CPU,
  * will maximum be stored/queued for one driver ->poll() call.  It is
@@ -70,6 +71,10 @@ struct bpf_cpu_map_entry {
 
 	struct completion kthread_running;
 	struct rcu_work free_work;
+
+	/* GRO context of the kthread, never scheduled as a real NAPI */
+	struct napi_struct napi;
+	struct net_device napi_dev;
 };
 
 struct bpf_cpu_map {
@@ -234,6 +239,7 @@ static int cpu_map_bpf_prog_run_xdp(struct bpf_cpu_map_entry *rcpu,
 }
 
 #define CPUMAP_BATCH 8
+#define CPUMAP_BATCH_MAX 32
 
 static int cpu_map_bpf_prog_run(struct bpf_cpu_map_entry *rcpu, void **frames,
 				int xdp_n, struct xdp_cpumap_stats *stats,
@@ -259,10 +265,33 @@ static int cpu_map_bpf_prog_run(struct bpf_cpu_map_entry *rcpu, void **frames,
 	return nframes;
 }
 
+static unsigned int cpu_map_gro_receive(struct bpf_cpu_map_entry *rcpu,
+					struct list_head *list)
+{
+	struct sk_buff *skb, *tmp;
+	unsigned int n = 0;
+
+	list_for_each_entry_safe(skb, tmp, list, list) {
+		skb_list_del_init(skb);
+		napi_gro_receive(&rcpu->napi, skb);
+		n++;
+	}
+
+	return n;
+}
+
+static void cpu_map_gro_flush(struct bpf_cpu_map_entry *rcpu)
+{
+	napi_gro_flush(&rcpu->napi, false);
+	gro_normal_list(&rcpu->napi);
+}
+
 static int cpu_map_kthread_run(void *data)
 {
 	struct bpf_cpu_map_entry *rcpu = data;
 	unsigned long last_qs = jiffies;
+	unsigned int batch = CPUMAP_BATCH;
+	unsigned int gro_pending = 0;
 
 	complete(&rcpu->kthread_running);
 	set_current_state(TASK_INTERRUPTIBLE);
@@ -277,8 +306,8 @@ static int cpu_map_kthread_run(void *data)
 		unsigned int kmem_alloc_drops = 0, sched = 0;
 		gfp_t gfp = __GFP_ZERO | GFP_ATOMIC;
 		int i, n, m, nframes, xdp_n;
-		void *frames[CPUMAP_BATCH];
-		void *skbs[CPUMAP_BATCH];
+		void *frames[CPUMAP_BATCH_MAX];
+		void *skbs[CPUMAP_BATCH_MAX];
 		LIST_HEAD(list);
 
 		/* Release CPU reschedule checks */
@@ -302,8 +331,16 @@ static int cpu_map_kthread_run(void *data)
 		 * kthread CPU pinned. Lockless access to ptr_ring
 		 * consume side valid as no-resize allowed of queue.
 		 */
-		n = __ptr_ring_consume_batched(rcpu->queue, frames,
-					       CPUMAP_BATCH);
+		n = __ptr_ring_consume_batched(rcpu->queue, frames, batch);
+
+		/* Grow the batch while the ring stays backlogged, fall back
+		 * to the small one as soon as it is drained.
+		 */
+		if (n == batch)
+			batch = min_t(unsigned int, batch * 2, CPUMAP_BATCH_MAX);
+		else
+			batch = CPUMAP_BATCH;
+
 		for (i = 0, xdp_n = 0; i < n; i++) {
 			void *f = frames[i];
 			struct page *page;
@@ -351,7 +388,19 @@ static int cpu_map_kthread_run(void *data)
 
 			list_add_tail(&skb->list, &list);
 		}
-		netif_receive_skb_list(&list);
+
+		gro_pending += cpu_map_gro_receive(rcpu, &list);
+
+		/* Keep aggregating across batches while the ring is
+		 * backlogged, like a NAPI poll would within its budget.
+		 * Flush once the ring is drained, so that a lone packet is
+		 * not held back.
+		 */
+		if (gro_pending >= NAPI_POLL_WEIGHT ||
+		    __ptr_ring_empty(rcpu->queue)) {
+			cpu_map_gro_flush(rcpu);
+			gro_pending = 0;
+		}
 
 		/* Feedback loop via tracepoint */
 		trace_xdp_cpumap_kthread(rcpu->map_id, n, kmem_alloc_drops,
@@ -429,13 +478,20 @@ __cpu_map_entry_alloc(struct bpf_map *map, struct bpf_cpumap_val *value,
 	if (fd > 0 && __cpu_map_load_bpf_program(rcpu, map, fd))
 		goto free_ptr_ring;
 
+	/* The GRO context is private to the kthread, keep it out of the
+	 * busy polling NAPI hash.
+	 */
+	init_dummy_netdev(&rcpu->napi_dev);
+	set_bit(NAPI_STATE_NO_BUSY_POLL, &rcpu->napi.state);
+	netif_napi_add(&rcpu->napi_dev, &rcpu->napi, NULL);
+
 	/* Setup kthread */
 	init_completion(&rcpu->kthread_running);
 	rcpu->kthread = kthread_create_on_node(cpu_map_kthread_run, rcpu, numa,
 					       "cpumap/%d/map:%d", cpu,
 					       map->id);
 	if (IS_ERR(rcpu->kthread))
-		goto free_prog;
+		goto del_napi;
 
 	/* Make sure kthread runs on a single CPU */
 	kthread_bind(rcpu->kthread, cpu);
@@ -449,7 +505,8 @@ __cpu_map_entry_alloc(struct bpf_map *map, struct bpf_cpumap_val *value,
 
 	return rcpu;
 
-free_prog:
+del_napi:
+	netif_napi_del(&rcpu->napi);
 	if (rcpu->prog)
 		bpf_prog_put(rcpu->prog);
 free_ptr_ring:
@@ -479,6 +536,7 @@ static void __cpu_map_entry_free(struct work_struct *work)
 	 * before exiting.
 	 */
 	kthread_stop(rcpu->kthread);
+	netif_napi_del(&rcpu->napi);
 
 	if (rcpu->prog)
 		bpf_prog_put(rcpu->prog);
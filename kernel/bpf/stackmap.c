@@ -4,11 +4,13 @@
 #include <linux/bpf.h>
 #include <linux/jhash.h>
 #include <linux/filter.h>
+#include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/stacktrace.h>
 #include <linux/perf_event.h>
 #include <linux/btf_ids.h>
 #include <linux/buildid.h>
+#include <linux/hash.h>
 #include "percpu_freelist.h"
 #include "mmap_unlock_work.h"
 
@@ -31,6 +33,81 @@ struct bpf_stack_map {
 	struct stack_map_bucket *buckets[];
 };
 
+/* Small per-CPU cache of the build IDs of recently seen executables, so
+ * that build_id stack maps don't parse the ELF notes of the same file
+ * on every stack capture.  Entries are keyed by the backing inode; the
+ * inode pointer is never dereferenced from the cache, and the inode
+ * number, generation and ctime catch both inode reuse and a rewritten
+ * file.
+ */
+#define BUILD_ID_CACHE_BITS	4
+#define BUILD_ID_CACHE_SIZE	(1 << BUILD_ID_CACHE_BITS)
+
+struct build_id_cache_entry {
+	const struct inode *inode;
+	unsigned long ino;
+	u32 generation;
+	struct timespec64 ctime;
+	unsigned char build_id[BUILD_ID_SIZE_MAX];
+};
+
+static DEFINE_PER_CPU(struct build_id_cache_entry[BUILD_ID_CACHE_SIZE],
+		      build_id_cache);
+static DEFINE_PER_CPU(int, build_id_cache_busy);
+
+static bool build_id_cache_match(const struct build_id_cache_entry *ent,
+				 const struct inode *inode,
+				 const struct timespec64 *ctime)
+{
+	return ent->inode == inode && ent->ino == inode->i_ino &&
+	       ent->generation == inode->i_generation &&
+	       timespec64_equal(&ent->ctime, ctime);
+}
+
+/* Same as build_id_parse(), but served from the per-CPU cache when the
+ * file was seen before.  If the cache is already in use on this CPU
+ * (e.g. we interrupted another stack capture from NMI), bypass it.
+ */
+static int stack_map_build_id_parse(struct vm_area_struct *vma,
+				    unsigned char *build_id)
+{
+	struct build_id_cache_entry *ent;
+	struct timespec64 ctime;
+	struct inode *inode;
+	int err;
+
+	if (!vma->vm_file)
+		return -EINVAL;
+
+	migrate_disable();
+	if (unlikely(this_cpu_inc_return(build_id_cache_busy) != 1)) {
+		err = build_id_parse(vma, build_id, NULL);
+		goto out;
+	}
+
+	inode = file_inode(vma->vm_file);
+	ctime = inode_get_ctime(inode);
+	ent = this_cpu_ptr(&build_id_cache[hash_ptr(inode, BUILD_ID_CACHE_BITS)]);
+	if (build_id_cache_match(ent, inode, &ctime)) {
+		memcpy(build_id, ent->build_id, BUILD_ID_SIZE_MAX);
+		err = 0;
+		goto out;
+	}
+
+	err = build_id_parse(vma, build_id, NULL);
+	if (!err) {
+		ent->inode = inode;
+		ent->ino = inode->i_ino;
+		ent->generation = inode->i_generation;
+		ent->ctime = ctime;
+		memcpy(ent->build_id, build_id, BUILD_ID_SIZE_MAX);
+	}
+out:
+	this_cpu_dec(build_id_cache_busy);
+	migrate_enable();
+	return err;
+}
+
 static inline bool stack_map_use_build_id(struct bpf_map *map)
 {
 	return (map->map_flags & BPF_F_STACK_BUILD_ID);
@@ -156,7 +233,7 @@ static void stack_map_get_build_id_offset(struct bpf_stack_build_id *id_offs,
 			goto build_id_valid;
 		}
 		vma = find_vma(current->mm, ips[i]);
-		if (!vma || build_id_parse(vma, id_offs[i].build_id, NULL)) {
+		if (!vma || stack_map_build_id_parse(vma, id_offs[i].build_id)) {
 			/* per entry fall back to ips */
 			id_offs[i].status = BPF_STACK_BUILD_ID_IP;
 			id_offs[i].ip = ips[i];
@@ -16754,6 +16754,17 @@ static int is_state_visited(struct bpf_verifier_env *env, int insn_idx)
 				update_loop_entry(cur, loop_entry);
 hit:
 			sl->hit_cnt++;
+			env->prune_hits++;
+			/* Programs with many similar branches tend to prune
+			 * against the same few states over and over. Keep the
+			 * state that just hit at the head of its list, so
+			 * that the next lookup compares against it first.
+			 */
+			if (pprev != explored_state(env, insn_idx)) {
+				*pprev = sl->next;
+				sl->next = *explored_state(env, insn_idx);
+				*explored_state(env, insn_idx) = sl;
+			}
 			/* reached equivalent register/stack state,
 			 * prune the search.
 			 * Registers read by the continuation are read by us.
@@ -16778,6 +16789,7 @@ static int is_state_visited(struct bpf_verifier_env *env, int insn_idx)
 			return 1;
 		}
 miss:
+		env->prune_misses++;
 		/* when new state is not going to be added do not increase miss count.
 		 * Otherwise several loop iterations will remove the state
 		 * recorded earlier. The goal of these heuristics is to have
@@ -16849,6 +16861,7 @@ static int is_state_visited(struct bpf_verifier_env *env, int insn_idx)
 		return -ENOMEM;
 	env->total_states++;
 	env->peak_states++;
+	env->insn_aux_data[insn_idx].states_cnt++;
 	env->prev_jmps_processed = env->jmps_processed;
 	env->prev_insn_processed = env->insn_processed;
 
@@ -19704,6 +19717,40 @@ static int do_check_main(struct bpf_verifier_env *env)
 }
 
 
+#define STATS_TOP_INSNS 5
+
+/* Print the instructions that accumulated the most saved states. These
+ * are where state pruning fails and verification time goes, so they are
+ * the first place to look when a program takes long to verify.
+ */
+static void print_state_hotspots(struct bpf_verifier_env *env)
+{
+	struct bpf_insn_aux_data *aux = env->insn_aux_data;
+	u32 top[STATS_TOP_INSNS];
+	int i, j, n = 0;
+
+	for (i = 0; i < env->prog->len; i++) {
+		if (!aux[i].states_cnt)
+			continue;
+		for (j = n; j > 0 && aux[top[j - 1]].states_cnt < aux[i].states_cnt; j--)
+			if (j < STATS_TOP_INSNS)
+				top[j] = top[j - 1];
+		if (j < STATS_TOP_INSNS) {
+			top[j] = i;
+			if (n < STATS_TOP_INSNS)
+				n++;
+		}
+	}
+
+	if (!n)
+		return;
+
+	verbose(env, "states per insn");
+	for (i = 0; i < n; i++)
+		verbose(env, " %d:%u", aux[top[i]].orig_idx, aux[top[i]].states_cnt);
+	verbose(env, "\n");
+}
+
 static void print_verification_stats(struct bpf_verifier_env *env)
 {
 	int i;
@@ -19720,6 +19767,9 @@ static void print_verification_stats(struct bpf_verifier_env *env)
 				verbose(env, "+");
 		}
 		verbose(env, "\n");
+		verbose(env, "prune hits %u misses %u\n",
+			env->prune_hits, env->prune_misses);
+		print_state_hotspots(env);
 	}
 	verbose(env, "processed %d insns (limit %d) max_states_per_insn %d "
 		"total_states %d peak_states %d mark_read %d\n",
@@ -8,6 +8,7 @@
 #include <linux/random.h>
 #include <linux/sbitmap.h>
 #include <linux/seq_file.h>
+#include <linux/topology.h>
 
 static int init_alloc_hint(struct sbitmap *sb, gfp_t flags)
 {
@@ -26,6 +27,18 @@ static int init_alloc_hint(struct sbitmap *sb, gfp_t flags)
 	return 0;
 }
 
+/* Where this CPU's hint starts over: the start of its cluster's range. */
+static inline unsigned int alloc_hint_home(struct sbitmap *sb,
+					   unsigned int depth)
+{
+	unsigned int home;
+
+	if (!sb->cluster)
+		return 0;
+	home = this_cpu_read(sb->cluster->start);
+	return home < depth ? home : 0;
+}
+
 static inline unsigned update_alloc_hint_before_get(struct sbitmap *sb,
 						    unsigned int depth)
 {
@@ -33,7 +46,10 @@ static inline unsigned update_alloc_hint_before_get(struct sbitmap *sb,
 
 	hint = this_cpu_read(*sb->alloc_hint);
 	if (unlikely(hint >= depth)) {
-		hint = depth ? get_random_u32_below(depth) : 0;
+		if (sb->cluster)
+			hint = alloc_hint_home(sb, depth);
+		else
+			hint = depth ? get_random_u32_below(depth) : 0;
 		this_cpu_write(*sb->alloc_hint, hint);
 	}
 
@@ -47,12 +63,17 @@ static inline void update_alloc_hint_after_get(struct sbitmap *sb,
 {
 	if (nr == -1) {
 		/* If the map is full, a hint won't do us much good. */
-		this_cpu_write(*sb->alloc_hint, 0);
+		this_cpu_write(*sb->alloc_hint, alloc_hint_home(sb, depth));
 	} else if (nr == hint || unlikely(sb->round_robin)) {
 		/* Only update the hint if we used it. */
 		hint = nr + 1;
 		if (hint >= depth - 1)
 			hint = 0;
+		/* and keep it within our cluster's words */
+		if (sb->cluster &&
+		    (hint < this_cpu_read(sb->cluster->start) ||
+		     hint >= this_cpu_read(sb->cluster->end)))
+			hint = alloc_hint_home(sb, depth);
 		this_cpu_write(*sb->alloc_hint, hint);
 	}
 }
@@ -97,6 +118,7 @@ int sbitmap_init_node(struct sbitmap *sb, unsigned int depth, int shift,
 	sb->depth = depth;
 	sb->map_nr = DIV_ROUND_UP(sb->depth, bits_per_word);
 	sb->round_robin = round_robin;
+	sb->cluster = NULL;
 
 	if (depth == 0) {
 		sb->map = NULL;
@@ -130,9 +152,76 @@ void sbitmap_resize(struct sbitmap *sb, unsigned int depth)
 
 	sb->depth = depth;
 	sb->map_nr = DIV_ROUND_UP(sb->depth, bits_per_word);
+
+	if (sb->cluster)
+		sbitmap_spread_alloc_hints(sb);
 }
 EXPORT_SYMBOL_GPL(sbitmap_resize);
 
+static unsigned int sbitmap_cluster_leader(unsigned int cpu)
+{
+	unsigned int leader = cpumask_first(topology_cluster_cpumask(cpu));
+
+	return leader < nr_cpu_ids ? leader : cpu;
+}
+
+static void sbitmap_set_cluster(struct sbitmap *sb, unsigned int cpu,
+				unsigned int word, unsigned int nr_words,
+				unsigned int hint_word)
+{
+	struct sbitmap_cluster *c = per_cpu_ptr(sb->cluster, cpu);
+
+	c->start = min(word << sb->shift, sb->depth - 1);
+	c->end = max(min((word + nr_words) << sb->shift, sb->depth),
+		     c->start + 1);
+	data_race(*per_cpu_ptr(sb->alloc_hint, cpu) =
+		  min(hint_word << sb->shift, sb->depth - 1));
+}
+
+void sbitmap_spread_alloc_hints(struct sbitmap *sb)
+{
+	unsigned int nr_clusters = 0, cluster = 0, cpu, i;
+
+	if (!sb->alloc_hint || sb->round_robin || !sb->map_nr)
+		return;
+
+	if (!sb->cluster) {
+		sb->cluster = alloc_percpu_gfp(struct sbitmap_cluster,
+					       GFP_NOIO | __GFP_NOWARN);
+		if (!sb->cluster)
+			return;
+	}
+
+	for_each_possible_cpu(cpu)
+		if (sbitmap_cluster_leader(cpu) == cpu)
+			nr_clusters++;
+
+	for_each_possible_cpu(cpu) {
+		const struct cpumask *mask = topology_cluster_cpumask(cpu);
+		unsigned int word, nr_words, size, rank = 0;
+
+		if (sbitmap_cluster_leader(cpu) != cpu)
+			continue;
+
+		/* the cluster's words, spread over its CPUs */
+		word = cluster * sb->map_nr / nr_clusters;
+		nr_words = (cluster + 1) * sb->map_nr / nr_clusters - word;
+		nr_words = max(nr_words, 1U);
+		cluster++;
+
+		if (!cpumask_test_cpu(cpu, mask)) {
+			sbitmap_set_cluster(sb, cpu, word, nr_words, word);
+			continue;
+		}
+
+		size = cpumask_weight_and(mask, cpu_possible_mask);
+		for_each_cpu_and(i, mask, cpu_possible_mask)
+			sbitmap_set_cluster(sb, i, word, nr_words,
+					    word + rank++ * nr_words / size);
+	}
+}
+EXPORT_SYMBOL_GPL(sbitmap_spread_alloc_hints);
+
 static int __sbitmap_get_word(unsigned long *word, unsigned long depth,
 			      unsigned int hint, bool wrap)
 {
@@ -602,8 +691,16 @@ EXPORT_SYMBOL_GPL(sbitmap_queue_wake_up);
 
 static inline void sbitmap_update_cpu_hint(struct sbitmap *sb, int cpu, int tag)
 {
-	if (likely(!sb->round_robin && tag < sb->depth))
+	if (likely(!sb->round_robin && tag < sb->depth)) {
+		/* a tag freed outside the CPU's cluster doesn't move its hint */
+		if (sb->cluster) {
+			struct sbitmap_cluster *c = per_cpu_ptr(sb->cluster, cpu);
+
+			if (tag < data_race(c->start) || tag >= data_race(c->end))
+				return;
+		}
 		data_race(*per_cpu_ptr(sb->alloc_hint, cpu) = tag);
+	}
 }
 
 void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq, int offset,
@@ -719,6 +816,7 @@ void sbitmap_queue_show(struct sbitmap_queue *sbq, struct seq_file *m)
 	seq_puts(m, "}\n");
 
 	seq_printf(m, "round_robin=%d\n", sbq->sb.round_robin);
+	seq_printf(m, "cluster_hints=%d\n", !!sbq->sb.cluster);
 	seq_printf(m, "min_shallow_depth=%u\n", sbq->min_shallow_depth);
 }
 EXPORT_SYMBOL_GPL(sbitmap_queue_show);
@@ -86,6 +86,99 @@ static void test_success_cases(void)
 	close(fd);
 }
 
+static void test_blocked_cases(void)
+{
+	LIBBPF_OPTS(bpf_map_create_opts, opts);
+	__u32 value, i;
+	int fd, err;
+
+	/* Unknown map_extra bits */
+	opts.map_extra = 1ULL << 5;
+	fd = bpf_map_create(BPF_MAP_TYPE_BLOOM_FILTER, NULL, 0, sizeof(value), 100, &opts);
+	if (!ASSERT_LT(fd, 0, "bpf_map_create bloom filter invalid map_extra"))
+		close(fd);
+
+	opts.map_extra = BPF_BLOOM_BLOCKED | 3;
+	fd = bpf_map_create(BPF_MAP_TYPE_BLOOM_FILTER, NULL, 0, sizeof(value), 100, &opts);
+	if (!ASSERT_GE(fd, 0, "bpf_map_create blocked bloom filter"))
+		return;
+
+	for (i = 0; i < 100; i++) {
+		value = i * 7919;
+		err = bpf_map_update_elem(fd, NULL, &value, 0);
+		if (!ASSERT_OK(err, "bpf_map_update_elem blocked bloom filter"))
+			goto done;
+	}
+
+	/* A bloom filter has no false negatives */
+	for (i = 0; i < 100; i++) {
+		value = i * 7919;
+		err = bpf_map_lookup_elem(fd, NULL, &value);
+		if (!ASSERT_OK(err, "bpf_map_lookup_elem blocked bloom filter"))
+			goto done;
+	}
+
+done:
+	close(fd);
+}
+
+#define FP_NR_ENTRIES	1000
+#define FP_NR_PROBES	20000
+
+/* Fill a filter to capacity and count hits for values never inserted */
+static int count_false_positives(__u64 map_extra)
+{
+	LIBBPF_OPTS(bpf_map_create_opts, opts);
+	int fd, err, nr_fp = 0;
+	__u32 value, i;
+
+	opts.map_flags = BPF_F_ZERO_SEED;
+	opts.map_extra = map_extra;
+	fd = bpf_map_create(BPF_MAP_TYPE_BLOOM_FILTER, NULL, 0, sizeof(value),
+			    FP_NR_ENTRIES, &opts);
+	if (!ASSERT_GE(fd, 0, "bpf_map_create bloom filter fp rate"))
+		return -1;
+
+	/* Insert even values, probe odd ones */
+	for (i = 0; i < FP_NR_ENTRIES; i++) {
+		value = i * 2;
+		err = bpf_map_update_elem(fd, NULL, &value, 0);
+		if (!ASSERT_OK(err, "bpf_map_update_elem bloom filter fp rate")) {
+			nr_fp = -1;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < FP_NR_PROBES; i++) {
+		value = i * 2 + 1;
+		if (!bpf_map_lookup_elem(fd, NULL, &value))
+			nr_fp++;
+	}
+
+done:
+	close(fd);
+	return nr_fp;
+}
+
+static void test_blocked_fp_rate(void)
+{
+	int classic, blocked;
+
+	classic = count_false_positives(3);
+	blocked = count_false_positives(BPF_BLOOM_BLOCKED | 3);
+	if (classic < 0 || blocked < 0)
+		return;
+
+	/*
+	 * Both layouts use the same bitmap, which gives the classic one
+	 * about 3% false positives here.  Confining a value's bits to one
+	 * block costs a bit more than that, while a poorly distributed
+	 * block or bit choice costs a lot more.
+	 */
+	ASSERT_LE(classic, FP_NR_PROBES / 10, "classic fp rate");
+	ASSERT_LE(blocked, 2 * classic + FP_NR_PROBES / 100, "blocked fp rate");
+}
+
 static void check_bloom(struct bloom_filter_map *skel)
 {
 	struct bpf_link *link;
@@ -205,6 +298,8 @@ void test_bloom_filter_map(void)
 
 	test_fail_cases();
 	test_success_cases();
+	test_blocked_cases();
+	test_blocked_fp_rate();
 
 	err = setup_progs(&skel, &rand_vals, &nr_rand_vals);
 	if (err)
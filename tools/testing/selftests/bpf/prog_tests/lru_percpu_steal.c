@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+#include <sched.h>
+#include <test_progs.h>
+
+/* Nodes owned by each CPU */
+#define NR_PER_CPU	16
+/* Inserts past the CPU's share, one steal batch worth */
+#define NR_SKEWED	4
+
+/* A CPU that inserts more than its share of a BPF_F_NO_COMMON_LRU map
+ * while all of its own entries are hot must take free nodes from the
+ * idle CPUs instead of evicting those entries.
+ */
+void test_lru_percpu_steal(void)
+{
+	LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = BPF_F_NO_COMMON_LRU);
+	int nr_cpus = libbpf_num_possible_cpus();
+	cpu_set_t old, new;
+	__u64 *values;
+	__u32 key;
+	int fd, cpu, err;
+
+	if (!ASSERT_GT(nr_cpus, 0, "nr_cpus"))
+		return;
+	if (nr_cpus < 2) {
+		test__skip();
+		return;
+	}
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!ASSERT_OK_PTR(values, "calloc values"))
+		return;
+
+	/* Keep every insert on the same CPU */
+	cpu = sched_getcpu();
+	if (!ASSERT_GE(cpu, 0, "sched_getcpu"))
+		goto free_values;
+	CPU_ZERO(&new);
+	CPU_SET(cpu, &new);
+	err = sched_getaffinity(getpid(), sizeof(old), &old);
+	if (!ASSERT_OK(err, "getaffinity"))
+		goto free_values;
+	err = sched_setaffinity(getpid(), sizeof(new), &new);
+	if (!ASSERT_OK(err, "setaffinity"))
+		goto free_values;
+
+	fd = bpf_map_create(BPF_MAP_TYPE_LRU_PERCPU_HASH, NULL, sizeof(key),
+			    sizeof(*values), NR_PER_CPU * nr_cpus, &opts);
+	if (!ASSERT_GE(fd, 0, "bpf_map_create"))
+		goto restore_affinity;
+
+	/* Fill this CPU's share of the nodes */
+	for (key = 0; key < NR_PER_CPU; key++) {
+		err = bpf_map_update_elem(fd, &key, values, BPF_NOEXIST);
+		if (!ASSERT_OK(err, "fill"))
+			goto close_map;
+	}
+
+	/* Updating an existing element sets its reference bit */
+	for (key = 0; key < NR_PER_CPU; key++) {
+		err = bpf_map_update_elem(fd, &key, values, BPF_EXIST);
+		if (!ASSERT_OK(err, "reference"))
+			goto close_map;
+	}
+
+	for (key = NR_PER_CPU; key < NR_PER_CPU + NR_SKEWED; key++) {
+		err = bpf_map_update_elem(fd, &key, values, BPF_NOEXIST);
+		if (!ASSERT_OK(err, "skewed insert"))
+			goto close_map;
+	}
+
+	/* None of the hot entries may have been evicted */
+	for (key = 0; key < NR_PER_CPU + NR_SKEWED; key++) {
+		err = bpf_map_lookup_elem(fd, &key, values);
+		if (!ASSERT_OK(err, "lookup"))
+			break;
+	}
+
+close_map:
+	close(fd);
+restore_affinity:
+	sched_setaffinity(getpid(), sizeof(old), &old);
+free_values:
+	free(values);
+}